@@ -25,16 +25,58 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := audio.hidl_compat.default
 LOCAL_PROPRIETARY_MODULE := false
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SRC_FILES := audio_hw.cpp
+LOCAL_SRC_FILES := audio_hw.cpp \
+                   volume/audio_hw_volume.cpp
 
 LOCAL_SHARED_LIBRARIES := libbase \
                           liblog \
                           libcutils \
                           libutils \
-                          libaudiohal
+                          libaudiohal \
+                          libaudioutils
 
 LOCAL_HEADER_LIBRARIES := libhardware_headers
 
 LOCAL_CFLAGS := -Wno-unused-parameter
 
+# Set AUDIO_HW_TRACE := 0 to build the data path without the trace ring
+ifneq ($(AUDIO_HW_TRACE),)
+LOCAL_CFLAGS += -DAUDIO_HW_TRACE=$(AUDIO_HW_TRACE)
+endif
+
 include $(BUILD_SHARED_LIBRARY)
+
+# Host benchmark of the wrapper's own overhead, run against an in-process
+# fake libaudiohal with configurable injected latency
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_bench
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := audio_hw.cpp \
+                   volume/audio_hw_volume.cpp \
+                   bench/fake_audiohal.cpp \
+                   bench/audio_hw_bench.cpp
+
+LOCAL_SHARED_LIBRARIES := libbase \
+                          liblog \
+                          libcutils \
+                          libutils \
+                          libaudioutils
+
+LOCAL_HEADER_LIBRARIES := libhardware_headers \
+                          libaudiohal_headers
+
+LOCAL_CFLAGS := -Wno-unused-parameter
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Host decoder of the PCM tap files written with wrapper_tap=1
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_tap_decode
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := tap/audio_hw_tap_decode.cpp
+
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -15,421 +15,6000 @@
  */
 
 #define LOG_TAG "audio_hw_primary"
-#define LOG_NDEBUG 0
+/* Control-plane ALOGV calls are compiled in with -DLOG_NDEBUG=0 */
+#ifndef LOG_NDEBUG
+#define LOG_NDEBUG 1
+#endif
 
+/*
+ * Data-path tracing (out_write, in_read and position queries) never goes to
+ * logd. With AUDIO_HW_TRACE enabled, events can be recorded into an
+ * in-memory ring that adev_dump() prints; build with -DAUDIO_HW_TRACE=0 to
+ * compile the data path without any tracing at all.
+ */
+#ifndef AUDIO_HW_TRACE
+#define AUDIO_HW_TRACE 1
+#endif
+
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
 #include <log/log.h>
+#include <audio_utils/channels.h>
+#include <audio_utils/primitives.h>
+#include <audio_utils/resampler.h>
+#include <cutils/properties.h>
+#include <cutils/str_parms.h>
 #include <hardware/hardware.h>
 #include <system/audio.h>
 #include <hardware/audio.h>
 
 #include <media/audiohal/DeviceHalInterface.h>
 #include <media/audiohal/DevicesFactoryHalInterface.h>
+#include <media/audiohal/EffectsFactoryHalInterface.h>
 #include <media/audiohal/StreamHalInterface.h>
 
+#include "tap/audio_hw_tap.h"
+#include "volume/audio_hw_volume.h"
+
 using namespace android;
 
+/* Every wrapper-only parameter key starts with this */
+#define WRAPPER_PARAM_PREFIX "wrapper_"
+
+/* Runtime trace level: 0 disables the trace ring, 1 records data-path events */
+#define WRAPPER_PROP_TRACE_LEVEL "persist.halium.audio_hw.trace"
+#define WRAPPER_PARAM_TRACE_LEVEL "wrapper_trace_level"
+
+/* Asynchronous writer mode of PCM outputs, see out_async_write() */
+#define WRAPPER_PROP_ASYNC_WRITE "persist.halium.audio_hw.async_write"
+#define WRAPPER_PROP_ASYNC_PERIODS "persist.halium.audio_hw.async_periods"
+#define WRAPPER_PROP_ASYNC_PRIORITY "persist.halium.audio_hw.async_priority"
+#define WRAPPER_PARAM_ASYNC_WRITE "wrapper_async_write"
+#define WRAPPER_PARAM_ASYNC_PERIODS "wrapper_async_periods"
+/*
+ * Capture thread mode of PCM inputs, see in_async_read(): HAL periods read
+ * per burst, and bursts buffered in the ring.
+ */
+#define WRAPPER_PROP_ASYNC_READ "persist.halium.audio_hw.async_read"
+#define WRAPPER_PROP_ASYNC_READ_BURST "persist.halium.audio_hw.async_read_burst"
+#define WRAPPER_PROP_ASYNC_READ_BURSTS "persist.halium.audio_hw.async_read_bursts"
+#define WRAPPER_PARAM_ASYNC_READ "wrapper_async_read"
+/* Device key putting every open stream in standby at once, see adev_standby_all() */
+#define WRAPPER_PARAM_STANDBY_ALL "wrapper_standby_all"
+/* Workers of a bulk standby, used once standby() has been taking this long */
+#define STANDBY_ALL_WORKERS 3
+#define STANDBY_ALL_PARALLEL_NS 100000
+/* Stream wrappers preallocated per device; streams beyond these use the heap */
+#define WRAPPER_POOL_OUTPUTS 8
+#define WRAPPER_POOL_INPUTS 4
+/* Parameter strings kept per stream or device, enough for a route toggling back and forth */
+#define PARAM_STRINGS 4
+/*
+ * HAL module this wrapper stands in for (default: taken from the library
+ * name, audio.<module>.<variant>.so), and the extra modules streams are
+ * routed to when their devices belong there, as a comma separated list such
+ * as "a2dp,usb,r_submix" (default: none, every stream stays on the primary).
+ */
+#define WRAPPER_PROP_MODULE "ro.vendor.halium.audio_hw.module"
+#define WRAPPER_PROP_ROUTED_MODULES "persist.halium.audio_hw.modules"
+
+/*
+ * Outputs opened in the background ahead of the client, as a comma separated
+ * list of "primary", "deep_buffer" and "low_latency", on the devices given
+ * by the second property (default: speaker).
+ */
+#define WRAPPER_PROP_PREOPEN "persist.halium.audio_hw.preopen"
+#define WRAPPER_PROP_PREOPEN_DEVICES "persist.halium.audio_hw.preopen_devices"
+/* Pre-opened outputs use io handles the client never allocates */
+#define PREOPEN_HANDLE_BASE 0x7f000000
+
+/*
+ * Outputs opened on several devices at once (say speaker and HDMI) become
+ * duplicating outputs: one HAL stream per device, on the module the device
+ * routes to, all fed from a shared buffer of DUPLICATE_PERIODS periods.
+ * The stream of the lowest device bit paces the client.
+ */
+#define WRAPPER_PROP_DUPLICATE "persist.halium.audio_hw.duplicate"
+#define DUPLICATE_MAX_TARGETS 4
+#define DUPLICATE_PERIODS 8
+/*
+ * Secondary targets further behind the primary drop audio to catch up.
+ * Their clock drift against the primary is measured for the dumps only,
+ * not corrected, so a drifting target catches up that way too.
+ */
+#define DUPLICATE_MAX_LAG_PERIODS 2
+#define DUPLICATE_DRIFT_INTERVAL_MS 1000
+/* Secondary targets use io handles the client never allocates either */
+#define DUPLICATE_HANDLE_BASE 0x7e000000
+
+#define ASYNC_DEFAULT_PERIODS 4
+#define ASYNC_DEFAULT_PRIORITY 2
+#define ASYNC_READ_DEFAULT_BURST 2
+#define ASYNC_READ_DEFAULT_BURSTS 4
+
+/*
+ * Interval at which output positions are re-read from the HAL; in between
+ * they are extrapolated locally. 0 forwards every query.
+ */
+#define WRAPPER_PROP_POSITION_RESYNC_MS "persist.halium.audio_hw.position_resync_ms"
+#define WRAPPER_PARAM_POSITION_RESYNC_MS "wrapper_position_resync_ms"
+#define POSITION_DEFAULT_RESYNC_MS 100
+/* Shortest baseline, and largest deviation from the nominal rate, for drift estimates */
+#define POSITION_DRIFT_MIN_BASELINE_NS 1000000000LL
+#define POSITION_DRIFT_MAX_PPM 10000
+
+/*
+ * Convert between the PCM config a client asked for and the one the HAL
+ * picked, instead of handing the HAL's choice back to the client, and the
+ * resampler quality (0-10) used for that.
+ */
+#define WRAPPER_PROP_CONVERT "persist.halium.audio_hw.convert"
+#define WRAPPER_PROP_CONVERT_QUALITY "persist.halium.audio_hw.convert_quality"
+/* Frames converted per pass when the HAL period is unknown */
+#define CONVERT_DEFAULT_CHUNK_FRAMES 1024
+
+/*
+ * Adaptive buffer size, see adapt_record(): ADAPT_OFF reports the HAL's,
+ * ADAPT_RECOMMEND only shows the size that would be used in the dumps, and
+ * ADAPT_APPLY reports it to clients. Sizes stay within ADAPT_MIN_PCT and
+ * ADAPT_MAX_PCT of the HAL's. They never go below the HAL's own: its period
+ * does not change with the size reported, so a smaller one saves no latency.
+ */
+#define WRAPPER_PROP_ADAPTIVE_BUFFER "persist.halium.audio_hw.adaptive_buffer"
+#define WRAPPER_PARAM_ADAPTIVE_BUFFER "wrapper_adaptive_buffer"
+#define ADAPT_WINDOW_CALLS 200
+#define ADAPT_STABLE_WINDOWS 5
+/* A call later than this many buffers is a restart, not a stall */
+#define ADAPT_IDLE_BUFFERS 8
+#define ADAPT_MIN_PCT 100
+#define ADAPT_MAX_PCT 400
+
+/*
+ * PCM tap, switched per stream with wrapper_tap=1: every write() or read()
+ * is recorded into a ring file of tap_size_kb in tap_dir, which the host
+ * tool audio_hw_tap_decode turns back into a WAV file and a call log.
+ */
+#define WRAPPER_PROP_TAP_DIR "persist.halium.audio_hw.tap_dir"
+#define WRAPPER_PROP_TAP_SIZE_KB "persist.halium.audio_hw.tap_size_kb"
+#define WRAPPER_PARAM_TAP "wrapper_tap"
+#define TAP_DEFAULT_DIR "/data/local/tmp"
+#define TAP_DEFAULT_SIZE_KB 4096
+
+/* Set to false to forward every set_parameters() and get_parameters() */
+#define WRAPPER_PROP_PARAM_CACHE "persist.halium.audio_hw.param_cache"
+
+/*
+ * Streams whose HAL has no volume or gain control get it applied by the
+ * wrapper instead, ramping to each new gain over SOFT_VOLUME_RAMP_MS. Set
+ * to false to hand the HAL's error back to the client.
+ */
+#define WRAPPER_PROP_SOFT_VOLUME "persist.halium.audio_hw.soft_volume"
+#define SOFT_VOLUME_RAMP_MS 20
+
+/*
+ * Control calls on a running stream are run by its data thread between two
+ * periods, see control_submit(). Set to false to run them on the caller,
+ * which still waits for a write() or read() in flight to return.
+ */
+#define WRAPPER_PROP_DEFER_CONTROL "persist.halium.audio_hw.defer_control"
+/* A deferred call waits two periods plus this, within the maximum */
+#define CONTROL_DEFER_MARGIN_MS 10
+#define CONTROL_DEFER_MAX_MS 200
+#define CONTROL_BATCH 8
+
+enum trace_event {
+    TRACE_OUT_WRITE,
+    TRACE_OUT_RENDER_POSITION,
+    TRACE_OUT_PRESENTATION_POSITION,
+    TRACE_IN_READ,
+};
+
+/* Indexed by enum trace_event */
+static const char * const trace_event_names[] = {
+    "out_write",
+    "out_get_render_position",
+    "out_get_presentation_position",
+    "in_read",
+};
+
+#define TRACE_RING_SIZE 1024 /* power of two */
+
+/*
+ * One ring slot. Writers claim slots with a single atomic increment and
+ * publish them through seq, so recording never blocks or formats strings;
+ * a reader discards slots that were being overwritten while it copied them.
+ */
+struct trace_entry {
+    std::atomic<uint32_t> seq;
+    uint32_t event;
+    const void *stream;
+    int64_t time_ns;
+    int64_t arg;
+    int32_t status;
+};
+
+static struct trace_entry trace_ring[TRACE_RING_SIZE];
+static std::atomic<uint32_t> trace_head;
+static std::atomic<int> trace_level;
+
+static inline int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#if AUDIO_HW_TRACE
+static void trace_record(enum trace_event event, const void *stream, int64_t arg,
+                         int32_t status)
+{
+    uint32_t index = trace_head.fetch_add(1, std::memory_order_relaxed);
+    struct trace_entry *entry = &trace_ring[index & (TRACE_RING_SIZE - 1)];
+
+    entry->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry->event = event;
+    entry->stream = stream;
+    entry->time_ns = monotonic_ns();
+    entry->arg = arg;
+    entry->status = status;
+    entry->seq.store(index + 1, std::memory_order_release);
+}
+
+#define TRACE_EVENT(event, stream, arg, status)                             \
+    do {                                                                    \
+        if (trace_level.load(std::memory_order_relaxed) > 0)                \
+            trace_record(event, stream, arg, status);                       \
+    } while (0)
+#else
+#define TRACE_EVENT(event, stream, arg, status) do { } while (0)
+#endif
+
+static void trace_set_level(int level)
+{
+    ALOGI("trace level %d%s", level, AUDIO_HW_TRACE ? "" : " (tracing compiled out)");
+    trace_level.store(level, std::memory_order_relaxed);
+}
+
+static void trace_dump(int fd)
+{
+    uint32_t head = trace_head.load(std::memory_order_acquire);
+    uint32_t count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+
+    dprintf(fd, "wrapper trace (level %d, %u events recorded):\n",
+            trace_level.load(std::memory_order_relaxed), head);
+
+    for (uint32_t index = head - count; index != head; index++) {
+        const struct trace_entry *slot = &trace_ring[index & (TRACE_RING_SIZE - 1)];
+        uint32_t seq = slot->seq.load(std::memory_order_acquire);
+        uint32_t event = slot->event;
+        const void *stream = slot->stream;
+        int64_t time_ns = slot->time_ns;
+        int64_t arg = slot->arg;
+        int32_t status = slot->status;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq != index + 1 || slot->seq.load(std::memory_order_relaxed) != seq)
+            continue;
+
+        dprintf(fd, "  %lld.%06lld %s %p arg=%lld status=%d\n",
+                (long long)(time_ns / 1000000000LL),
+                (long long)(time_ns % 1000000000LL / 1000),
+                trace_event_names[event], stream, (long long)arg, status);
+    }
+}
+
+#define HISTOGRAM_BUCKETS 24
+
+/*
+ * Log2-scale histogram: bucket 0 counts zero values, bucket n counts values
+ * in [2^(n-1), 2^n) and the last bucket everything larger. Only the stream's
+ * data thread records, so relaxed load/store pairs replace atomic
+ * read-modify-write; dumping threads see a slightly stale, untorn view.
+ */
+struct wrapper_histogram {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+/* Per-stream statistics of the write()/read() calls into libaudiohal */
+struct wrapper_stream_stats {
+    struct wrapper_histogram duration_us;   /* time blocked in the call */
+    struct wrapper_histogram interval_us;   /* time between call starts */
+    struct wrapper_histogram bytes;         /* bytes transferred per call */
+    std::atomic<uint64_t> short_transfers;
+    std::atomic<uint64_t> errors;
+    int64_t last_call_ns;
+};
+
+static inline void counter_add(std::atomic<uint64_t> *counter, uint64_t value)
+{
+    counter->store(counter->load(std::memory_order_relaxed) + value,
+                   std::memory_order_relaxed);
+}
+
+/*
+ * libaudiohal's answer once the HAL service is gone. Only a hint: binder
+ * can fail a transaction for other reasons, see adev_recover().
+ */
+static inline bool hal_transport_error(status_t ret)
+{
+    return ret == DEAD_OBJECT || ret == FAILED_TRANSACTION;
+}
+
+static void histogram_record(struct wrapper_histogram *histogram, uint64_t value)
+{
+    unsigned int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+
+    counter_add(&histogram->buckets[bucket], 1);
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum, value);
+    if (value > histogram->max.load(std::memory_order_relaxed))
+        histogram->max.store(value, std::memory_order_relaxed);
+}
+
+static void histogram_dump(int fd, const char *name, const char *unit,
+                           const struct wrapper_histogram *histogram)
+{
+    uint64_t count = histogram->count.load(std::memory_order_relaxed);
+    uint64_t sum = histogram->sum.load(std::memory_order_relaxed);
+
+    dprintf(fd, "  %s: count=%llu avg=%llu%s max=%llu%s\n", name,
+            (unsigned long long)count, (unsigned long long)(count ? sum / count : 0), unit,
+            (unsigned long long)histogram->max.load(std::memory_order_relaxed), unit);
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t hits = histogram->buckets[i].load(std::memory_order_relaxed);
+        if (!hits)
+            continue;
+
+        if (i == HISTOGRAM_BUCKETS - 1)
+            dprintf(fd, "    >=%llu%s: %llu\n", 1ULL << (i - 1), unit, (unsigned long long)hits);
+        else
+            dprintf(fd, "    <%llu%s: %llu\n", 1ULL << i, unit, (unsigned long long)hits);
+    }
+}
+
+static void stream_stats_record(struct wrapper_stream_stats *stats, int64_t start_ns,
+                                int64_t end_ns, size_t requested, size_t transferred,
+                                status_t status)
+{
+    if (stats->last_call_ns)
+        histogram_record(&stats->interval_us, (start_ns - stats->last_call_ns) / 1000);
+    stats->last_call_ns = start_ns;
+
+    histogram_record(&stats->duration_us, (end_ns - start_ns) / 1000);
+
+    if (status != OK) {
+        counter_add(&stats->errors, 1);
+        return;
+    }
+
+    histogram_record(&stats->bytes, transferred);
+    if (transferred < requested)
+        counter_add(&stats->short_transfers, 1);
+}
+
+static void stream_stats_dump(int fd, const struct wrapper_stream_stats *stats)
+{
+    histogram_dump(fd, "call duration", "us", &stats->duration_us);
+    histogram_dump(fd, "call interval", "us", &stats->interval_us);
+    histogram_dump(fd, "bytes per call", "B", &stats->bytes);
+    dprintf(fd, "  short transfers: %llu, errors: %llu\n",
+            (unsigned long long)stats->short_transfers.load(std::memory_order_relaxed),
+            (unsigned long long)stats->errors.load(std::memory_order_relaxed));
+}
+
+struct wrapper_stream_out;
+struct wrapper_stream_in;
+
+/*
+ * Parameter values the HAL accepted, per device and per stream. Sets that
+ * would not change anything are dropped, since vendor HALs tend to
+ * reconfigure on every set, and gets of the keys only the client sets are
+ * answered locally.
+ */
+struct wrapper_param_cache {
+    bool enabled;
+    std::mutex lock;
+    /* Looked up by string_view, so that lookups never allocate */
+    std::map<std::string, std::string, std::less<>> values;
+    std::atomic<uint64_t> sets_dropped;
+    std::atomic<uint64_t> gets_local;
+    /* The last String8s given to the HAL, see params_string8() */
+    String8 strings[PARAM_STRINGS];
+    size_t next_string;
+    std::atomic<uint64_t> strings_built;
+};
+
+/*
+ * An interface adev_recover() or a stream's recovery may replace while
+ * other threads call it. Every access copies the sp under a lock, so each
+ * caller holds a reference of its own for as long as its call lasts.
+ */
+template <typename T>
+class WrapperHalIface {
+  public:
+    sp<T> load() const
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mIface;
+    }
+
+    /* Returns the interface replaced, released once the caller drops it */
+    sp<T> exchange(const sp<T>& iface)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        sp<T> old = mIface;
+        mIface = iface;
+        return old;
+    }
+
+    WrapperHalIface& operator=(const sp<T>& iface)
+    {
+        exchange(iface);
+        return *this;
+    }
+
+    operator sp<T>() const { return load(); }
+    sp<T> operator->() const { return load(); }
+    bool operator==(std::nullptr_t) const { return load() == nullptr; }
+    bool operator!=(std::nullptr_t) const { return load() != nullptr; }
+
+  private:
+    mutable std::mutex mLock;
+    sp<T> mIface;
+};
+
+/* A HAL module streams can be routed to, opened on first use */
+struct wrapper_hal_module {
+    std::string name;
+    sp<DeviceHalInterface> deviceIface;
+    bool open_failed;
+};
+
+enum preopen_state {
+    PREOPEN_EMPTY,      /* waiting to be opened by the pre-open thread */
+    PREOPEN_OPENING,
+    PREOPEN_READY,      /* open and unclaimed */
+    PREOPEN_IN_USE,     /* handed to a client stream, reopened once it closes */
+    PREOPEN_FAILED,
+};
+
+struct wrapper_preopen_output {
+    const char *name;
+    audio_output_flags_t flags;
+    audio_io_handle_t handle;
+    struct audio_config config;
+    sp<StreamOutHalInterface> streamIface;
+    enum preopen_state state;
+};
+
+/*
+ * Device state set through the legacy API rather than parameters, replayed
+ * into a restarted HAL service by adev_recover(). Unset values are NAN,
+ * AUDIO_MODE_INVALID or -1.
+ */
+struct wrapper_device_state {
+    std::mutex lock;
+    audio_mode_t mode;
+    float voice_volume;
+    float master_volume;
+    int master_mute;
+    int mic_mute;
+    /* The last connect event of each connected device, by device */
+    std::map<std::string, std::string> connections;
+};
+
+/* One stream of a bulk standby: either out or in is set */
+struct wrapper_standby_task {
+    struct wrapper_stream_out *out;
+    struct wrapper_stream_in *in;
+};
+
+/*
+ * Workers of adev_standby_all(), started the first time standby() turned
+ * out slow enough to be worth running in parallel. The caller works
+ * through tasks as well; lock protects everything below it.
+ */
+struct wrapper_standby_pool {
+    /* Held for a whole bulk standby; closing a stream waits for it */
+    std::mutex run_lock;
+    std::thread threads[STANDBY_ALL_WORKERS];
+    bool started;
+    /* Mean time of one standby() in the last bulk standby */
+    int64_t mean_ns;
+    std::mutex lock;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    std::vector<struct wrapper_standby_task> tasks;
+    size_t next;
+    size_t done;
+    int64_t busy_ns;
+    bool exit;
+};
+
 struct wrapper_audio_device {
     struct audio_hw_device hw_device;
-    sp<DeviceHalInterface> deviceIface;
+    /* The module this device was opened as */
+    std::string module_name;
+    WrapperHalIface<DeviceHalInterface> deviceIface;
+
+    std::mutex modules_lock;
+    std::vector<struct wrapper_hal_module> modules;
+
+    struct wrapper_param_cache params;
+
+    /* Module each audio patch was created on, for releasing it there */
+    std::mutex patches_lock;
+    /* A few at a time, so a vector that keeps its capacity across switches */
+    std::vector<std::pair<audio_patch_handle_t, sp<DeviceHalInterface>>> patches;
+
+    /* Standard outputs prepared in the background, see adev_preopen_loop() */
+    std::mutex preopen_lock;
+    std::condition_variable preopen_cond;
+    std::vector<struct wrapper_preopen_output> preopen;
+    audio_devices_t preopen_devices;
+    std::thread preopen_thread;
+    bool preopen_exit;
+
+    /*
+     * Streams opened on this device. Bulk operations copy the lists under
+     * the lock, and keep streams from closing by other means.
+     */
+    std::mutex streams_lock;
+    std::vector<struct wrapper_stream_out *> outputs;
+    std::vector<struct wrapper_stream_in *> inputs;
+    struct wrapper_standby_pool standby;
+    std::atomic<uint64_t> standby_all_ns;
+    struct wrapper_stream_pools *pools;
+
+    /* Adaptive buffer mode, and the size inputs of each config last settled on */
+    int adapt_mode;
+    std::mutex input_scale_lock;
+    std::map<std::tuple<uint32_t, audio_channel_mask_t, audio_format_t>,
+             std::atomic<uint32_t>> input_scale_pct;
+
+    /*
+     * Recovery from a HAL service restart, see adev_recover(). The modules
+     * are reopened by the recovery thread; streams opened in an older
+     * generation reopen themselves on their data thread. Replaced module
+     * interfaces are kept, with the generation they served, until no
+     * stream of that generation is left.
+     */
+    struct wrapper_device_state state;
+    std::mutex recovery_lock;
+    std::condition_variable recovery_cond;
+    std::thread recovery_thread;
+    bool recovery_requested;
+    bool recovery_exit;
+    std::atomic<uint32_t> hal_generation;
+    std::vector<std::pair<uint32_t, sp<RefBase>>> retired;
+    std::atomic<uint64_t> recovery_ns;
+};
+
+/*
+ * Stream properties are fixed by the HAL when the stream is opened and only
+ * change when the stream is reconfigured through set_parameters(), so they
+ * are snapshotted once instead of costing a binder round-trip per getter.
+ * A new snapshot is queried and stored by the data thread, see
+ * out_reconfigure_run(), while getters read it.
+ */
+struct wrapper_hal_config {
+    uint32_t sample_rate;
+    audio_channel_mask_t channel_mask;
+    audio_format_t format;
+    size_t frame_size;
+    size_t buffer_size;
+};
+
+struct wrapper_stream_config {
+    std::atomic<uint32_t> sample_rate;
+    std::atomic<audio_channel_mask_t> channel_mask;
+    std::atomic<audio_format_t> format;
+    std::atomic<size_t> frame_size;
+    std::atomic<size_t> buffer_size;
+    /* Number of getter IPCs answered from the snapshot */
+    std::atomic<uint64_t> ipcs_saved;
+};
+
+/*
+ * Shared buffer of an MMAP_NOIRQ stream. The fd handed out by libaudiohal
+ * belongs to the HIDL handle it was received in, so the wrapper keeps its
+ * own duplicate and mapping alive for as long as the client may use them.
+ */
+struct wrapper_mmap_buffer {
+    int fd;
+    void *address;
+    size_t size;
+};
+
+/*
+ * Lock-free single-producer/single-consumer byte ring. head and tail count
+ * bytes ever written and consumed; each is only stored by its owning side.
+ */
+struct wrapper_ring {
+    uint8_t *data;
+    size_t size;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+};
+
+/*
+ * Writer thread draining a ring into the HAL, decoupling the client's
+ * write() from binder and HAL stalls. hal_lock is held around every HAL
+ * write so that standby can empty the ring without racing the thread;
+ * wake_lock only protects sleeping and waking up on the two conditions.
+ */
+struct wrapper_async_writer {
+    struct wrapper_ring ring;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::mutex hal_lock;
+    std::mutex wake_lock;
+    std::condition_variable data_cond;
+    std::condition_variable space_cond;
+    std::atomic<uint64_t> max_fill;
+    std::atomic<uint64_t> producer_waits;
+    std::atomic<uint64_t> underruns;
+};
+
+/* One HAL stream of a duplicating output, drained by its own writer thread */
+struct wrapper_duplicate_target {
+    sp<StreamOutHalInterface> streamIface;
+    const char *module;
+    audio_devices_t device;
+    audio_io_handle_t handle;
+    std::thread thread;
+    /* Held around every HAL write, so that standby can skip queued audio */
+    std::mutex hal_lock;
+    /* Bytes of the shared stream written to, or dropped for, this target */
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    /* Secondary targets only: the period being written, copied out of the buffer */
+    std::vector<uint8_t> period;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> underruns;
+    /* Clock rate against the nominal sample rate, from drift_frames on */
+    std::atomic<int32_t> drift_ppm;
+    std::atomic<bool> drift_reset;
+    uint64_t drift_frames;
+    int64_t drift_ns;
+    int64_t drift_checked_ns;
+};
+
+/*
+ * Duplicating output: out_write() copies into one buffer that the writer
+ * thread of every target drains at its own pace. The primary target, whose
+ * stream is also out->streamIface, paces the client and writes straight
+ * from the buffer. The others are never waited for, so the client may
+ * overwrite what they have not written yet: they copy each period out
+ * under the lock the client fills the buffer under, and skip ahead when
+ * they fall behind.
+ */
+struct wrapper_duplicate {
+    struct wrapper_duplicate_target *targets[DUPLICATE_MAX_TARGETS];
+    size_t count;
+    uint8_t *buffer;
+    size_t size;
+    size_t period;
+    size_t frame_size;
+    uint32_t sample_rate;
+    std::atomic<uint64_t> head;
+    std::atomic<bool> running;
+    /* Held while the buffer is filled or copied out of, and to wait on the conditions */
+    std::mutex lock;
+    std::condition_variable data_cond;
+    std::condition_variable space_cond;
+    std::atomic<uint64_t> producer_waits;
+};
+
+/* One side of a format conversion */
+struct wrapper_pcm_format {
+    uint32_t sample_rate;
+    audio_channel_mask_t channel_mask;
+    audio_format_t format;
+    uint32_t channels;
+    size_t frame_size;
+};
+
+/*
+ * Converts between a client's and the HAL's PCM config with libaudioutils:
+ * sample format and channels through float, sample rate with its
+ * resampler, which works on 16 bit samples. All buffers are sized for
+ * chunk_frames when the HAL's config is set, so the data path never
+ * allocates.
+ */
+struct wrapper_converter {
+    /* First member, so that the resampler's callbacks can find the rest */
+    struct resampler_buffer_provider provider;
+    struct wrapper_pcm_format client;
+    /*
+     * Only the data thread changes the HAL's side, see converter_reconfigure(),
+     * and getters on other threads read it under lock.
+     */
+    mutable std::mutex lock;
+    struct wrapper_pcm_format hal;
+    struct resampler_itfe *resampler;
+    size_t chunk_frames;
+    std::vector<float> work[2];
+    std::vector<int16_t> resample_in;
+    std::vector<int16_t> resample_out;
+    std::vector<uint8_t> hal_buffer;
+    /* Capture: converted HAL frames in resample_in not yet resampled */
+    struct wrapper_stream_in *in;
+    size_t pending_frames;
+    size_t pending_offset;
+    ssize_t read_error;
+};
+
+/*
+ * Mapped tap file of a stream. It is created the first time the tap is
+ * switched on and kept until the stream closes, so that the data thread
+ * never races with an unmap; only the data thread writes records.
+ */
+struct wrapper_pcm_tap {
+    std::string path;
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    struct wrapper_tap_header *header;
+    uint8_t *ring;
+    uint64_t write_pos;
+    uint64_t frames;
+    std::atomic<bool> enabled;
+};
+
+/*
+ * Software volume of a stream, see WRAPPER_PROP_SOFT_VOLUME. The control
+ * thread sets the target gains; the data thread ramps towards them and
+ * owns everything below them.
+ */
+struct wrapper_soft_volume {
+    std::atomic<bool> active;
+    std::atomic<float> target_left;
+    std::atomic<float> target_right;
+    /* Targets the current ramp heads to, and the frames it has left */
+    float ramp_left;
+    float ramp_right;
+    uint32_t ramp_frames;
+    float gain[VOLUME_MAX_CHANNELS];
+    float step[VOLUME_MAX_CHANNELS];
+    /* Output only: the client's buffer is const, the scaled copy goes here */
+    std::vector<uint8_t> scratch;
+    std::atomic<uint64_t> frames;
+};
+
+enum adapt_mode {
+    ADAPT_OFF,
+    ADAPT_RECOMMEND,
+    ADAPT_APPLY,
+};
+
+/*
+ * Cadence of a stream's write() or read() calls over the current window,
+ * and the buffer size recommended from past windows, as a percentage of
+ * the HAL's. Only the data thread updates the window.
+ */
+struct wrapper_adaptive_buffer {
+    std::atomic<int> mode;
+    int64_t last_ns;
+    uint32_t calls;
+    uint32_t stalls;
+    int64_t max_late_ns;
+    uint32_t stable_windows;
+    std::atomic<uint32_t> scale_pct;
+    /* Where the recommendation is kept for the next stream, if anywhere */
+    std::atomic<uint32_t> *learned_pct;
+    std::atomic<uint64_t> grown;
+    std::atomic<uint64_t> shrunk;
+    std::atomic<int64_t> last_late_ns;
+    std::atomic<const char *> last_decision;
+};
+
+/*
+ * Capture thread reading the HAL in bursts of whole periods into a ring
+ * that in_read() is served from. The ring holds a whole number of bursts;
+ * when the client falls that far behind, new bursts are still read, to
+ * keep the HAL from overrunning, and dropped as lost frames.
+ */
+struct wrapper_async_reader {
+    struct wrapper_ring ring;
+    uint8_t *scratch;
+    size_t burst;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::mutex wake_lock;
+    std::condition_variable data_cond;
+    std::condition_variable stop_cond;
+    std::atomic<uint64_t> frames_lost;
+    std::atomic<uint64_t> overruns;
+    std::atomic<uint64_t> client_waits;
+};
+
+/*
+ * Last position the HAL reported, frames at time_ns, and where the current
+ * drift baseline starts. Positions are extrapolated from it at a rate
+ * measured over the baseline, and never handed out going backwards.
+ */
+struct wrapper_position_anchor {
+    bool valid;
+    bool advancing;     /* moving, rather than stopped or not started */
+    uint64_t frames;
+    int64_t time_ns;
+    uint64_t base_frames;
+    int64_t base_ns;
+    int64_t synced_ns;  /* when the HAL was last queried */
+    int64_t moved_ns;   /* when the HAL position last changed */
+    uint64_t written;   /* frames_written at the anchor */
+    uint64_t reported;
+    double frames_per_ns;
+};
+
+struct wrapper_position_clock {
+    std::mutex lock;
+    struct wrapper_position_anchor presentation;
+    struct wrapper_position_anchor render;
+    std::atomic<int> resync_ms;
+    /* Frames handed to the HAL, which positions can never run ahead of */
+    std::atomic<uint64_t> frames_written;
+    std::atomic<uint64_t> hal_queries;
+    std::atomic<uint64_t> interpolated;
+    std::atomic<uint64_t> max_error_frames;
+};
+
+enum control_op_type {
+    CONTROL_SET_PARAMETERS = 1 << 0,
+    CONTROL_SET_VOLUME = 1 << 1,     /* or gain, for inputs */
+    CONTROL_STANDBY = 1 << 2,
+    CONTROL_RECONFIGURE = 1 << 3,    /* set_parameters() that may change the config */
+    CONTROL_PAUSE = 1 << 4,
+    CONTROL_RESUME = 1 << 5,
+    CONTROL_DRAIN = 1 << 6,
+    CONTROL_FLUSH = 1 << 7,
+    CONTROL_SET_CALLBACK = 1 << 8,
+    CONTROL_ADD_EFFECT = 1 << 9,
+    CONTROL_REMOVE_EFFECT = 1 << 10,
+    CONTROL_METADATA = 1 << 11,      /* source or sink metadata */
+};
+
+/*
+ * Operations the wrapper's writer and capture threads may run. A new
+ * config is taken by the client's thread when the stream converts, as the
+ * converter belongs to it, or by the writer thread of an output that does not.
+ */
+#define CONTROL_STREAM_OPS (CONTROL_SET_PARAMETERS | CONTROL_SET_VOLUME | CONTROL_PAUSE | \
+                            CONTROL_RESUME | CONTROL_DRAIN | CONTROL_FLUSH | \
+                            CONTROL_SET_CALLBACK | CONTROL_ADD_EFFECT | \
+                            CONTROL_REMOVE_EFFECT | CONTROL_METADATA)
+#define CONTROL_ALL_OPS (CONTROL_STREAM_OPS | CONTROL_STANDBY | CONTROL_RECONFIGURE)
+
+/* A control call handed to the data thread; it lives on the caller's stack */
+struct wrapper_control_op {
+    enum control_op_type type;
+    const std::string *kvpairs;
+    float left;
+    float right;
+    bool early_notify;
+    effect_handle_t effect;
+    const void *metadata;
+    status_t result;
+    bool done;
+};
+
+/* Stream state bits seen by control calls */
+#define CONTROL_RUNNING 0x1     /* written or read since the last standby */
+#define CONTROL_IN_CALL 0x2     /* a write() or read() is in flight */
+#define CONTROL_CLOSING 0x4
+#define CONTROL_DIRECT 0x8      /* a control call runs on its caller */
+#define CONTROL_DIRECT_WAIT 0x10 /* and another waits for the data thread to leave */
+
+/*
+ * Control calls queued for a stream's data thread, see control_submit().
+ * lock is only held to queue, take or complete operations, never across
+ * a HAL call. leave_cond is signalled when the data thread leaves the HAL
+ * for someone waiting on it, and when a direct call is done.
+ */
+struct wrapper_stream_control {
+    std::atomic<uint32_t> state;
+    std::atomic<pthread_t> data_thread;
+    std::atomic<bool> pending;
+    bool defer;
+    std::mutex lock;
+    std::condition_variable done_cond;
+    std::condition_variable leave_cond;
+    std::vector<struct wrapper_control_op *> queue;
+    std::atomic<uint64_t> deferred;
+    std::atomic<uint64_t> direct;
+    std::atomic<uint64_t> timeouts;
 };
 
 struct wrapper_stream_in {
     struct audio_stream_in stream;
-    sp<StreamInHalInterface> streamIface;
+    WrapperHalIface<StreamInHalInterface> streamIface;
+    struct wrapper_audio_device *adev;
+    const char *module;
+    audio_io_handle_t handle;
+    audio_input_flags_t flags;
+    struct wrapper_stream_config config;
+    struct wrapper_param_cache params;
+    struct wrapper_mmap_buffer mmap;
+    struct wrapper_stream_stats stats;
+    /* Set when the client's PCM config differs from the HAL's */
+    struct wrapper_converter *conv;
+    struct wrapper_adaptive_buffer adapt;
+    /* Requested capture thread state, applied by the data thread */
+    std::atomic<bool> async_requested;
+    std::atomic<struct wrapper_async_reader *> async;
+    std::atomic<struct wrapper_pcm_tap *> tap;
+    /* What the stream is reopened with after a HAL service restart */
+    audio_devices_t devices;
+    audio_source_t source;
+    std::string address;
+    std::atomic<float> gain;
+    std::atomic<uint32_t> hal_generation;
+    struct wrapper_soft_volume soft_volume;
+    struct wrapper_stream_control control;
+};
+
+/*
+ * Forwards libaudiohal's asynchronous stream events to the client callback
+ * of a non-blocking or offloaded output. libaudiohal only keeps a weak
+ * reference, so the stream owns it; being refcounted, it also outlives the
+ * stream if an event is being delivered while the stream is closed.
+ */
+class WrapperStreamOutCallback : public StreamOutHalInterfaceCallback {
+  public:
+    void setClientCallback(stream_callback_t callback, void *cookie)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mCallback = callback;
+        mCookie = cookie;
+    }
+
+    void onWriteReady() override { deliver(STREAM_CBK_EVENT_WRITE_READY); }
+    void onDrainReady() override { deliver(STREAM_CBK_EVENT_DRAIN_READY); }
+    void onError() override { deliver(STREAM_CBK_EVENT_ERROR); }
+
+  private:
+    void deliver(stream_callback_event_t event)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mCallback)
+            mCallback(event, NULL, mCookie);
+    }
+
+    std::mutex mLock;
+    stream_callback_t mCallback = NULL;
+    void *mCookie = NULL;
 };
 
 struct wrapper_stream_out {
     struct audio_stream_out stream;
-    sp<StreamOutHalInterface> streamIface;
+    WrapperHalIface<StreamOutHalInterface> streamIface;
+    sp<WrapperStreamOutCallback> callback;
+    struct wrapper_audio_device *adev;
+    const char *module;
+    /* Index of the pre-opened output this stream took over or replaced, or -1 */
+    int preopen_index;
+    /* The client's io handle, and the one the HAL knows the stream by */
+    audio_io_handle_t handle;
+    audio_io_handle_t hal_handle;
+    audio_output_flags_t flags;
+    struct wrapper_stream_config config;
+    struct wrapper_param_cache params;
+    struct wrapper_mmap_buffer mmap;
+    struct wrapper_stream_stats stats;
+    /* Set when the client's PCM config differs from the HAL's */
+    struct wrapper_converter *conv;
+    struct wrapper_adaptive_buffer adapt;
+    /* Requested asynchronous writer state, applied by the data thread */
+    std::atomic<bool> async_requested;
+    std::atomic<int> async_periods;
+    std::atomic<struct wrapper_async_writer *> async;
+    std::atomic<struct wrapper_pcm_tap *> tap;
+    struct wrapper_position_clock position;
+    /* Set for outputs duplicated to several devices */
+    struct wrapper_duplicate *dup;
+    /* What the stream is reopened with after a HAL service restart */
+    audio_devices_t devices;
+    audio_devices_t duplicate_devices;
+    std::string address;
+    std::atomic<float> volume_left;
+    std::atomic<float> volume_right;
+    std::atomic<uint32_t> hal_generation;
+    struct wrapper_soft_volume soft_volume;
+    struct wrapper_stream_control control;
 };
 
-static uint32_t out_get_sample_rate(const struct audio_stream *stream)
+/*
+ * Storage for N stream wrappers, constructed in place when a stream opens,
+ * so that route changes reopening streams do not go through the heap.
+ */
+template <typename T, size_t N>
+struct wrapper_pool {
+    std::mutex lock;
+    alignas(T) unsigned char slots[N][sizeof(T)];
+    bool used[N];
+    std::atomic<uint64_t> reused;
+    std::atomic<uint64_t> heap;
+};
+
+struct wrapper_stream_pools {
+    struct wrapper_pool<struct wrapper_stream_out, WRAPPER_POOL_OUTPUTS> outputs;
+    struct wrapper_pool<struct wrapper_stream_in, WRAPPER_POOL_INPUTS> inputs;
+};
+
+template <typename T, size_t N>
+static T *pool_take(struct wrapper_pool<T, N> *pool)
 {
-    ALOGV("out_get_sample_rate");
+    std::lock_guard<std::mutex> lock(pool->lock);
+
+    for (size_t i = 0; i < N; i++) {
+        if (!pool->used[i]) {
+            pool->used[i] = true;
+            counter_add(&pool->reused, 1);
+            return new (pool->slots[i]) T();
+        }
+    }
 
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    uint32_t rate = 0;
+    counter_add(&pool->heap, 1);
+    return new T();
+}
+
+template <typename T, size_t N>
+static void pool_put(struct wrapper_pool<T, N> *pool, T *object)
+{
+    uintptr_t offset = (uintptr_t)object - (uintptr_t)pool->slots;
+
+    if (offset >= sizeof(pool->slots)) {
+        delete object;
+        return;
+    }
+
+    object->~T();
+
+    std::lock_guard<std::mutex> lock(pool->lock);
+    pool->used[offset / sizeof(pool->slots[0])] = false;
+}
+
+template <typename T, size_t N>
+static void pool_dump(int fd, const char *type, struct wrapper_pool<T, N> *pool)
+{
+    dprintf(fd, "  %s pool: %zu slots, %llu reused, %llu from the heap\n", type, N,
+            (unsigned long long)pool->reused.load(std::memory_order_relaxed),
+            (unsigned long long)pool->heap.load(std::memory_order_relaxed));
+}
+
+/* Asks the HAL; what it does not answer stays as in config */
+static void stream_query_config(const sp<StreamHalInterface>& streamIface,
+                                const struct wrapper_stream_config *config,
+                                struct wrapper_hal_config *hal)
+{
+    hal->sample_rate = config->sample_rate;
+    hal->channel_mask = config->channel_mask;
+    hal->format = config->format;
+    hal->frame_size = config->frame_size;
+    hal->buffer_size = config->buffer_size;
+
+    status_t ret = streamIface->getAudioProperties(&hal->sample_rate, &hal->channel_mask,
+                                                   &hal->format);
+    if (ret != OK) {
+        ALOGE("getAudioProperties() error %d", ret);
+    }
+
+    streamIface->getFrameSize(&hal->frame_size);
+    streamIface->getBufferSize(&hal->buffer_size);
+
+    ALOGV("stream config: rate=%u channel_mask=%#x format=%#x frame_size=%zu buffer_size=%zu",
+          hal->sample_rate, hal->channel_mask, hal->format, hal->frame_size, hal->buffer_size);
+}
+
+static void stream_store_config(struct wrapper_stream_config *config,
+                                const struct wrapper_hal_config *hal)
+{
+    config->sample_rate = hal->sample_rate;
+    config->channel_mask = hal->channel_mask;
+    config->format = hal->format;
+    config->frame_size = hal->frame_size;
+    config->buffer_size = hal->buffer_size;
+}
+
+static void stream_refresh_config(const sp<StreamHalInterface>& streamIface,
+                                  struct wrapper_stream_config *config)
+{
+    struct wrapper_hal_config hal;
+
+    stream_query_config(streamIface, config, &hal);
+    stream_store_config(config, &hal);
+}
+
+static void stream_dump_wrapper_state(int fd, const char *type, const void *stream,
+                                      const char *module,
+                                      const struct wrapper_stream_config *config,
+                                      const struct wrapper_stream_stats *stats)
+{
+    dprintf(fd, "wrapper %s stream %p (module %s):\n", type, stream, module);
+    dprintf(fd, "  sample_rate: %u, channel_mask: %#x, format: %#x\n",
+            config->sample_rate.load(), config->channel_mask.load(), config->format.load());
+    dprintf(fd, "  frame_size: %zu, buffer_size: %zu\n",
+            config->frame_size.load(), config->buffer_size.load());
+    dprintf(fd, "  getter IPCs saved: %llu\n",
+            (unsigned long long)config->ipcs_saved.load(std::memory_order_relaxed));
+    stream_stats_dump(fd, stats);
+}
+
+static void stream_release_mmap_buffer(struct wrapper_mmap_buffer *buffer)
+{
+    if (buffer->address)
+        munmap(buffer->address, buffer->size);
+    if (buffer->fd >= 0)
+        close(buffer->fd);
+
+    buffer->fd = -1;
+    buffer->address = NULL;
+    buffer->size = 0;
+}
+
+static int stream_create_mmap_buffer(const sp<StreamHalInterface>& streamIface,
+                                     const struct wrapper_stream_config *config,
+                                     struct wrapper_mmap_buffer *buffer,
+                                     int32_t min_size_frames,
+                                     struct audio_mmap_buffer_info *info)
+{
+    status_t ret = streamIface->createMmapBuffer(min_size_frames, info);
+    if (ret != OK) {
+        ALOGE("createMmapBuffer() error %d", ret);
+        return ret;
+    }
+
+    if (info->shared_memory_fd < 0 || info->buffer_size_frames <= 0) {
+        ALOGE("createMmapBuffer() returned fd %d with %d frames",
+              info->shared_memory_fd, info->buffer_size_frames);
+        return -EINVAL;
+    }
+
+    stream_release_mmap_buffer(buffer);
+
+    buffer->fd = fcntl(info->shared_memory_fd, F_DUPFD_CLOEXEC, 0);
+    if (buffer->fd < 0) {
+        ALOGE("failed to duplicate mmap buffer fd: %s", strerror(errno));
+        return -errno;
+    }
+
+    buffer->size = (size_t)info->buffer_size_frames * config->frame_size;
+    buffer->address = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           buffer->fd, 0);
+    if (buffer->address == MAP_FAILED) {
+        int err = errno;
+        ALOGE("failed to map %zu bytes of mmap buffer: %s", buffer->size, strerror(err));
+        buffer->address = NULL;
+        stream_release_mmap_buffer(buffer);
+        return -err;
+    }
+
+    info->shared_memory_fd = buffer->fd;
+    info->shared_memory_address = buffer->address;
+
+    ALOGI("mmap buffer: fd=%d size=%zu frames=%d burst=%d", buffer->fd, buffer->size,
+          info->buffer_size_frames, info->burst_size_frames);
+    return 0;
+}
+
+/*
+ * Calls fn(key, value) for each pair of "k1=v1;k2;...", keys without a
+ * value getting an empty one. The views point into kvpairs.
+ */
+template <typename F>
+static void params_for_each(const char *kvpairs, F fn)
+{
+    const char *pos = kvpairs;
+
+    while (pos && *pos) {
+        const char *end = strchr(pos, ';');
+        size_t length = end ? (size_t)(end - pos) : strlen(pos);
+        const char *equals = (const char *)memchr(pos, '=', length);
+
+        if (length > 0) {
+            if (equals)
+                fn(std::string_view(pos, equals - pos),
+                   std::string_view(equals + 1, pos + length - equals - 1));
+            else
+                fn(std::string_view(pos, length), std::string_view());
+        }
+
+        pos = end ? end + 1 : NULL;
+    }
+}
+
+/* Whether a set_parameters() call can change the stream properties snapshot */
+static bool params_change_stream_config(const char *kvpairs)
+{
+    static const char * const keys[] = {
+        AUDIO_PARAMETER_STREAM_ROUTING,
+        AUDIO_PARAMETER_STREAM_FORMAT,
+        AUDIO_PARAMETER_STREAM_CHANNELS,
+        AUDIO_PARAMETER_STREAM_SAMPLING_RATE,
+        AUDIO_PARAMETER_STREAM_FRAME_COUNT,
+        AUDIO_PARAMETER_STREAM_INPUT_SOURCE,
+    };
+    bool changed = false;
+
+    params_for_each(kvpairs, [&](std::string_view key, std::string_view) {
+        for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]) && !changed; i++)
+            changed = key == keys[i];
+    });
+
+    return changed;
+}
+
+/* Keys whose value is an event rather than a state, so never redundant */
+static const char * const param_event_keys[] = {
+    AUDIO_PARAMETER_DEVICE_CONNECT,
+    AUDIO_PARAMETER_DEVICE_DISCONNECT,
+    "reconfigA2dp",
+};
+
+static bool params_is_event(std::string_view key)
+{
+    for (size_t i = 0; i < sizeof(param_event_keys) / sizeof(param_event_keys[0]); i++) {
+        if (key == param_event_keys[i])
+            return true;
+    }
+    return false;
+}
+
+/* Also never redundant: the same route sent again is how clients force a re-route */
+static bool params_is_forced(std::string_view key)
+{
+    return key == AUDIO_PARAMETER_STREAM_ROUTING || params_is_event(key);
+}
+
+/*
+ * Keys only the client sets, so the value it last set is what the HAL has.
+ * Any other key, routing included, may change inside the HAL and is asked for.
+ */
+static const char * const param_client_keys[] = {
+    AUDIO_PARAMETER_KEY_SCREEN_STATE,
+    AUDIO_PARAMETER_KEY_TTY_MODE,
+    AUDIO_PARAMETER_KEY_BT_NREC,
+    AUDIO_PARAMETER_KEY_BT_SCO_WB,
+    AUDIO_PARAMETER_KEY_HAC,
+    AUDIO_PARAMETER_STREAM_INPUT_SOURCE,
+};
+
+static bool params_is_client_owned(std::string_view key)
+{
+    for (size_t i = 0; i < sizeof(param_client_keys) / sizeof(param_client_keys[0]); i++) {
+        if (key == param_client_keys[i])
+            return true;
+    }
+    return false;
+}
+
+static void params_append(std::string *kvpairs, std::string_view key,
+                          const std::string_view *value)
+{
+    if (!kvpairs->empty())
+        kvpairs->append(";");
+    kvpairs->append(key);
+    if (value) {
+        kvpairs->append("=");
+        kvpairs->append(*value);
+    }
+}
+
+/*
+ * Wrapper-only keys are rare, and str_parms allocates for every pair, so
+ * kvpairs is only split with it when one is there. *parms is NULL otherwise.
+ */
+static int params_create_wrapper(const char *kvpairs, struct str_parms **parms)
+{
+    *parms = NULL;
+    if (!strstr(kvpairs, WRAPPER_PARAM_PREFIX))
+        return 0;
+
+    *parms = str_parms_create_str(kvpairs);
+    return *parms ? 0 : -ENOMEM;
+}
+
+/*
+ * For the device's wrapper-only keys, which a bulk standby sends often:
+ * calls fn(key, value) for each, and sets remaining to the other pairs.
+ * Unlike str_parms it allocates nothing once remaining has grown.
+ */
+template <typename F>
+static void params_split_wrapper(const char *kvpairs, std::string *remaining, F fn)
+{
+    remaining->clear();
+    params_for_each(kvpairs, [&](std::string_view key, std::string_view value) {
+        if (key.substr(0, strlen(WRAPPER_PARAM_PREFIX)) == WRAPPER_PARAM_PREFIX)
+            fn(key, value.empty() ? 0 : (int)strtol(value.data(), NULL, 10));
+        else
+            params_append(remaining, key, &value);
+    });
+}
+
+/* Sets changed to the part of kvpairs that would change what the HAL has been told */
+static void params_cache_filter(struct wrapper_param_cache *cache, const char *kvpairs,
+                                std::string *changed)
+{
+    changed->clear();
+    if (!cache->enabled) {
+        changed->append(kvpairs);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(cache->lock);
+    params_for_each(kvpairs, [&](std::string_view key, std::string_view value) {
+        auto it = params_is_forced(key) ? cache->values.end() : cache->values.find(key);
+
+        if (it != cache->values.end() && it->second == value) {
+            ALOGV("dropping redundant parameter %s", it->first.c_str());
+            counter_add(&cache->sets_dropped, 1);
+            return;
+        }
+        params_append(changed, key, &value);
+    });
+}
+
+/*
+ * Records the outcome of forwarding kvpairs; unknown HAL state is forgotten.
+ * Known keys are updated in place, so only a new key allocates. Recorded
+ * even when the cache is off, since recovery replays it.
+ */
+static void params_cache_store(struct wrapper_param_cache *cache, const std::string& kvpairs,
+                               bool accepted)
+{
+    std::lock_guard<std::mutex> lock(cache->lock);
+    params_for_each(kvpairs.c_str(), [&](std::string_view key, std::string_view value) {
+        auto it = cache->values.find(key);
+
+        if (accepted && !params_is_event(key)) {
+            if (it != cache->values.end())
+                it->second.assign(value);
+            else
+                cache->values.emplace(std::string(key), std::string(value));
+        } else if (it != cache->values.end()) {
+            cache->values.erase(it);
+        }
+    });
+}
+
+/* Forgets key, or every key if NULL, when the HAL may have changed it itself */
+static void params_cache_invalidate(struct wrapper_param_cache *cache, const char *key)
+{
+    std::lock_guard<std::mutex> lock(cache->lock);
+
+    if (key)
+        cache->values.erase(key);
+    else
+        cache->values.clear();
+}
+
+static bool params_has_event(const std::string& kvpairs)
+{
+    bool event = false;
+
+    params_for_each(kvpairs.c_str(), [&](std::string_view key, std::string_view) {
+        event = event || params_is_event(key);
+    });
+    return event;
+}
+
+/*
+ * A String8 allocates whenever it is built, and libaudiohal only takes
+ * those. The last few handed to the HAL are kept, and one with the same
+ * text is handed out again, which only takes a reference. strings_built
+ * counts the others, and stays put once parameters go round in circles.
+ */
+static String8 params_string8(struct wrapper_param_cache *cache, const char *text)
+{
+    std::lock_guard<std::mutex> lock(cache->lock);
+
+    for (const String8 &string : cache->strings) {
+        if (strcmp(string.string(), text) == 0)
+            return string;
+    }
+
+    String8 &string = cache->strings[cache->next_string];
+    cache->next_string = (cache->next_string + 1) % PARAM_STRINGS;
+    string.setTo(text);
+    counter_add(&cache->strings_built, 1);
+    return string;
+}
+
+/*
+ * Forwards kvpairs minus the parameters the HAL already has. forwarded
+ * receives what was sent; callers keep it around to reuse its capacity.
+ */
+template <typename T>
+static status_t params_forward(const sp<T>& iface, struct wrapper_param_cache *cache,
+                               const char *kvpairs, std::string *forwarded)
+{
+    status_t ret = OK;
+
+    params_cache_filter(cache, kvpairs, forwarded);
+    if (!forwarded->empty()) {
+        ret = iface->setParameters(params_string8(cache, forwarded->c_str()));
+        /* A dead HAL service is told again once it is back */
+        params_cache_store(cache, *forwarded, ret == OK || hal_transport_error(ret));
+    }
+
+    return ret;
+}
+
+/* params_cache_filter() of what is left of parms once wrapper-only keys are consumed */
+static void params_cache_filter_remaining(struct wrapper_param_cache *cache,
+                                          struct str_parms *parms, std::string *changed)
+{
+    char *remaining = str_parms_to_str(parms);
+
+    params_cache_filter(cache, remaining ? remaining : "", changed);
+    free(remaining);
+}
+
+/*
+ * Answers the requested keys the client owns and the cache knows, and asks
+ * the HAL for the others only. Without keys the HAL is asked for everything, as before.
+ * The reply must be malloc()ed, as the caller frees it.
+ */
+template <typename T>
+static char *params_cache_get(struct wrapper_param_cache *cache, const sp<T>& iface,
+                              const char *keys)
+{
+    static thread_local std::string local;
+    static thread_local std::string forward;
+    bool requested = false;
+    String8 values;
+
+    local.clear();
+    forward.clear();
+
+    {
+        std::unique_lock<std::mutex> lock(cache->lock, std::defer_lock);
+        if (cache->enabled)
+            lock.lock();
+
+        params_for_each(keys, [&](std::string_view key, std::string_view) {
+            auto it = cache->enabled && params_is_client_owned(key) ?
+                      cache->values.find(key) : cache->values.end();
+
+            requested = true;
+            if (it != cache->values.end()) {
+                std::string_view value(it->second);
+                params_append(&local, key, &value);
+                counter_add(&cache->gets_local, 1);
+            } else {
+                params_append(&forward, key, NULL);
+            }
+        });
+    }
+
+    if (!requested || !forward.empty())
+        iface->getParameters(params_string8(cache, forward.c_str()), &values);
+
+    if (local.empty())
+        return strdup(values.string());
+
+    /* forward is done with, and its capacity reused for the reply */
+    forward.assign(values.string());
+    params_append(&forward, local, NULL);
+    return strdup(forward.c_str());
+}
+
+/* Everything the HAL has been told and accepted, for a restarted HAL service */
+static void params_cache_kvpairs(struct wrapper_param_cache *cache, std::string *kvpairs)
+{
+    std::lock_guard<std::mutex> lock(cache->lock);
+
+    kvpairs->clear();
+    for (const auto &entry : cache->values) {
+        std::string_view value(entry.second);
+        params_append(kvpairs, entry.first, &value);
+    }
+}
+
+static void params_cache_dump(int fd, struct wrapper_param_cache *cache)
+{
+    std::lock_guard<std::mutex> lock(cache->lock);
+
+    dprintf(fd, "  parameters: %s, %zu cached, sets dropped: %llu, gets answered: %llu, "
+            "strings built: %llu\n",
+            cache->enabled ? "cached" : "forwarded", cache->values.size(),
+            (unsigned long long)cache->sets_dropped.load(std::memory_order_relaxed),
+            (unsigned long long)cache->gets_local.load(std::memory_order_relaxed),
+            (unsigned long long)cache->strings_built.load(std::memory_order_relaxed));
+}
+
+static bool ring_init(struct wrapper_ring *ring, size_t size)
+{
+    if (ring->size != size) {
+        free(ring->data);
+        ring->data = (uint8_t *)malloc(size);
+        ring->size = ring->data ? size : 0;
+    }
+
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    return ring->data != NULL;
+}
+
+static void ring_release(struct wrapper_ring *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+    ring->size = 0;
+}
+
+static inline size_t ring_fill(const struct wrapper_ring *ring)
+{
+    return ring->head.load(std::memory_order_acquire) -
+           ring->tail.load(std::memory_order_acquire);
+}
+
+/* Producer side: returns the contiguous writable region at the head */
+static size_t ring_peek_space(struct wrapper_ring *ring, uint8_t **data)
+{
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    size_t space = ring->size - (size_t)(head - ring->tail.load(std::memory_order_acquire));
+    size_t offset = head % ring->size;
+
+    *data = ring->data + offset;
+    return std::min(space, ring->size - offset);
+}
+
+static void ring_commit(struct wrapper_ring *ring, size_t bytes)
+{
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + bytes,
+                     std::memory_order_release);
+}
+
+/* Producer side: copies as much of buffer as fits and returns that amount */
+static size_t ring_write(struct wrapper_ring *ring, const void *buffer, size_t bytes)
+{
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    size_t space = ring->size - (size_t)(head - ring->tail.load(std::memory_order_acquire));
+    size_t offset = head % ring->size;
+
+    bytes = std::min(bytes, space);
+
+    size_t first = std::min(bytes, ring->size - offset);
+    memcpy(ring->data + offset, buffer, first);
+    memcpy(ring->data, (const uint8_t *)buffer + first, bytes - first);
+
+    ring->head.store(head + bytes, std::memory_order_release);
+    return bytes;
+}
+
+/* Consumer side: returns the contiguous readable region at the tail */
+static size_t ring_peek(struct wrapper_ring *ring, uint8_t **data)
+{
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t available = ring->head.load(std::memory_order_acquire) - tail;
+    size_t offset = tail % ring->size;
+
+    *data = ring->data + offset;
+    return std::min(available, ring->size - offset);
+}
+
+static void ring_consume(struct wrapper_ring *ring, size_t bytes)
+{
+    ring->tail.store(ring->tail.load(std::memory_order_relaxed) + bytes,
+                     std::memory_order_release);
+}
+
+/* Consumer side: drops everything queued */
+static void ring_flush(struct wrapper_ring *ring)
+{
+    ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+/** Control operations **/
+
+/*
+ * Threading model of a stream. Its data thread is the client thread in
+ * write() or read(), which clients never call concurrently, together with
+ * the writer, capture or duplicating threads acting for it. Control calls
+ * (set_parameters, set_volume, set_gain, standby) come from any thread.
+ * Vendor HALs serialize these against the data path behind their own
+ * locks, so a routing change issued while a write() was in the HAL held
+ * that write, and the one after it, for as long as the change took.
+ *
+ * On a running stream a control call is therefore queued, and its caller
+ * waits while the data thread runs it between two periods, before its
+ * next HAL write or read; the caller still gets the HAL's answer. With a
+ * writer or capture thread, that thread runs it, and the client's calls
+ * never wait for it. A standby is only deferred while a write() or read()
+ * is in flight, to the end of it, and only the client thread runs one:
+ * it stops the wrapper's threads. Calls on an idle stream, from the data
+ * thread itself, or not picked up within two periods run on the caller.
+ *
+ * Closing a stream waits for a write() or read() in flight to return, and
+ * fails those that race with it, so that it is never torn down under the
+ * data thread; queued calls fail with -ENODEV.
+ */
+
+static void control_init(struct wrapper_stream_control *control)
+{
+    control->state = 0;
+    control->data_thread = pthread_t();
+    control->pending = false;
+    control->defer = property_get_bool(WRAPPER_PROP_DEFER_CONTROL, true);
+    control->deferred = 0;
+    control->direct = 0;
+    control->timeouts = 0;
+}
+
+/* How long a deferred call waits for the data thread; 0 runs calls directly */
+static int control_timeout_ms(const struct wrapper_stream_control *control,
+                              const struct wrapper_stream_config *config)
+{
+    if (!control->defer || !audio_is_linear_pcm(config->format) || !config->frame_size ||
+        !config->sample_rate)
+        return 0;
+
+    uint64_t period_ms = (uint64_t)(config->buffer_size / config->frame_size) * 1000 /
+                         config->sample_rate;
+    return (int)std::min<uint64_t>(2 * period_ms + CONTROL_DEFER_MARGIN_MS,
+                                   CONTROL_DEFER_MAX_MS);
+}
+
+static void control_leave(struct wrapper_stream_control *control)
+{
+    uint32_t state = control->state.fetch_and(~CONTROL_IN_CALL, std::memory_order_acq_rel);
+
+    /* Taking the lock orders this with the waiting thread's predicate check */
+    if (state & (CONTROL_CLOSING | CONTROL_DIRECT_WAIT)) {
+        {
+            std::lock_guard<std::mutex> lock(control->lock);
+        }
+        control->leave_cond.notify_all();
+    }
+}
+
+/* Data thread, entering write() or read(): false once the stream is closing */
+static bool control_enter(struct wrapper_stream_control *control)
+{
+    uint32_t state = control->state.fetch_or(CONTROL_RUNNING | CONTROL_IN_CALL,
+                                             std::memory_order_acq_rel);
+
+    control->data_thread.store(pthread_self(), std::memory_order_relaxed);
+    if (state & CONTROL_CLOSING) {
+        control_leave(control);
+        return false;
+    }
+
+    /* A control call running on its caller owns the HAL stream until it is done */
+    if (state & CONTROL_DIRECT) {
+        std::unique_lock<std::mutex> lock(control->lock);
+        control->leave_cond.wait(lock, [control] {
+            return !(control->state.load(std::memory_order_acquire) & CONTROL_DIRECT);
+        });
+    }
+    return true;
+}
+
+/* Run by a standby: later control calls no longer wait for the data thread */
+static void control_stopped(struct wrapper_stream_control *control)
+{
+    control->state.fetch_and(~CONTROL_RUNNING, std::memory_order_acq_rel);
+}
+
+/*
+ * Data thread: runs the queued operations of the given types with run(),
+ * in order, and hands each result to its waiting caller.
+ */
+template <typename S, typename F>
+static void control_apply(struct wrapper_stream_control *control, S *stream, uint32_t types,
+                          F run)
+{
+    struct wrapper_control_op *batch[CONTROL_BATCH];
+    size_t count = 0;
+
+    if (!control->pending.load(std::memory_order_acquire))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(control->lock);
+        size_t kept = 0;
+
+        for (struct wrapper_control_op *op : control->queue) {
+            if ((op->type & types) && count < CONTROL_BATCH)
+                batch[count++] = op;
+            else
+                control->queue[kept++] = op;
+        }
+        control->queue.resize(kept);
+        control->pending.store(kept > 0, std::memory_order_release);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        status_t result = run(stream, batch[i]);
+
+        {
+            std::lock_guard<std::mutex> lock(control->lock);
+            batch[i]->result = result;
+            batch[i]->done = true;
+        }
+        control->done_cond.notify_all();
+    }
+}
+
+/*
+ * Control thread: runs op with run() here once the data thread is out of
+ * the HAL, and keeps it out until op is done, so that the two never use
+ * the HAL stream or the wrapper's stream state at once.
+ */
+template <typename S, typename F>
+static status_t control_run_direct(struct wrapper_stream_control *control, S *stream,
+                                   struct wrapper_control_op *op, F run)
+{
+    {
+        std::unique_lock<std::mutex> lock(control->lock);
+        control->leave_cond.wait(lock, [control] {
+            uint32_t state = control->state.fetch_or(CONTROL_DIRECT_WAIT,
+                                                     std::memory_order_acq_rel);
+
+            state |= CONTROL_DIRECT_WAIT;
+            while (!(state & (CONTROL_IN_CALL | CONTROL_DIRECT))) {
+                if (control->state.compare_exchange_weak(
+                        state, (state | CONTROL_DIRECT) & ~CONTROL_DIRECT_WAIT,
+                        std::memory_order_acq_rel))
+                    return true;
+            }
+            return false;
+        });
+    }
+
+    status_t result = run(stream, op);
+
+    control->state.fetch_and(~CONTROL_DIRECT, std::memory_order_acq_rel);
+    {
+        std::lock_guard<std::mutex> lock(control->lock);
+    }
+    control->leave_cond.notify_all();
+    return result;
+}
+
+/*
+ * Control thread: has the data thread run op with run() if the stream is
+ * busy, see above, or runs it here. Returns what run() returned.
+ */
+template <typename S, typename F>
+static status_t control_submit(struct wrapper_stream_control *control, S *stream,
+                               struct wrapper_control_op *op, int timeout_ms, F run)
+{
+    uint32_t state = control->state.load(std::memory_order_acquire);
+    uint32_t busy = op->type == CONTROL_STANDBY ? CONTROL_IN_CALL : CONTROL_RUNNING;
+
+    /* The data thread itself, or a client racing its own close */
+    if ((state & CONTROL_CLOSING) ||
+        pthread_equal(control->data_thread.load(std::memory_order_relaxed), pthread_self())) {
+        control->direct.fetch_add(1, std::memory_order_relaxed);
+        return run(stream, op);
+    }
+
+    if (timeout_ms <= 0 || !(state & busy)) {
+        control->direct.fetch_add(1, std::memory_order_relaxed);
+        return control_run_direct(control, stream, op, run);
+    }
+
+    std::unique_lock<std::mutex> lock(control->lock);
+    op->done = false;
+    control->queue.push_back(op);
+    control->pending.store(true, std::memory_order_release);
+    counter_add(&control->deferred, 1);
+
+    if (control->done_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                                    [op] { return op->done; }))
+        return op->result;
+
+    /*
+     * The data thread went idle without a standby: take the call back. It
+     * still waits for a write() or read() stuck in the HAL to return.
+     */
+    auto it = std::find(control->queue.begin(), control->queue.end(), op);
+    if (it != control->queue.end()) {
+        control->queue.erase(it);
+        control->pending.store(!control->queue.empty(), std::memory_order_release);
+        counter_add(&control->timeouts, 1);
+        lock.unlock();
+        return control_run_direct(control, stream, op, run);
+    }
+
+    /* Taken just now, and being run */
+    control->done_cond.wait(lock, [op] { return op->done; });
+    return op->result;
+}
+
+/* Before a stream is torn down: waits for its data thread to be out of it */
+static void control_close(struct wrapper_stream_control *control)
+{
+    std::unique_lock<std::mutex> lock(control->lock);
+
+    control->state.fetch_or(CONTROL_CLOSING, std::memory_order_acq_rel);
+    control->leave_cond.wait(lock, [control] {
+        return !(control->state.load(std::memory_order_acquire) & CONTROL_IN_CALL);
+    });
+
+    for (struct wrapper_control_op *op : control->queue) {
+        op->result = -ENODEV;
+        op->done = true;
+    }
+    control->queue.clear();
+    control->pending.store(false, std::memory_order_release);
+    lock.unlock();
+    control->done_cond.notify_all();
+}
+
+static void control_dump(int fd, const struct wrapper_stream_control *control)
+{
+    dprintf(fd, "  control calls: %s, %llu deferred, %llu timed out, %llu direct\n",
+            control->defer ? "deferred while running" : "direct",
+            (unsigned long long)control->deferred.load(std::memory_order_relaxed),
+            (unsigned long long)control->timeouts.load(std::memory_order_relaxed),
+            (unsigned long long)control->direct.load(std::memory_order_relaxed));
+}
+
+/* HAL service recovery, see adev_recover() */
+static bool adev_recover(struct wrapper_audio_device *adev, uint32_t seen);
+static void adev_release_retired(struct wrapper_audio_device *adev);
+
+/* Whether the HAL service restarted since the stream was last opened */
+static inline bool stream_hal_stale(const struct wrapper_audio_device *adev,
+                                    const std::atomic<uint32_t> *generation)
+{
+    return generation->load(std::memory_order_relaxed) !=
+           adev->hal_generation.load(std::memory_order_acquire);
+}
+
+static void out_recover(struct wrapper_stream_out *out);
+static void in_recover(struct wrapper_stream_in *in);
+
+/* Runs the control calls of the given types queued for the data thread */
+static void out_control_apply(struct wrapper_stream_out *out, uint32_t types);
+static void in_control_apply(struct wrapper_stream_in *in, uint32_t types);
+
+/* The writer thread only makes sense for blocking PCM outputs of one device */
+static bool out_async_supported(const struct wrapper_stream_out *out)
+{
+    return !out->dup && audio_is_linear_pcm(out->config.format) &&
+           !(out->flags & (AUDIO_OUTPUT_FLAG_DIRECT | AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD |
+                           AUDIO_OUTPUT_FLAG_NON_BLOCKING | AUDIO_OUTPUT_FLAG_MMAP_NOIRQ));
+}
+
+static void out_async_writer_loop(struct wrapper_stream_out *out,
+                                  struct wrapper_async_writer *writer)
+{
+    struct wrapper_ring *ring = &writer->ring;
+    bool had_data = false;
+
+    for (;;) {
+        /* Between two periods, and before hal_lock, which a standby takes */
+        out_control_apply(out, out->conv ? CONTROL_STREAM_OPS :
+                                           CONTROL_STREAM_OPS | CONTROL_RECONFIGURE);
+
+        std::unique_lock<std::mutex> hal_lock(writer->hal_lock);
+        uint8_t *data;
+        size_t bytes = ring_peek(ring, &data);
+
+        if (bytes == 0) {
+            hal_lock.unlock();
+
+            if (!writer->running.load(std::memory_order_acquire))
+                break;
+            if (had_data)
+                counter_add(&writer->underruns, 1);
+            had_data = false;
+
+            std::unique_lock<std::mutex> lock(writer->wake_lock);
+            writer->data_cond.wait(lock, [writer, ring] {
+                return ring_fill(ring) > 0 || !writer->running.load(std::memory_order_acquire);
+            });
+            continue;
+        }
+
+        /* Hand the HAL at most one period per call, like a blocking client */
+        if (out->config.buffer_size)
+            bytes = std::min(bytes, out->config.buffer_size.load());
+
+        size_t written = 0;
+        int64_t start_ns = monotonic_ns();
+        status_t ret = out->streamIface->write(data, bytes, &written);
+        stream_stats_record(&out->stats, start_ns, monotonic_ns(), bytes, written, ret);
+        TRACE_EVENT(TRACE_OUT_WRITE, out, ret == OK ? written : bytes, ret);
+
+        if (ret == OK && out->config.frame_size)
+            counter_add(&out->position.frames_written, written / out->config.frame_size);
+
+        /* The client's next write() reopens the stream, and stops this thread for it */
+        if (hal_transport_error(ret))
+            adev_recover(out->adev, out->hal_generation.load(std::memory_order_relaxed));
+
+        /* Audio the HAL refused is dropped rather than retried forever */
+        ring_consume(ring, ret == OK ? written : bytes);
+        hal_lock.unlock();
+        had_data = true;
+
+        /* Taking wake_lock orders this with the waiter's predicate check */
+        {
+            std::lock_guard<std::mutex> lock(writer->wake_lock);
+        }
+        writer->space_cond.notify_one();
+    }
+}
+
+static void out_async_stop(struct wrapper_async_writer *writer)
+{
+    if (!writer->thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(writer->wake_lock);
+        writer->running.store(false, std::memory_order_release);
+    }
+    writer->data_cond.notify_one();
+    writer->thread.join();
+}
+
+static bool out_async_start(struct wrapper_stream_out *out)
+{
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_acquire);
+    int periods = out->async_periods.load(std::memory_order_relaxed);
+
+    if (!writer) {
+        writer = new wrapper_async_writer();
+        out->async.store(writer, std::memory_order_release);
+    }
+
+    if (periods < 2)
+        periods = 2;
+    if (!out->config.buffer_size ||
+        !ring_init(&writer->ring, (size_t)periods * out->config.buffer_size)) {
+        ALOGE("out_async_start: cannot allocate %d periods of %zu bytes",
+              periods, out->config.buffer_size.load());
+        return false;
+    }
+
+    writer->running.store(true, std::memory_order_release);
+    writer->thread = std::thread(out_async_writer_loop, out, writer);
+
+    struct sched_param param = {};
+    param.sched_priority = property_get_int32(WRAPPER_PROP_ASYNC_PRIORITY,
+                                              ASYNC_DEFAULT_PRIORITY);
+    int err = pthread_setschedparam(writer->thread.native_handle(), SCHED_FIFO, &param);
+    if (err)
+        ALOGW("out_async_start: cannot use SCHED_FIFO priority %d: %s",
+              param.sched_priority, strerror(err));
+    pthread_setname_np(writer->thread.native_handle(), "audio_hw_writer");
+
+    ALOGI("out_async_start: %p ring of %zu bytes (%d periods)", out, writer->ring.size, periods);
+    return true;
+}
+
+/* Latency the ring adds on top of the HAL's, in milliseconds */
+static uint32_t out_async_latency_ms(const struct wrapper_stream_out *out)
+{
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_acquire);
+
+    if (!writer || !writer->running.load(std::memory_order_relaxed) ||
+        !out->config.frame_size || !out->config.sample_rate)
+        return 0;
+
+    uint64_t frames = ring_fill(&writer->ring) / out->config.frame_size;
+    return (uint32_t)(frames * 1000 / out->config.sample_rate);
+}
+
+/*
+ * Applies a change of the asynchronous writer mode. Only ever called from
+ * the data thread, so the ring never changes under a running producer;
+ * stopping drains what is queued into the HAL first.
+ */
+static void out_async_apply_mode(struct wrapper_stream_out *out)
+{
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_relaxed);
+    bool running = writer && writer->running.load(std::memory_order_relaxed);
+    bool requested = out->async_requested.load(std::memory_order_relaxed);
+
+    if (running == requested)
+        return;
+
+    if (requested) {
+        if (!out_async_start(out))
+            out->async_requested.store(false, std::memory_order_relaxed);
+    } else {
+        out_async_stop(writer);
+        ALOGI("out_async_stop: %p", out);
+    }
+}
+
+/*
+ * Queues the period for the writer thread and returns as soon as it fits
+ * in the ring. The client is paced by the HAL draining the ring, and since
+ * the HAL's position only counts frames that reached it, queued frames show
+ * up as latency in presentation positions as well as in out_get_latency().
+ */
+static ssize_t out_async_write(struct wrapper_stream_out *out,
+                               struct wrapper_async_writer *writer,
+                               const void *buffer, size_t bytes)
+{
+    struct wrapper_ring *ring = &writer->ring;
+    size_t queued = ring_write(ring, buffer, bytes);
+
+    if (queued < bytes) {
+        counter_add(&writer->producer_waits, 1);
+
+        /* Never wait longer than the ring takes to drain at the nominal rate */
+        uint64_t ring_ms = out->config.sample_rate && out->config.frame_size ?
+                ring->size / out->config.frame_size * 1000 / out->config.sample_rate : 100;
+        std::unique_lock<std::mutex> lock(writer->wake_lock);
+        writer->space_cond.wait_for(lock, std::chrono::milliseconds(ring_ms), [ring] {
+            return ring_fill(ring) < ring->size;
+        });
+        lock.unlock();
+
+        queued += ring_write(ring, (const uint8_t *)buffer + queued, bytes - queued);
+    }
+
+    size_t fill = ring_fill(ring);
+    if (fill > writer->max_fill.load(std::memory_order_relaxed))
+        writer->max_fill.store(fill, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(writer->wake_lock);
+    }
+    writer->data_cond.notify_one();
+
+    return queued;
+}
+
+static void out_async_dump(int fd, const struct wrapper_stream_out *out)
+{
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_acquire);
+
+    if (!writer)
+        return;
+
+    dprintf(fd, "  async writer: %s, ring: %zu/%zu bytes, max fill: %llu, latency: %ums\n",
+            writer->running.load(std::memory_order_relaxed) ? "running" : "stopped",
+            writer->ring.size ? ring_fill(&writer->ring) : 0, writer->ring.size,
+            (unsigned long long)writer->max_fill.load(std::memory_order_relaxed),
+            out_async_latency_ms(out));
+    dprintf(fd, "  async writer: producer waits: %llu, underruns: %llu\n",
+            (unsigned long long)writer->producer_waits.load(std::memory_order_relaxed),
+            (unsigned long long)writer->underruns.load(std::memory_order_relaxed));
+}
+
+static void out_async_release(struct wrapper_stream_out *out)
+{
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_acquire);
+
+    if (!writer)
+        return;
+
+    out_async_stop(writer);
+    ring_release(&writer->ring);
+    delete writer;
+    out->async.store(NULL, std::memory_order_release);
+}
+
+/* Only PCM positions advance at the sample rate of the stream */
+static bool position_interpolated(const struct wrapper_stream_out *out)
+{
+    return out->position.resync_ms.load(std::memory_order_relaxed) > 0 &&
+           out->config.sample_rate && audio_is_linear_pcm(out->config.format) &&
+           !(out->flags & (AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD | AUDIO_OUTPUT_FLAG_MMAP_NOIRQ));
+}
+
+/* Drops the anchors, after which the next queries go to the HAL again */
+static void position_reset(struct wrapper_position_clock *clock)
+{
+    std::lock_guard<std::mutex> lock(clock->lock);
+    clock->presentation = wrapper_position_anchor();
+    clock->render = wrapper_position_anchor();
+}
+
+static bool position_needs_resync(const struct wrapper_position_clock *clock,
+                                  const struct wrapper_position_anchor *anchor, int64_t now_ns)
+{
+    int64_t resync_ns = (int64_t)clock->resync_ms.load(std::memory_order_relaxed) * 1000000;
+
+    return !anchor->valid || !anchor->advancing || now_ns - anchor->synced_ns >= resync_ns;
+}
+
+static uint64_t position_extrapolate(const struct wrapper_position_anchor *anchor,
+                                     int64_t time_ns)
+{
+    if (!anchor->advancing || time_ns <= anchor->time_ns)
+        return anchor->frames;
+
+    return anchor->frames + (uint64_t)((time_ns - anchor->time_ns) * anchor->frames_per_ns);
+}
+
+/* Moves the anchor to a position just read from the HAL */
+static void position_anchor_update(struct wrapper_position_clock *clock,
+                                   struct wrapper_position_anchor *anchor,
+                                   uint64_t frames, int64_t time_ns, int64_t now_ns,
+                                   uint32_t sample_rate)
+{
+    double nominal = sample_rate / 1e9;
+    int64_t resync_ns = (int64_t)clock->resync_ms.load(std::memory_order_relaxed) * 1000000;
+
+    anchor->synced_ns = now_ns;
+
+    if (!anchor->valid || frames < anchor->frames) {
+        /* First query, or the HAL started counting over */
+        *anchor = wrapper_position_anchor();
+        anchor->valid = true;
+        anchor->base_frames = frames;
+        anchor->base_ns = time_ns;
+        anchor->synced_ns = now_ns;
+        anchor->moved_ns = now_ns;
+        anchor->frames_per_ns = nominal;
+    } else if (frames == anchor->frames) {
+        /*
+         * HALs update their position once per period, so an unchanged one
+         * only means stopped once it has not moved for a whole interval.
+         * The anchor is kept as is: the old timestamp is the accurate one.
+         */
+        if (now_ns - anchor->moved_ns > resync_ns) {
+            anchor->advancing = false;
+            anchor->base_frames = frames;
+            anchor->base_ns = time_ns;
+        }
+        return;
+    } else {
+        if (anchor->advancing) {
+            uint64_t predicted = position_extrapolate(anchor, time_ns);
+            uint64_t error = predicted > frames ? predicted - frames : frames - predicted;
+
+            if (error > clock->max_error_frames.load(std::memory_order_relaxed))
+                clock->max_error_frames.store(error, std::memory_order_relaxed);
+        }
+
+        /* Drift correction: the HAL's own rate over a long enough baseline */
+        if (time_ns - anchor->base_ns >= POSITION_DRIFT_MIN_BASELINE_NS) {
+            double rate = (double)(frames - anchor->base_frames) / (time_ns - anchor->base_ns);
+            double max_drift = nominal * POSITION_DRIFT_MAX_PPM / 1e6;
+
+            anchor->frames_per_ns = std::min(std::max(rate, nominal - max_drift),
+                                             nominal + max_drift);
+        }
+
+        anchor->advancing = true;
+        anchor->moved_ns = now_ns;
+    }
+
+    anchor->frames = frames;
+    anchor->time_ns = time_ns;
+    anchor->written = clock->frames_written.load(std::memory_order_relaxed);
+}
+
+/* Position at now_ns, bounded by what has been written and never going back */
+static uint64_t position_report(struct wrapper_position_clock *clock,
+                                struct wrapper_position_anchor *anchor, int64_t now_ns)
+{
+    uint64_t frames = position_extrapolate(anchor, now_ns);
+
+    if (frames > anchor->frames) {
+        uint64_t written = clock->frames_written.load(std::memory_order_relaxed);
+        uint64_t queued = anchor->written > anchor->frames ? anchor->written - anchor->frames : 0;
+
+        frames = std::min(frames, anchor->frames + queued + (written - anchor->written));
+    }
+
+    anchor->reported = std::max(anchor->reported, frames);
+    return anchor->reported;
+}
+
+static void position_dump(int fd, struct wrapper_stream_out *out)
+{
+    struct wrapper_position_clock *clock = &out->position;
+    std::lock_guard<std::mutex> lock(clock->lock);
+    double drift_ppm = 0;
+
+    if (clock->presentation.advancing && out->config.sample_rate)
+        drift_ppm = (clock->presentation.frames_per_ns * 1e9 / out->config.sample_rate - 1) * 1e6;
+
+    dprintf(fd, "  position: %s, resync: %dms, HAL queries: %llu, interpolated: %llu\n",
+            position_interpolated(out) ? "interpolated" : "forwarded",
+            clock->resync_ms.load(std::memory_order_relaxed),
+            (unsigned long long)clock->hal_queries.load(std::memory_order_relaxed),
+            (unsigned long long)clock->interpolated.load(std::memory_order_relaxed));
+    dprintf(fd, "  position: max error: %llu frames, drift: %.0f ppm\n",
+            (unsigned long long)clock->max_error_frames.load(std::memory_order_relaxed),
+            drift_ppm);
+}
+
+/** Format conversion **/
+
+static bool converter_format_supported(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+    case AUDIO_FORMAT_PCM_32_BIT:
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void converter_set_format(struct wrapper_pcm_format *side, uint32_t sample_rate,
+                                 audio_channel_mask_t channel_mask, audio_format_t format,
+                                 bool input)
+{
+    side->sample_rate = sample_rate;
+    side->channel_mask = channel_mask;
+    side->format = format;
+    side->channels = input ? audio_channel_count_from_in_mask(channel_mask) :
+                             audio_channel_count_from_out_mask(channel_mask);
+    side->frame_size = side->channels * audio_bytes_per_sample(format);
+}
+
+/*
+ * The resampler works on 16 bit samples. That costs nothing when either
+ * side is 16 bit, but would truncate audio that is wider on both.
+ */
+static bool converter_resample_allowed(const struct wrapper_pcm_format *client,
+                                       const struct wrapper_pcm_format *hal)
+{
+    return client->sample_rate == hal->sample_rate ||
+           client->format == AUDIO_FORMAT_PCM_16_BIT || hal->format == AUDIO_FORMAT_PCM_16_BIT;
+}
+
+/*
+ * Sets the HAL's side of conv: creates its resampler, if any, and sizes the
+ * buffers for one HAL period of buffer_size bytes.
+ */
+static bool converter_set_hal(struct wrapper_converter *conv,
+                              const struct wrapper_pcm_format *hal, size_t buffer_size,
+                              bool input)
+{
+    const struct wrapper_pcm_format *client = &conv->client;
+    size_t chunk_frames = buffer_size && hal->frame_size ?
+            buffer_size / hal->frame_size : CONVERT_DEFAULT_CHUNK_FRAMES;
+    struct resampler_itfe *resampler = NULL;
+
+    /* Channels are converted first, so the resampler runs at the far side's count */
+    if (client->sample_rate != hal->sample_rate) {
+        const struct wrapper_pcm_format *from = input ? hal : client;
+        const struct wrapper_pcm_format *to = input ? client : hal;
+        uint32_t quality = property_get_int32(WRAPPER_PROP_CONVERT_QUALITY,
+                                              RESAMPLER_QUALITY_DEFAULT);
+
+        int ret = create_resampler(from->sample_rate, to->sample_rate, to->channels, quality,
+                                   &conv->provider, &resampler);
+        if (ret) {
+            ALOGE("create_resampler(%u, %u) error %d", from->sample_rate, to->sample_rate, ret);
+            return false;
+        }
+    }
+
+    conv->hal = *hal;
+    conv->resampler = resampler;
+    conv->chunk_frames = chunk_frames;
+
+    /* A chunk on either side of the resampler, plus its rounding */
+    uint32_t max_rate = std::max(client->sample_rate, hal->sample_rate);
+    uint32_t min_rate = std::min(client->sample_rate, hal->sample_rate);
+    size_t max_frames = (chunk_frames * max_rate + min_rate - 1) / min_rate + 16;
+    size_t max_samples = max_frames * std::max(client->channels, hal->channels);
+
+    conv->work[0].resize(max_samples);
+    conv->work[1].resize(max_samples);
+    conv->resample_in.resize(max_samples);
+    conv->resample_out.resize(max_samples);
+    conv->hal_buffer.resize(max_frames * hal->frame_size);
+
+    ALOGI("converting rate=%u channel_mask=%#x format=%#x %s rate=%u channel_mask=%#x format=%#x",
+          client->sample_rate, client->channel_mask, client->format, input ? "from" : "to",
+          hal->sample_rate, hal->channel_mask, hal->format);
+    return true;
+}
+
+/*
+ * Returns a converter between what the client requested and what the HAL
+ * picked, or NULL when they match or the HAL's choice cannot be converted.
+ * Fields the client left unset take the HAL's values.
+ */
+static struct wrapper_converter *converter_create(const struct audio_config *requested,
+                                                  const struct wrapper_stream_config *config,
+                                                  bool input)
+{
+    struct wrapper_pcm_format client;
+    struct wrapper_pcm_format hal;
+
+    converter_set_format(&hal, config->sample_rate, config->channel_mask, config->format, input);
+    converter_set_format(&client,
+                         requested->sample_rate ? requested->sample_rate : hal.sample_rate,
+                         requested->channel_mask ? requested->channel_mask : hal.channel_mask,
+                         requested->format != AUDIO_FORMAT_DEFAULT ? requested->format :
+                                                                     hal.format,
+                         input);
+
+    /* Then the client is left on the HAL's rate, and still gets its channels and format */
+    if (!converter_resample_allowed(&client, &hal)) {
+        ALOGW("not resampling %u Hz format %#x to %u Hz format %#x, which would cut it to 16 bits",
+              client.sample_rate, client.format, hal.sample_rate, hal.format);
+        converter_set_format(&client, hal.sample_rate, client.channel_mask, client.format, input);
+    }
+
+    if (client.sample_rate == hal.sample_rate && client.channel_mask == hal.channel_mask &&
+        client.format == hal.format)
+        return NULL;
+
+    if (!converter_format_supported(client.format) || !converter_format_supported(hal.format) ||
+        !client.channels || !hal.channels || !client.sample_rate || !hal.sample_rate) {
+        ALOGW("cannot convert between rate=%u channel_mask=%#x format=%#x and "
+              "rate=%u channel_mask=%#x format=%#x",
+              client.sample_rate, client.channel_mask, client.format,
+              hal.sample_rate, hal.channel_mask, hal.format);
+        return NULL;
+    }
+
+    struct wrapper_converter *conv = new wrapper_converter();
+    conv->client = client;
+    if (!converter_set_hal(conv, &hal, config->buffer_size, input)) {
+        delete conv;
+        return NULL;
+    }
+    return conv;
+}
+
+/*
+ * Data thread: follows the HAL to the config it took after set_parameters()
+ * or a reopen, keeping the client's side. A config that cannot be converted
+ * to leaves the converter as it was, and returns false.
+ */
+static bool converter_reconfigure(struct wrapper_converter *conv,
+                                  const struct wrapper_hal_config *config, bool input)
+{
+    struct wrapper_pcm_format hal;
+
+    converter_set_format(&hal, config->sample_rate, config->channel_mask, config->format, input);
+    if (hal.sample_rate == conv->hal.sample_rate && hal.channel_mask == conv->hal.channel_mask &&
+        hal.format == conv->hal.format &&
+        config->buffer_size == conv->chunk_frames * hal.frame_size)
+        return true;
+
+    if (!converter_format_supported(hal.format) || !hal.channels || !hal.sample_rate ||
+        !converter_resample_allowed(&conv->client, &hal)) {
+        ALOGW("cannot convert to rate=%u channel_mask=%#x format=%#x, keeping the old config",
+              hal.sample_rate, hal.channel_mask, hal.format);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(conv->lock);
+    struct resampler_itfe *resampler = conv->resampler;
+
+    if (!converter_set_hal(conv, &hal, config->buffer_size, input))
+        return false;
+    if (resampler)
+        release_resampler(resampler);
+    conv->pending_frames = 0;
+    conv->pending_offset = 0;
+    return true;
+}
+
+/*
+ * A HAL rejecting a config writes one it supports back. With conversion
+ * enabled the stream is opened with that one instead, and converted.
+ */
+static bool converter_retry_open(const struct audio_config *requested,
+                                 const struct audio_config *suggested)
+{
+    if (!property_get_bool(WRAPPER_PROP_CONVERT, false))
+        return false;
+
+    return suggested->sample_rate != requested->sample_rate ||
+           suggested->channel_mask != requested->channel_mask ||
+           suggested->format != requested->format;
+}
+
+static void converter_release(struct wrapper_converter *conv)
+{
+    if (!conv)
+        return;
+
+    if (conv->resampler)
+        release_resampler(conv->resampler);
+    delete conv;
+}
+
+/* Drops resampler history, e.g. across standby */
+static void converter_reset(struct wrapper_converter *conv)
+{
+    if (conv->resampler)
+        conv->resampler->reset(conv->resampler);
+    conv->pending_frames = 0;
+    conv->pending_offset = 0;
+}
+
+static uint64_t converter_scale_frames(const struct wrapper_converter *conv, uint64_t frames)
+{
+    if (conv->client.sample_rate == conv->hal.sample_rate)
+        return frames;
+    return frames * conv->client.sample_rate / conv->hal.sample_rate;
+}
+
+/* HAL frames counted at the client's sample rate */
+static uint64_t converter_client_frames(const struct wrapper_converter *conv, uint64_t frames)
+{
+    if (!conv)
+        return frames;
+
+    std::lock_guard<std::mutex> lock(conv->lock);
+    return converter_scale_frames(conv, frames);
+}
+
+/* One HAL period, in client bytes */
+static size_t converter_client_buffer_size(const struct wrapper_converter *conv)
+{
+    std::lock_guard<std::mutex> lock(conv->lock);
+    return converter_scale_frames(conv, conv->chunk_frames) * conv->client.frame_size;
+}
+
+/* What the resampler holds back */
+static uint32_t converter_latency_ms(const struct wrapper_converter *conv)
+{
+    std::lock_guard<std::mutex> lock(conv->lock);
+    return conv->resampler ? conv->resampler->delay_ns(conv->resampler) / 1000000 : 0;
+}
+
+static void converter_channels(const float *src, uint32_t src_channels,
+                               float *dst, uint32_t dst_channels, size_t frames)
+{
+    if (src_channels == 1 && dst_channels == 2)
+        upmix_to_stereo_float_from_mono_float(dst, src, frames);
+    else if (src_channels == 2 && dst_channels == 1)
+        downmix_to_mono_float_from_stereo_float(dst, src, frames);
+    else
+        /* Extra channels are dropped, missing ones are left silent */
+        adjust_channels(src, src_channels, dst, dst_channels, sizeof(float),
+                        frames * src_channels * sizeof(float));
+}
+
+/* Samples of one side as float in the other side's channel layout */
+static const float *converter_to_float(struct wrapper_converter *conv,
+                                       const struct wrapper_pcm_format *from,
+                                       const struct wrapper_pcm_format *to,
+                                       const void *src, size_t frames)
+{
+    float *samples = conv->work[0].data();
+
+    memcpy_by_audio_format(samples, AUDIO_FORMAT_PCM_FLOAT, src, from->format,
+                           frames * from->channels);
+    if (from->channels == to->channels)
+        return samples;
+
+    converter_channels(samples, from->channels, conv->work[1].data(), to->channels, frames);
+    return conv->work[1].data();
+}
+
+/* Converts up to chunk_frames of client audio into hal_buffer, returns HAL frames */
+static size_t converter_process_output(struct wrapper_converter *conv, const void *src,
+                                       size_t frames)
+{
+    const float *samples = converter_to_float(conv, &conv->client, &conv->hal, src, frames);
+    size_t channels = conv->hal.channels;
+
+    if (!conv->resampler) {
+        memcpy_by_audio_format(conv->hal_buffer.data(), conv->hal.format, samples,
+                               AUDIO_FORMAT_PCM_FLOAT, frames * channels);
+        return frames;
+    }
+
+    size_t capacity = conv->resample_out.size() / channels;
+    size_t consumed = 0;
+    size_t produced = 0;
+
+    memcpy_to_i16_from_float(conv->resample_in.data(), samples, frames * channels);
+    while (consumed < frames && produced < capacity) {
+        size_t in_frames = frames - consumed;
+        size_t out_frames = capacity - produced;
+
+        conv->resampler->resample_from_input(conv->resampler,
+                                             conv->resample_in.data() + consumed * channels,
+                                             &in_frames,
+                                             conv->resample_out.data() + produced * channels,
+                                             &out_frames);
+        if (!in_frames && !out_frames)
+            break;
+        consumed += in_frames;
+        produced += out_frames;
+    }
+
+    memcpy_by_audio_format(conv->hal_buffer.data(), conv->hal.format, conv->resample_out.data(),
+                           AUDIO_FORMAT_PCM_16_BIT, produced * channels);
+    return produced;
+}
+
+static void converter_dump(int fd, const struct wrapper_converter *conv)
+{
+    if (!conv)
+        return;
+
+    std::lock_guard<std::mutex> lock(conv->lock);
+    dprintf(fd, "  conversion: client rate=%u channel_mask=%#x format=%#x, resampler: %s\n",
+            conv->client.sample_rate, conv->client.channel_mask, conv->client.format,
+            conv->resampler ? "yes" : "no");
+}
+
+/** Adaptive buffer size **/
+
+static int adapt_valid_mode(int mode)
+{
+    return std::min(std::max(mode, (int)ADAPT_OFF), (int)ADAPT_APPLY);
+}
+
+static void adapt_init(struct wrapper_adaptive_buffer *adapt, int mode,
+                       std::atomic<uint32_t> *learned_pct)
+{
+    adapt->mode.store(mode, std::memory_order_relaxed);
+    adapt->learned_pct = learned_pct;
+    adapt->scale_pct.store(learned_pct ? learned_pct->load(std::memory_order_relaxed) : 100,
+                           std::memory_order_relaxed);
+    adapt->last_decision.store("none yet", std::memory_order_relaxed);
+}
+
+/* Standby and other pauses in the client's calls are not stalls */
+static void adapt_reset(struct wrapper_adaptive_buffer *adapt)
+{
+    adapt->last_ns = 0;
+}
+
+/* size scaled by pct, in whole frames */
+static size_t adapt_scale(size_t size, size_t frame_size, uint32_t pct)
+{
+    if (!frame_size || pct == 100)
+        return size;
+
+    size_t frames = size / frame_size * pct / 100;
+    return std::max(frames, (size_t)1) * frame_size;
+}
+
+static size_t adapt_buffer_size(const struct wrapper_adaptive_buffer *adapt, size_t size,
+                                size_t frame_size)
+{
+    if (adapt->mode.load(std::memory_order_relaxed) != ADAPT_APPLY)
+        return size;
+    return adapt_scale(size, frame_size, adapt->scale_pct.load(std::memory_order_relaxed));
+}
+
+static int64_t adapt_duration_ns(size_t bytes, size_t frame_size, uint32_t sample_rate)
+{
+    if (!frame_size || !sample_rate)
+        return 0;
+    return (int64_t)(bytes / frame_size) * 1000000000LL / sample_rate;
+}
+
+/*
+ * Called on entry to every write() or read() with the duration of the
+ * audio it carries. A call arriving more than a whole buffer late is a
+ * stall, which the HAL most likely ran dry or overran on. At the end of a
+ * window, stalls double the buffer. ADAPT_STABLE_WINDOWS windows in a row
+ * that were never late by more than a quarter of a buffer halve it.
+ */
+static void adapt_record(struct wrapper_adaptive_buffer *adapt, int64_t duration_ns)
+{
+    int64_t now_ns = monotonic_ns();
+    int64_t last_ns = adapt->last_ns;
+
+    adapt->last_ns = now_ns;
+    if (!last_ns || duration_ns <= 0)
+        return;
+
+    int64_t late_ns = now_ns - last_ns - duration_ns;
+    if (late_ns > duration_ns * ADAPT_IDLE_BUFFERS)
+        return;
+
+    adapt->max_late_ns = std::max(adapt->max_late_ns, late_ns);
+    if (late_ns > duration_ns)
+        adapt->stalls++;
+    if (++adapt->calls < ADAPT_WINDOW_CALLS)
+        return;
+
+    uint32_t scale = adapt->scale_pct.load(std::memory_order_relaxed);
+
+    if (adapt->stalls) {
+        adapt->stable_windows = 0;
+        if (scale < ADAPT_MAX_PCT) {
+            scale *= 2;
+            counter_add(&adapt->grown, 1);
+            adapt->last_decision.store("grown after stalls", std::memory_order_relaxed);
+        }
+    } else if (adapt->max_late_ns < duration_ns / 4) {
+        if (++adapt->stable_windows >= ADAPT_STABLE_WINDOWS && scale > ADAPT_MIN_PCT) {
+            scale /= 2;
+            adapt->stable_windows = 0;
+            counter_add(&adapt->shrunk, 1);
+            adapt->last_decision.store("shrunk, cadence stable", std::memory_order_relaxed);
+        }
+    } else {
+        adapt->stable_windows = 0;
+    }
+
+    if (scale != adapt->scale_pct.load(std::memory_order_relaxed)) {
+        ALOGI("adaptive buffer: %u%% -> %u%% of the HAL's, %u stalls, worst lateness %lld us",
+              adapt->scale_pct.load(std::memory_order_relaxed), scale, adapt->stalls,
+              (long long)(adapt->max_late_ns / 1000));
+        adapt->scale_pct.store(scale, std::memory_order_relaxed);
+        if (adapt->learned_pct)
+            adapt->learned_pct->store(scale, std::memory_order_relaxed);
+    }
+
+    adapt->last_late_ns.store(adapt->max_late_ns, std::memory_order_relaxed);
+    adapt->calls = 0;
+    adapt->stalls = 0;
+    adapt->max_late_ns = 0;
+}
+
+static void adapt_dump(int fd, const struct wrapper_adaptive_buffer *adapt, size_t size,
+                       size_t frame_size)
+{
+    static const char * const modes[] = { "off", "recommend", "apply" };
+    int mode = adapt->mode.load(std::memory_order_relaxed);
+    uint32_t scale = adapt->scale_pct.load(std::memory_order_relaxed);
+
+    if (mode == ADAPT_OFF)
+        return;
+
+    dprintf(fd, "  adaptive buffer (%s): %u%% of the HAL's, %zu bytes, grown %llu, "
+            "shrunk %llu, worst lateness %lld us, last decision: %s\n",
+            modes[mode], scale, adapt_scale(size, frame_size, scale),
+            (unsigned long long)adapt->grown.load(std::memory_order_relaxed),
+            (unsigned long long)adapt->shrunk.load(std::memory_order_relaxed),
+            (long long)(adapt->last_late_ns.load(std::memory_order_relaxed) / 1000),
+            adapt->last_decision.load(std::memory_order_relaxed));
+}
+
+/** PCM tap **/
+
+static void tap_release(struct wrapper_pcm_tap *tap)
+{
+    if (!tap)
+        return;
+
+    if (tap->map)
+        munmap(tap->map, tap->map_size);
+    if (tap->fd >= 0)
+        close(tap->fd);
+    delete tap;
+}
+
+/* Maps a new tap file for the client's side of a stream, see tap/audio_hw_tap.h */
+static struct wrapper_pcm_tap *tap_create(const char *type, audio_io_handle_t handle,
+                                          enum wrapper_tap_direction direction,
+                                          const struct wrapper_pcm_format *pcm)
+{
+    char dir[PROPERTY_VALUE_MAX];
+    char path[PATH_MAX];
+    size_t header_size = (sizeof(struct wrapper_tap_header) + WRAPPER_TAP_ALIGN - 1) &
+                         ~(size_t)(WRAPPER_TAP_ALIGN - 1);
+    size_t ring_size = std::max(property_get_int32(WRAPPER_PROP_TAP_SIZE_KB,
+                                                   TAP_DEFAULT_SIZE_KB), 64) * 1024;
+
+    property_get(WRAPPER_PROP_TAP_DIR, dir, TAP_DEFAULT_DIR);
+    snprintf(path, sizeof(path), "%s/audio_hw_tap_%s_%d.bin", dir, type, handle);
+
+    struct wrapper_pcm_tap *tap = new wrapper_pcm_tap();
+    tap->path = path;
+    tap->map_size = header_size + ring_size;
+    tap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tap->fd < 0 || ftruncate(tap->fd, tap->map_size)) {
+        ALOGE("cannot create PCM tap %s: %s", path, strerror(errno));
+        tap_release(tap);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, tap->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, tap->fd, 0);
+    if (map == MAP_FAILED) {
+        ALOGE("cannot map PCM tap %s: %s", path, strerror(errno));
+        tap_release(tap);
+        return NULL;
+    }
+
+    /* Touched here, so that the data path never faults the file in */
+    tap->map = (uint8_t *)map;
+    memset(tap->map, 0, tap->map_size);
+
+    tap->header = (struct wrapper_tap_header *)tap->map;
+    tap->ring = tap->map + header_size;
+    tap->header->version = WRAPPER_TAP_VERSION;
+    tap->header->header_size = header_size;
+    tap->header->direction = direction;
+    tap->header->ring_size = ring_size;
+    tap->header->sample_rate = pcm->sample_rate;
+    tap->header->channel_mask = pcm->channel_mask;
+    tap->header->format = pcm->format;
+    tap->header->frame_size = pcm->frame_size;
+    tap->header->channels = pcm->channels;
+    __atomic_store_n(&tap->header->magic, WRAPPER_TAP_MAGIC, __ATOMIC_RELEASE);
+
+    ALOGI("PCM tap of %s stream %d in %s, %zu KiB", type, handle, path, ring_size / 1024);
+    return tap;
+}
+
+/* Switches a stream's tap, creating its file the first time */
+static void tap_set_enabled(std::atomic<struct wrapper_pcm_tap *> *slot, bool enabled,
+                            const char *type, audio_io_handle_t handle,
+                            enum wrapper_tap_direction direction,
+                            const struct wrapper_pcm_format *pcm)
+{
+    struct wrapper_pcm_tap *tap = slot->load(std::memory_order_acquire);
+
+    if (enabled && !tap) {
+        struct wrapper_pcm_tap *expected = NULL;
+
+        tap = tap_create(type, handle, direction, pcm);
+        if (!tap)
+            return;
+        if (!slot->compare_exchange_strong(expected, tap, std::memory_order_acq_rel)) {
+            tap_release(tap);
+            tap = expected;
+        }
+    }
+
+    if (tap)
+        tap->enabled.store(enabled, std::memory_order_relaxed);
+}
+
+static void tap_copy(struct wrapper_pcm_tap *tap, uint64_t pos, const void *data, size_t size)
+{
+    uint64_t ring_size = tap->header->ring_size;
+    size_t offset = pos % ring_size;
+    size_t first = std::min(size, (size_t)(ring_size - offset));
+
+    memcpy(tap->ring + offset, data, first);
+    if (first < size)
+        memcpy(tap->ring, (const uint8_t *)data + first, size - first);
+}
+
+/* Records one write() or read(): two memcpy()s into the mapping, no syscalls */
+static void tap_record(struct wrapper_pcm_tap *tap, const void *data, ssize_t result,
+                       size_t frame_size)
+{
+    struct wrapper_tap_record record;
+    size_t size = result > 0 ? result : 0;
+    size_t max_size = tap->header->ring_size - sizeof(record);
+
+    record.magic = WRAPPER_TAP_RECORD_MAGIC;
+    record.size = std::min(size, max_size);
+    record.time_ns = monotonic_ns();
+    record.result = result;
+    record.position = tap->frames;
+
+    tap_copy(tap, tap->write_pos, &record, sizeof(record));
+    tap_copy(tap, tap->write_pos + sizeof(record), data, record.size);
+
+    tap->write_pos += (sizeof(record) + record.size + WRAPPER_TAP_ALIGN - 1) &
+                      ~(uint64_t)(WRAPPER_TAP_ALIGN - 1);
+    if (frame_size)
+        tap->frames += size / frame_size;
+
+    tap->header->records++;
+    __atomic_store_n(&tap->header->write_pos, tap->write_pos, __ATOMIC_RELEASE);
+}
+
+static void tap_dump(int fd, std::atomic<struct wrapper_pcm_tap *> *slot)
+{
+    struct wrapper_pcm_tap *tap = slot->load(std::memory_order_acquire);
+
+    if (!tap)
+        return;
+
+    dprintf(fd, "  PCM tap: %s, %s, %llu records\n", tap->path.c_str(),
+            tap->enabled.load(std::memory_order_relaxed) ? "on" : "off",
+            (unsigned long long)tap->header->records);
+}
+
+/** Software volume **/
+
+static void soft_volume_init(struct wrapper_soft_volume *sv)
+{
+    sv->active = false;
+    sv->target_left = 1.0f;
+    sv->target_right = 1.0f;
+    sv->ramp_left = 1.0f;
+    sv->ramp_right = 1.0f;
+    sv->ramp_frames = 0;
+    for (int c = 0; c < VOLUME_MAX_CHANNELS; c++) {
+        sv->gain[c] = 1.0f;
+        sv->step[c] = 0.0f;
+    }
+    sv->frames = 0;
+}
+
+static uint32_t soft_volume_channels(const struct wrapper_stream_config *config)
+{
+    size_t sample_size = audio_bytes_per_sample(config->format);
+
+    return sample_size ? config->frame_size / sample_size : 0;
+}
+
+/*
+ * Called when the HAL refused a stream's volume or gain: from then on the
+ * wrapper applies it, unless disabled or the HAL's format has no kernel.
+ */
+static bool soft_volume_enable(struct wrapper_soft_volume *sv,
+                               const struct wrapper_stream_config *config,
+                               const char *type, audio_io_handle_t handle)
+{
+    uint32_t channels = soft_volume_channels(config);
+
+    if (!property_get_bool(WRAPPER_PROP_SOFT_VOLUME, true))
+        return false;
+
+    if (!volume_format_supported(config->format) || !channels ||
+        channels > VOLUME_MAX_CHANNELS) {
+        ALOGW("soft_volume_enable: %s %d: no software volume for format %#x, %u channels",
+              type, handle, config->format.load(), channels);
+        return false;
+    }
+
+    ALOGI("soft_volume_enable: %s %d has no HAL volume, applying it in the wrapper",
+          type, handle);
+    sv->active.store(true, std::memory_order_release);
+    return true;
+}
+
+static void soft_volume_set(struct wrapper_soft_volume *sv, float left, float right)
+{
+    sv->target_left.store(std::clamp(left, 0.0f, 1.0f), std::memory_order_relaxed);
+    sv->target_right.store(std::clamp(right, 0.0f, 1.0f), std::memory_order_relaxed);
+}
+
+/* Channels past the first two get the average of left and right */
+static float soft_volume_channel_gain(const struct wrapper_soft_volume *sv,
+                                      uint32_t channels, uint32_t c)
+{
+    if (c == 0 || channels == 1)
+        return sv->ramp_left;
+    if (c == 1)
+        return sv->ramp_right;
+    return (sv->ramp_left + sv->ramp_right) / 2;
+}
+
+/* Data thread: starts a ramp from the current gains towards new targets */
+static void soft_volume_update(struct wrapper_soft_volume *sv, uint32_t channels,
+                               uint32_t sample_rate)
+{
+    float left = sv->target_left.load(std::memory_order_relaxed);
+    float right = sv->target_right.load(std::memory_order_relaxed);
+
+    if (left == sv->ramp_left && right == sv->ramp_right)
+        return;
+
+    sv->ramp_left = left;
+    sv->ramp_right = right;
+    sv->ramp_frames = std::max(sample_rate * SOFT_VOLUME_RAMP_MS / 1000, 1u);
+    for (uint32_t c = 0; c < channels; c++)
+        sv->step[c] = (soft_volume_channel_gain(sv, channels, c) - sv->gain[c]) /
+                      sv->ramp_frames;
+}
+
+/*
+ * Data thread: scales bytes of src in the HAL's format into dst, which may
+ * be src. Returns false, leaving dst alone, while the gains are unity.
+ */
+static bool soft_volume_apply(struct wrapper_soft_volume *sv,
+                              const struct wrapper_stream_config *config, void *dst,
+                              const void *src, size_t bytes)
+{
+    uint32_t channels = soft_volume_channels(config);
+    size_t frames = config->frame_size ? bytes / config->frame_size : 0;
+    size_t ramp;
+
+    if (!channels || channels > VOLUME_MAX_CHANNELS)
+        return false;
+
+    soft_volume_update(sv, channels, config->sample_rate);
+    if (!sv->ramp_frames) {
+        uint32_t c = 0;
+
+        while (c < channels && sv->gain[c] == 1.0f)
+            c++;
+        if (c == channels)
+            return false;
+    }
+
+    ramp = std::min(frames, (size_t)sv->ramp_frames);
+    if (ramp) {
+        volume_apply(config->format, dst, src, ramp, channels, sv->gain, sv->step);
+        sv->ramp_frames -= ramp;
+        /* Land exactly on the targets, whatever the rounding on the way */
+        if (!sv->ramp_frames) {
+            for (uint32_t c = 0; c < channels; c++) {
+                sv->gain[c] = soft_volume_channel_gain(sv, channels, c);
+                sv->step[c] = 0.0f;
+            }
+        }
+    }
+
+    size_t offset = ramp * config->frame_size;
+    if (frames > ramp)
+        volume_apply(config->format, (uint8_t *)dst + offset, (const uint8_t *)src + offset,
+                     frames - ramp, channels, sv->gain, sv->step);
+
+    /* A partial frame is never played, but a copy must not leave it out */
+    if (dst != src && bytes > frames * config->frame_size)
+        memcpy((uint8_t *)dst + frames * config->frame_size,
+               (const uint8_t *)src + frames * config->frame_size,
+               bytes - frames * config->frame_size);
+
+    counter_add(&sv->frames, frames);
+    return true;
+}
+
+/*
+ * Returns the buffer to hand to the HAL. A short write gives the rest back
+ * to the client, which resubmits it unscaled: the ramp has then run a few
+ * frames ahead, which cannot be heard.
+ */
+static const void *out_soft_volume(struct wrapper_stream_out *out, const void *buffer,
+                                   size_t bytes)
+{
+    struct wrapper_soft_volume *sv = &out->soft_volume;
+
+    /* Only grows, so the heap is left alone once the client's size is known */
+    if (sv->scratch.size() < bytes)
+        sv->scratch.resize(bytes);
+
+    if (!soft_volume_apply(sv, &out->config, sv->scratch.data(), buffer, bytes))
+        return buffer;
+    return sv->scratch.data();
+}
+
+/* Captured audio is scaled in place, in the caller's buffer */
+static ssize_t in_soft_volume(struct wrapper_stream_in *in, void *buffer, ssize_t read)
+{
+    if (read > 0 && in->soft_volume.active.load(std::memory_order_acquire))
+        soft_volume_apply(&in->soft_volume, &in->config, buffer, buffer, read);
+    return read;
+}
+
+static void soft_volume_dump(int fd, const struct wrapper_soft_volume *sv)
+{
+    if (!sv->active.load(std::memory_order_acquire))
+        return;
+
+    dprintf(fd, "  Software volume: %.3f/%.3f, %llu frames scaled\n",
+            sv->target_left.load(std::memory_order_relaxed),
+            sv->target_right.load(std::memory_order_relaxed),
+            (unsigned long long)sv->frames.load(std::memory_order_relaxed));
+}
+
+/** Duplicating outputs **/
+
+/* Devices beyond the primary one a new output is duplicated to, or 0 */
+static audio_devices_t out_duplicate_devices(audio_devices_t devices,
+                                             audio_output_flags_t flags,
+                                             const struct audio_config *config)
+{
+    audio_devices_t primary = devices & -devices;
+
+    if (!property_get_bool(WRAPPER_PROP_DUPLICATE, false) || devices == primary ||
+        (config->format != AUDIO_FORMAT_DEFAULT && !audio_is_linear_pcm(config->format)) ||
+        (flags & (AUDIO_OUTPUT_FLAG_DIRECT | AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD |
+                  AUDIO_OUTPUT_FLAG_NON_BLOCKING | AUDIO_OUTPUT_FLAG_MMAP_NOIRQ)))
+        return 0;
+
+    return devices & ~primary;
+}
+
+/* Measures a target's clock against the sample rate, once per interval */
+static void out_duplicate_measure_drift(struct wrapper_duplicate *dup,
+                                        struct wrapper_duplicate_target *target)
+{
+    int64_t now_ns = monotonic_ns();
+    uint64_t frames;
+    struct timespec timestamp;
+
+    if (target->drift_reset.exchange(false, std::memory_order_relaxed))
+        target->drift_ns = 0;
+    if (now_ns - target->drift_checked_ns < DUPLICATE_DRIFT_INTERVAL_MS * 1000000LL)
+        return;
+    target->drift_checked_ns = now_ns;
+
+    if (target->streamIface->getPresentationPosition(&frames, &timestamp) != OK || !frames)
+        return;
+
+    int64_t time_ns = (int64_t)timestamp.tv_sec * 1000000000LL + timestamp.tv_nsec;
+    if (!target->drift_ns || frames < target->drift_frames || time_ns <= target->drift_ns) {
+        target->drift_frames = frames;
+        target->drift_ns = time_ns;
+        return;
+    }
+
+    /* Measured from the first position, so the estimate settles over time */
+    double rate = (double)(frames - target->drift_frames) * 1e9 / (time_ns - target->drift_ns);
+    target->drift_ppm.store((int32_t)((rate / dup->sample_rate - 1.0) * 1e6),
+                            std::memory_order_relaxed);
+}
+
+static void out_duplicate_writer_loop(struct wrapper_stream_out *out,
+                                      struct wrapper_duplicate *dup,
+                                      struct wrapper_duplicate_target *target)
+{
+    struct wrapper_duplicate_target *primary = dup->targets[0];
+    uint64_t max_lag = (uint64_t)dup->period * DUPLICATE_MAX_LAG_PERIODS;
+    bool had_data = false;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(dup->lock);
+            auto ready = [dup, target] {
+                return dup->head.load(std::memory_order_relaxed) !=
+                       target->tail.load(std::memory_order_relaxed) ||
+                       !dup->running.load(std::memory_order_relaxed);
+            };
+
+            if (!ready()) {
+                if (had_data)
+                    counter_add(&target->underruns, 1);
+                had_data = false;
+                dup->data_cond.wait(lock, ready);
+            }
+            if (!dup->running.load(std::memory_order_relaxed))
+                break;
+        }
+
+        std::unique_lock<std::mutex> hal_lock(target->hal_lock);
+        uint64_t tail = target->tail.load(std::memory_order_relaxed);
+        const uint8_t *data;
+        size_t bytes;
+
+        if (target == primary) {
+            /* The client never writes over what the primary has yet to write */
+            uint64_t head = dup->head.load(std::memory_order_acquire);
+            size_t offset = tail % dup->size;
+
+            bytes = std::min<uint64_t>(head - tail, std::min(dup->period, dup->size - offset));
+            data = dup->buffer + offset;
+        } else {
+            std::lock_guard<std::mutex> lock(dup->lock);
+            uint64_t head = dup->head.load(std::memory_order_relaxed);
+            uint64_t primary_tail = primary->tail.load(std::memory_order_acquire);
+            uint64_t floor = primary_tail > max_lag ? primary_tail - max_lag : 0;
+
+            /* Skips what lags behind the primary beyond max_lag, or was overwritten */
+            if (head > dup->size)
+                floor = std::max(floor, head - dup->size);
+            if (tail < floor) {
+                uint64_t skip = floor - tail;
+                skip += (dup->frame_size - skip % dup->frame_size) % dup->frame_size;
+                skip = std::min(skip, head - tail);
+                counter_add(&target->dropped, skip);
+                tail += skip;
+            }
+
+            size_t offset = tail % dup->size;
+            bytes = std::min<uint64_t>(head - tail, std::min(dup->period, dup->size - offset));
+            memcpy(target->period.data(), dup->buffer + offset, bytes);
+            data = target->period.data();
+        }
+
+        if (!bytes) {
+            target->tail.store(tail, std::memory_order_release);
+            continue;
+        }
+
+        size_t written = 0;
+        status_t ret = target->streamIface->write(data, bytes, &written);
+        if (ret != OK)
+            counter_add(&target->errors, 1);
+        if (hal_transport_error(ret))
+            adev_recover(out->adev, out->hal_generation.load(std::memory_order_relaxed));
+
+        /* Audio a target refuses is dropped rather than retried forever */
+        target->tail.store(tail + (ret == OK ? written : bytes), std::memory_order_release);
+        hal_lock.unlock();
+        had_data = true;
+
+        out_duplicate_measure_drift(dup, target);
+
+        if (target == primary) {
+            {
+                std::lock_guard<std::mutex> lock(dup->lock);
+            }
+            dup->space_cond.notify_one();
+        }
+    }
+}
+
+/* Blocks like a HAL write() until the primary target has room */
+static ssize_t out_duplicate_write(struct wrapper_stream_out *out, const void *buffer,
+                                   size_t bytes)
+{
+    struct wrapper_duplicate *dup = out->dup;
+    struct wrapper_duplicate_target *primary = dup->targets[0];
+    const uint8_t *src = (const uint8_t *)buffer;
+    int64_t start_ns = monotonic_ns();
+    size_t done = 0;
+
+    while (done < bytes) {
+        {
+            std::unique_lock<std::mutex> lock(dup->lock);
+            uint64_t head = dup->head.load(std::memory_order_relaxed);
+            auto has_space = [dup, primary, head] {
+                return head - primary->tail.load(std::memory_order_acquire) < dup->size;
+            };
+
+            if (!has_space()) {
+                counter_add(&dup->producer_waits, 1);
+                dup->space_cond.wait(lock, has_space);
+            }
+
+            size_t space = dup->size - (head - primary->tail.load(std::memory_order_acquire));
+            size_t offset = head % dup->size;
+            size_t chunk = std::min(bytes - done, std::min(space, dup->size - offset));
+
+            memcpy(dup->buffer + offset, src + done, chunk);
+            done += chunk;
+            dup->head.store(head + chunk, std::memory_order_release);
+        }
+        dup->data_cond.notify_all();
+    }
+
+    stream_stats_record(&out->stats, start_ns, monotonic_ns(), bytes, bytes, OK);
+    TRACE_EVENT(TRACE_OUT_WRITE, out, bytes, OK);
+    if (out->config.frame_size)
+        counter_add(&out->position.frames_written, bytes / out->config.frame_size);
+
+    return bytes;
+}
+
+/* Queued audio is skipped, and every target's HAL stream put in standby */
+static int out_duplicate_standby(struct wrapper_duplicate *dup)
+{
+    int ret = OK;
+
+    for (size_t i = 0; i < dup->count; i++) {
+        struct wrapper_duplicate_target *target = dup->targets[i];
+        std::lock_guard<std::mutex> lock(target->hal_lock);
+
+        target->tail.store(dup->head.load(std::memory_order_acquire),
+                           std::memory_order_release);
+        target->drift_reset.store(true, std::memory_order_relaxed);
+
+        status_t result = target->streamIface->standby();
+        if (i == 0)
+            ret = result;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(dup->lock);
+    }
+    dup->space_cond.notify_one();
+    return ret;
+}
+
+static int out_duplicate_set_volume(struct wrapper_duplicate *dup, float left, float right)
+{
+    int ret = dup->targets[0]->streamIface->setVolume(left, right);
+
+    for (size_t i = 1; i < dup->count; i++)
+        dup->targets[i]->streamIface->setVolume(left, right);
+
+    return ret;
+}
+
+/* The latency of the slowest target, including what is queued for it */
+static uint32_t out_duplicate_latency_ms(struct wrapper_duplicate *dup)
+{
+    uint64_t head = dup->head.load(std::memory_order_acquire);
+    uint32_t latency = 0;
+
+    for (size_t i = 0; i < dup->count; i++) {
+        struct wrapper_duplicate_target *target = dup->targets[i];
+        uint64_t queued = head - std::min(head, target->tail.load(std::memory_order_acquire));
+        uint32_t target_latency = 0;
+
+        target->streamIface->getLatency(&target_latency);
+        target_latency += (uint32_t)(queued / dup->frame_size * 1000 / dup->sample_rate);
+        latency = std::max(latency, target_latency);
+    }
+
+    return latency;
+}
+
+/*
+ * The position every target has played. Audio a secondary target dropped
+ * was not played, so it stays behind the client's timeline by that much.
+ * Each target's pair is carried forward to the newest timestamp before the
+ * lowest is taken. Secondary targets that cannot report yet are left out.
+ */
+static status_t out_duplicate_position(struct wrapper_duplicate *dup, uint64_t *frames,
+                                       struct timespec *timestamp)
+{
+    uint64_t target_frames[DUPLICATE_MAX_TARGETS];
+    int64_t target_ns[DUPLICATE_MAX_TARGETS];
+    int64_t newest_ns = 0;
+
+    for (size_t i = 0; i < dup->count; i++) {
+        struct wrapper_duplicate_target *target = dup->targets[i];
+        struct timespec ts;
+
+        target_ns[i] = -1;
+        status_t ret = target->streamIface->getPresentationPosition(&target_frames[i], &ts);
+        if (ret != OK) {
+            if (i == 0)
+                return ret;
+            continue;
+        }
+
+        target_ns[i] = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        newest_ns = std::max(newest_ns, target_ns[i]);
+    }
+
+    *frames = UINT64_MAX;
+    for (size_t i = 0; i < dup->count; i++) {
+        if (target_ns[i] < 0)
+            continue;
+        uint64_t elapsed = (uint64_t)(newest_ns - target_ns[i]) * dup->sample_rate / 1000000000LL;
+        *frames = std::min(*frames, target_frames[i] + elapsed);
+    }
+
+    timestamp->tv_sec = newest_ns / 1000000000LL;
+    timestamp->tv_nsec = newest_ns % 1000000000LL;
+    return OK;
+}
+
+static void out_duplicate_dump(int fd, struct wrapper_duplicate *dup)
+{
+    if (!dup)
+        return;
+
+    uint64_t head = dup->head.load(std::memory_order_acquire);
+    int32_t primary_ppm = dup->targets[0]->drift_ppm.load(std::memory_order_relaxed);
+
+    dprintf(fd, "  duplicating: %zu targets, buffer: %zu bytes, producer waits: %llu\n",
+            dup->count, dup->size,
+            (unsigned long long)dup->producer_waits.load(std::memory_order_relaxed));
+
+    for (size_t i = 0; i < dup->count; i++) {
+        struct wrapper_duplicate_target *target = dup->targets[i];
+        int32_t ppm = target->drift_ppm.load(std::memory_order_relaxed);
+
+        dprintf(fd, "  duplicating: %s device %#x on %s (handle %d): queued %llu bytes, "
+                "dropped %llu, errors %llu, underruns %llu, drift %d ppm (%+d vs primary)\n",
+                i ? "secondary" : "primary", target->device, target->module, target->handle,
+                (unsigned long long)(head - std::min(head, target->tail.load())),
+                (unsigned long long)target->dropped.load(std::memory_order_relaxed),
+                (unsigned long long)target->errors.load(std::memory_order_relaxed),
+                (unsigned long long)target->underruns.load(std::memory_order_relaxed),
+                ppm, ppm - primary_ppm);
+    }
+}
+
+static void out_duplicate_release(struct wrapper_stream_out *out)
+{
+    struct wrapper_duplicate *dup = out->dup;
+
+    if (!dup)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(dup->lock);
+        dup->running.store(false, std::memory_order_relaxed);
+    }
+    dup->data_cond.notify_all();
+
+    for (size_t i = 0; i < dup->count; i++) {
+        if (dup->targets[i]->thread.joinable())
+            dup->targets[i]->thread.join();
+        delete dup->targets[i];
+    }
+
+    free(dup->buffer);
+    delete dup;
+    out->dup = NULL;
+}
+
+/** Stream effects **/
+
+/*
+ * Effect handles come from the client's own effect library and mean
+ * nothing to the HAL, so the same effect is created again by the HAL's
+ * effects factory, given the client instance's config and attached there.
+ * The client's handle is only the key for detaching it again.
+ */
+struct wrapper_effect {
+    sp<EffectHalInterface> effectIface;
+    const void *stream;
+    effect_descriptor_t descriptor;
+    bool enabled;
+};
+
+static std::mutex effects_lock;
+static std::map<effect_handle_t, struct wrapper_effect> effects;
+static sp<EffectsFactoryHalInterface> effects_factory_iface;
+
+static sp<EffectsFactoryHalInterface> effects_factory()
+{
+    std::lock_guard<std::mutex> lock(effects_lock);
+    if (effects_factory_iface == nullptr)
+        effects_factory_iface = EffectsFactoryHalInterface::create();
+    return effects_factory_iface;
+}
+
+/* The factory of a restarted HAL service is a new one */
+static void effects_factory_reset()
+{
+    std::lock_guard<std::mutex> lock(effects_lock);
+    effects_factory_iface.clear();
+}
+
+/* Runs a command without arguments that replies with a status */
+static status_t effect_command(const sp<EffectHalInterface>& effectIface, uint32_t cmd)
+{
+    int32_t reply = 0;
+    uint32_t replySize = sizeof(reply);
+
+    status_t ret = effectIface->command(cmd, 0, NULL, &replySize, &reply);
+    return ret != OK ? ret : reply;
+}
+
+/*
+ * Gives the HAL's instance one config of the client's (get_cmd, then
+ * set_cmd), e.g. the reverse stream of an echo canceller. Having none to
+ * give is not an error.
+ */
+static status_t effect_copy_config(effect_handle_t effect,
+                                   const sp<EffectHalInterface>& effectIface,
+                                   uint32_t get_cmd, uint32_t set_cmd)
+{
+    effect_config_t config;
+    uint32_t size = sizeof(config);
+    int32_t reply = 0;
+    uint32_t replySize = sizeof(reply);
+
+    if (!(*effect)->command ||
+        (*effect)->command(effect, get_cmd, 0, NULL, &size, &config) != 0 ||
+        size != sizeof(config))
+        return OK;
+
+    status_t ret = effectIface->command(set_cmd, sizeof(config), &config, &replySize, &reply);
+    return ret != OK ? ret : reply;
+}
+
+/*
+ * The effect API has no command reading the enabled state back, but a
+ * disabled effect answers process() with -ENODATA. An empty buffer asks
+ * without processing anything. One without process() is taken as enabled.
+ */
+static bool effect_enabled(effect_handle_t effect)
+{
+    int16_t sample = 0;
+    audio_buffer_t buffer = {};
+
+    if (!(*effect)->process)
+        return true;
+
+    buffer.frameCount = 0;
+    buffer.s16 = &sample;
+    return (*effect)->process(effect, &buffer, &buffer) != -ENODATA;
+}
+
+/*
+ * Creates the HAL's instance of the client's effect in entry, and attaches
+ * it to the stream, enabled if the client's instance is.
+ */
+static status_t stream_attach_effect(const sp<StreamHalInterface>& streamIface,
+                                     audio_session_t session, audio_io_handle_t handle,
+                                     effect_handle_t effect, struct wrapper_effect *entry)
+{
+    sp<EffectsFactoryHalInterface> factory = effects_factory();
+
+    if (factory == nullptr)
+        return -ENODEV;
+
+    status_t status = factory->createEffect(&entry->descriptor.uuid, session, handle,
+                                            &entry->effectIface);
+    if (status != OK) {
+        ALOGE("createEffect() error %d for effect %s", status, entry->descriptor.name);
+        return status;
+    }
+
+    /*
+     * The client's configs are copied over. Effect parameters cannot be
+     * listed generically, so those start from the HAL's defaults.
+     */
+    entry->enabled = effect_enabled(effect);
+    status = effect_command(entry->effectIface, EFFECT_CMD_INIT);
+    if (status == OK)
+        status = effect_copy_config(effect, entry->effectIface,
+                                    EFFECT_CMD_GET_CONFIG, EFFECT_CMD_SET_CONFIG);
+    if (status == OK)
+        status = effect_copy_config(effect, entry->effectIface,
+                                    EFFECT_CMD_GET_CONFIG_REVERSE, EFFECT_CMD_SET_CONFIG_REVERSE);
+    if (status == OK && entry->enabled)
+        status = effect_command(entry->effectIface, EFFECT_CMD_ENABLE);
+    if (status == OK)
+        status = streamIface->addEffect(entry->effectIface);
+    if (status != OK) {
+        ALOGE("cannot attach effect %s: error %d", entry->descriptor.name, status);
+        entry->effectIface->close();
+        entry->effectIface.clear();
+    }
+    return status;
+}
+
+static int stream_add_effect(const sp<StreamHalInterface>& streamIface, const void *stream,
+                             audio_session_t session, audio_io_handle_t handle,
+                             effect_handle_t effect)
+{
+    struct wrapper_effect entry = {};
+
+    if (!effect || !*effect || !(*effect)->get_descriptor)
+        return -EINVAL;
+
+    int ret = (*effect)->get_descriptor(effect, &entry.descriptor);
+    if (ret)
+        return ret;
+
+    {
+        std::lock_guard<std::mutex> lock(effects_lock);
+        if (effects.count(effect))
+            return -EEXIST;
+    }
+
+    status_t status = stream_attach_effect(streamIface, session, handle, effect, &entry);
+    if (status != OK)
+        return status;
+
+    entry.stream = stream;
+    {
+        std::lock_guard<std::mutex> lock(effects_lock);
+        if (effects.emplace(effect, entry).second) {
+            ALOGI("attached effect %s to stream %p", entry.descriptor.name, stream);
+            return 0;
+        }
+    }
+
+    /* Lost a race against another add of the same handle */
+    streamIface->removeEffect(entry.effectIface);
+    entry.effectIface->close();
+    return -EEXIST;
+}
+
+static void stream_detach_effect(const sp<StreamHalInterface>& streamIface,
+                                 const struct wrapper_effect *entry)
+{
+    if (entry->enabled)
+        effect_command(entry->effectIface, EFFECT_CMD_DISABLE);
+    status_t ret = streamIface->removeEffect(entry->effectIface);
+    if (ret != OK)
+        ALOGE("removeEffect() error %d for effect %s", ret, entry->descriptor.name);
+    entry->effectIface->close();
+
+    ALOGI("detached effect %s from stream %p", entry->descriptor.name, entry->stream);
+}
+
+static int stream_remove_effect(const sp<StreamHalInterface>& streamIface, const void *stream,
+                                effect_handle_t effect)
+{
+    struct wrapper_effect entry;
+
+    {
+        std::lock_guard<std::mutex> lock(effects_lock);
+        auto it = effects.find(effect);
+        if (it == effects.end() || it->second.stream != stream)
+            return -EINVAL;
+
+        entry = it->second;
+        effects.erase(it);
+    }
+
+    stream_detach_effect(streamIface, &entry);
+    return 0;
+}
+
+/*
+ * Attaches the effects of a stream again once it was reopened in a
+ * restarted HAL service, whose old instances died with it. An effect that
+ * cannot be is forgotten, as if the client had removed it.
+ */
+static void stream_reattach_effects(const sp<StreamHalInterface>& streamIface,
+                                    const void *stream, audio_session_t session,
+                                    audio_io_handle_t handle)
+{
+    std::vector<std::pair<effect_handle_t, struct wrapper_effect>> attached;
+
+    {
+        std::lock_guard<std::mutex> lock(effects_lock);
+        for (const auto &entry : effects) {
+            if (entry.second.stream == stream)
+                attached.push_back(entry);
+        }
+    }
+
+    for (auto &entry : attached) {
+        status_t status = stream_attach_effect(streamIface, session, handle, entry.first,
+                                               &entry.second);
+
+        std::lock_guard<std::mutex> lock(effects_lock);
+        auto it = effects.find(entry.first);
+        if (it == effects.end() || it->second.stream != stream)
+            continue;
+        if (status == OK) {
+            it->second.effectIface = entry.second.effectIface;
+            it->second.enabled = entry.second.enabled;
+            ALOGI("attached effect %s to reopened stream %p", entry.second.descriptor.name,
+                  stream);
+        } else {
+            effects.erase(it);
+        }
+    }
+}
+
+/* Detaches what the client left attached to a stream it is closing */
+static void stream_release_effects(const sp<StreamHalInterface>& streamIface,
+                                   const void *stream)
+{
+    std::vector<struct wrapper_effect> attached;
+
+    {
+        std::lock_guard<std::mutex> lock(effects_lock);
+        for (auto it = effects.begin(); it != effects.end();) {
+            if (it->second.stream == stream) {
+                attached.push_back(it->second);
+                it = effects.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (const struct wrapper_effect &entry : attached)
+        stream_detach_effect(streamIface, &entry);
+}
+
+static void stream_effects_dump(int fd, const void *stream)
+{
+    std::lock_guard<std::mutex> lock(effects_lock);
+
+    for (const auto &effect : effects) {
+        if (effect.second.stream == stream)
+            dprintf(fd, "  effect: %s (%s), %s\n", effect.second.descriptor.name,
+                    effect.second.descriptor.implementor,
+                    effect.second.enabled ? "enabled" : "disabled");
+    }
+}
+
+static uint32_t out_get_sample_rate(const struct audio_stream *stream)
+{
+    ALOGV("out_get_sample_rate");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    out->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+    if (out->conv)
+        return out->conv->client.sample_rate;
+    return out->config.sample_rate;
+}
+
+static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
+{
+    ALOGV("out_set_sample_rate: %d", rate);
+    return -ENOSYS;
+}
+
+static size_t out_get_buffer_size(const struct audio_stream *stream)
+{
+    ALOGV("out_get_buffer_size");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    out->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+    if (out->conv)
+        return adapt_buffer_size(&out->adapt, converter_client_buffer_size(out->conv),
+                                 out->conv->client.frame_size);
+    return adapt_buffer_size(&out->adapt, out->config.buffer_size, out->config.frame_size);
+}
+
+static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
+{
+    ALOGV("out_get_channels");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    out->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+    if (out->conv)
+        return out->conv->client.channel_mask;
+    return out->config.channel_mask;
+}
+
+static audio_format_t out_get_format(const struct audio_stream *stream)
+{
+    ALOGV("out_get_format");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    out->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+    if (out->conv)
+        return out->conv->client.format;
+    return out->config.format;
+}
+
+static int out_set_format(struct audio_stream *stream, audio_format_t format)
+{
+    ALOGV("out_set_format: %d",format);
+    return -ENOSYS;
+}
+
+/* Run as a control call: the converter belongs to the writing thread */
+static status_t out_standby_run(struct wrapper_stream_out *out)
+{
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_acquire);
+
+    if (out->conv)
+        converter_reset(out->conv);
+    adapt_reset(&out->adapt);
+    position_reset(&out->position);
+    control_stopped(&out->control);
+
+    if (out->dup)
+        return out_duplicate_standby(out->dup);
+
+    /* Queued audio is dropped, and the writer kept out until standby is done */
+    if (writer && writer->running.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(writer->hal_lock);
+        ring_flush(&writer->ring);
+        return out->streamIface->standby();
+    }
+
+    return out->streamIface->standby();
+}
+
+/* The part of set_parameters() that the HAL serializes with writes */
+template <typename S>
+static status_t stream_set_parameters_run(S *stream, const std::string& kvpairs)
+{
+    status_t ret = stream->streamIface->setParameters(params_string8(&stream->params,
+                                                                     kvpairs.c_str()));
+
+    /* A dead HAL service is told again once it is back */
+    params_cache_store(&stream->params, kvpairs, ret == OK || hal_transport_error(ret));
+    return ret;
+}
+
+/*
+ * A set_parameters() that may change the stream's config: the HAL is asked
+ * for the new one, and the converter follows it, before the next write.
+ * The writer thread, if any, is kept off the HAL meanwhile. A new route or
+ * config also means a new position timeline.
+ */
+static status_t out_reconfigure_run(struct wrapper_stream_out *out, const std::string& kvpairs)
+{
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> hal_lock;
+    struct wrapper_hal_config hal;
+
+    if (writer && writer->running.load(std::memory_order_acquire))
+        hal_lock = std::unique_lock<std::mutex>(writer->hal_lock);
+
+    status_t ret = stream_set_parameters_run(out, kvpairs);
+    if (ret != OK)
+        return ret;
+
+    stream_query_config(out->streamIface.load(), &out->config, &hal);
+    stream_store_config(&out->config, &hal);
+    if (out->conv)
+        converter_reconfigure(out->conv, &hal, false);
+    position_reset(&out->position);
+    return OK;
+}
+
+/*
+ * libaudiohal only keeps a weak reference to the callback, so the stream
+ * holds it from the first set_callback() on.
+ */
+static status_t out_set_callback_run(struct wrapper_stream_out *out)
+{
+    if (out->callback != nullptr)
+        return OK;
+
+    sp<WrapperStreamOutCallback> callback = new WrapperStreamOutCallback();
+    status_t ret = out->streamIface->setCallback(callback);
+    if (ret != OK) {
+        ALOGE("setCallback() error %d", ret);
+        return ret;
+    }
+
+    out->callback = callback;
+    return OK;
+}
+
+static status_t out_control_run(struct wrapper_stream_out *out, struct wrapper_control_op *op)
+{
+    switch (op->type) {
+    case CONTROL_SET_PARAMETERS:
+        return stream_set_parameters_run(out, *op->kvpairs);
+    case CONTROL_SET_VOLUME:
+        return out->dup ? out_duplicate_set_volume(out->dup, op->left, op->right) :
+                          out->streamIface->setVolume(op->left, op->right);
+    case CONTROL_STANDBY:
+        return out_standby_run(out);
+    case CONTROL_RECONFIGURE:
+        return out_reconfigure_run(out, *op->kvpairs);
+    case CONTROL_PAUSE:
+        position_reset(&out->position);
+        return out->streamIface->pause();
+    case CONTROL_RESUME:
+        position_reset(&out->position);
+        return out->streamIface->resume();
+    case CONTROL_DRAIN:
+        return out->streamIface->drain(op->early_notify);
+    case CONTROL_FLUSH:
+        position_reset(&out->position);
+        return out->streamIface->flush();
+    case CONTROL_SET_CALLBACK:
+        return out_set_callback_run(out);
+    case CONTROL_ADD_EFFECT:
+        return stream_add_effect(out->streamIface.load(), out, AUDIO_SESSION_OUTPUT_MIX,
+                                 out->hal_handle, op->effect);
+    case CONTROL_REMOVE_EFFECT:
+        return stream_remove_effect(out->streamIface.load(), out, op->effect);
+    case CONTROL_METADATA:
+        return out->streamIface->updateSourceMetadata(
+                *(const StreamOutHalInterface::SourceMetadata *)op->metadata);
+    }
+    return BAD_VALUE;
+}
+
+static void out_control_apply(struct wrapper_stream_out *out, uint32_t types)
+{
+    control_apply(&out->control, out, types, out_control_run);
+}
+
+/* The client never writes to the HAL streams of a duplicated output itself */
+static status_t out_control_submit(struct wrapper_stream_out *out,
+                                   struct wrapper_control_op *op)
+{
+    int timeout_ms = out->dup ? 0 : control_timeout_ms(&out->control, &out->config);
+
+    return control_submit(&out->control, out, op, timeout_ms, out_control_run);
+}
+
+static int out_standby(struct audio_stream *stream)
+{
+    ALOGV("out_standby");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_STANDBY;
+    return out_control_submit(out, &op);
+}
+
+static int out_dump(const struct audio_stream *stream, int fd)
+{
+    ALOGV("out_dump");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+
+    stream_dump_wrapper_state(fd, "output", out, out->module, &out->config, &out->stats);
+    params_cache_dump(fd, &out->params);
+    stream_effects_dump(fd, out);
+    converter_dump(fd, out->conv);
+    adapt_dump(fd, &out->adapt, out->config.buffer_size, out->config.frame_size);
+    tap_dump(fd, &out->tap);
+    soft_volume_dump(fd, &out->soft_volume);
+    control_dump(fd, &out->control);
+    out_async_dump(fd, out);
+    out_duplicate_dump(fd, out->dup);
+    position_dump(fd, out);
+
+    return out->streamIface->dump(fd);
+}
+
+static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    ALOGV("out_set_parameters");
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    static thread_local std::string forwarded;
+    struct wrapper_control_op op = {};
+    struct str_parms *parms;
+    int value;
+
+    if (params_create_wrapper(kvpairs, &parms))
+        return -ENOMEM;
+
+    if (parms) {
+        if (str_parms_get_int(parms, WRAPPER_PARAM_ASYNC_PERIODS, &value) == 0) {
+            out->async_periods.store(value, std::memory_order_relaxed);
+            str_parms_del(parms, WRAPPER_PARAM_ASYNC_PERIODS);
+        }
+
+        if (str_parms_get_int(parms, WRAPPER_PARAM_ASYNC_WRITE, &value) == 0) {
+            out->async_requested.store(value != 0 && out_async_supported(out),
+                                       std::memory_order_relaxed);
+            str_parms_del(parms, WRAPPER_PARAM_ASYNC_WRITE);
+        }
+
+        if (str_parms_get_int(parms, WRAPPER_PARAM_POSITION_RESYNC_MS, &value) == 0) {
+            out->position.resync_ms.store(value, std::memory_order_relaxed);
+            str_parms_del(parms, WRAPPER_PARAM_POSITION_RESYNC_MS);
+        }
+
+        if (str_parms_get_int(parms, WRAPPER_PARAM_ADAPTIVE_BUFFER, &value) == 0) {
+            out->adapt.mode.store(adapt_valid_mode(value), std::memory_order_relaxed);
+            str_parms_del(parms, WRAPPER_PARAM_ADAPTIVE_BUFFER);
+        }
+
+        if (str_parms_get_int(parms, WRAPPER_PARAM_TAP, &value) == 0) {
+            struct wrapper_pcm_format pcm;
+
+            if (out->conv)
+                pcm = out->conv->client;
+            else
+                converter_set_format(&pcm, out->config.sample_rate, out->config.channel_mask,
+                                     out->config.format, false);
+            tap_set_enabled(&out->tap, value != 0, "output", out->handle,
+                            WRAPPER_TAP_OUTPUT, &pcm);
+            str_parms_del(parms, WRAPPER_PARAM_TAP);
+        }
+
+        params_cache_filter_remaining(&out->params, parms, &forwarded);
+        str_parms_destroy(parms);
+    } else {
+        params_cache_filter(&out->params, kvpairs, &forwarded);
+    }
+
+    if (forwarded.empty())
+        return OK;
+
+    op.type = params_change_stream_config(forwarded.c_str()) ? CONTROL_RECONFIGURE :
+                                                               CONTROL_SET_PARAMETERS;
+    op.kvpairs = &forwarded;
+    return out_control_submit(out, &op);
+}
+
+static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
+{
+    ALOGV("out_get_parameters");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    return params_cache_get(&out->params, out->streamIface.load(), keys);
+}
+
+static uint32_t out_get_latency(const struct audio_stream_out *stream)
+{
+    ALOGV("out_get_latency");
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+
+    uint32_t latency = 0;
+    if (out->dup)
+        latency = out_duplicate_latency_ms(out->dup);
+    else
+        out->streamIface->getLatency(&latency);
+    latency += out_async_latency_ms(out);
+
+    if (out->conv)
+        latency += converter_latency_ms(out->conv);
+
+    return latency;
+}
+
+static int out_set_volume(struct audio_stream_out *stream, float left,
+        float right)
+{
+    ALOGV("out_set_volume: Left:%f Right:%f", left, right);
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+
+    out->volume_left.store(left, std::memory_order_relaxed);
+    out->volume_right.store(right, std::memory_order_relaxed);
+
+    /* INVALID_OPERATION is also what a legacy HAL's -ENOSYS arrives as */
+    if (!out->soft_volume.active.load(std::memory_order_relaxed)) {
+        struct wrapper_control_op op = {};
+
+        op.type = CONTROL_SET_VOLUME;
+        op.left = left;
+        op.right = right;
+        int ret = out_control_submit(out, &op);
+
+        if (ret != INVALID_OPERATION ||
+            !soft_volume_enable(&out->soft_volume, &out->config, "output", out->handle))
+            return ret;
+
+        /* Duplicated targets that did take it must not apply it twice */
+        if (out->dup)
+            out_duplicate_set_volume(out->dup, 1.0f, 1.0f);
+    }
+
+    soft_volume_set(&out->soft_volume, left, right);
+    return 0;
+}
+
+/*
+ * Data path: by default the caller's buffer is handed to libaudiohal
+ * untouched, which copies it straight into the stream's fast message queue
+ * shared with the HAL service. That memcpy is then the only copy; the queue
+ * is private to libaudiohal and cannot be mapped from here. Streams that
+ * need a truly copy-free path have to be opened as MMAP streams. Audio is
+ * staged in a buffer of the wrapper's own, an extra copy each, when:
+ *  - the writer thread runs, see out_async_write() (the capture thread is
+ *    the same for inputs, see in_async_read()),
+ *  - the HAL opened the stream in another format than the client asked
+ *    for, see out_convert_write(),
+ *  - the wrapper applies the volume, see out_soft_volume(),
+ *  - the output is duplicated to several HAL streams, see
+ *    out_duplicate_write(),
+ *  - a tap is attached, which copies what was written, see tap_record().
+ */
+static ssize_t out_write_hal(struct wrapper_stream_out *out, const void* buffer,
+        size_t bytes)
+{
+    size_t written = 0;
+
+    if (stream_hal_stale(out->adev, &out->hal_generation))
+        out_recover(out);
+
+    if (out->soft_volume.active.load(std::memory_order_acquire))
+        buffer = out_soft_volume(out, buffer, bytes);
+
+    if (out->dup)
+        return out_duplicate_write(out, buffer, bytes);
+
+    out_async_apply_mode(out);
+
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_relaxed);
+    if (writer && writer->running.load(std::memory_order_relaxed))
+        return out_async_write(out, writer, buffer, bytes);
+
+    /* Standby waits for the end of out_write(), not to cut a conversion short */
+    out_control_apply(out, CONTROL_STREAM_OPS);
+
+    int64_t start_ns = monotonic_ns();
+    status_t ret = out->streamIface->write(buffer, bytes, &written);
+
+    /* Once the HAL service is back, the same buffer goes to the reopened stream */
+    if (hal_transport_error(ret) &&
+        adev_recover(out->adev, out->hal_generation.load(std::memory_order_relaxed))) {
+        out_recover(out);
+        ret = out->streamIface->write(buffer, bytes, &written);
+    }
+
+    stream_stats_record(&out->stats, start_ns, monotonic_ns(), bytes, written, ret);
+    TRACE_EVENT(TRACE_OUT_WRITE, out, ret == OK ? written : bytes, ret);
+    if (ret != OK) {
+        return ret;
+    }
+
+    if (out->config.frame_size)
+        counter_add(&out->position.frames_written, written / out->config.frame_size);
+
+    return written;
+}
+
+/*
+ * Returns client bytes consumed. Each converted chunk is handed over in
+ * full unless the HAL stops taking it, e.g. a writer ring that stayed full,
+ * in which case the part it took is counted at the client's rate.
+ */
+static ssize_t out_convert_write(struct wrapper_stream_out *out, const void* buffer,
+        size_t bytes)
+{
+    struct wrapper_converter *conv = out->conv;
+    const uint8_t *src = (const uint8_t *)buffer;
+    size_t frames = bytes / conv->client.frame_size;
+    size_t done = 0;
+
+    while (done < frames) {
+        size_t chunk = std::min(frames - done, conv->chunk_frames);
+        size_t hal_bytes = converter_process_output(conv, src + done * conv->client.frame_size,
+                                                    chunk) * conv->hal.frame_size;
+        size_t hal_done = 0;
+
+        while (hal_done < hal_bytes) {
+            ssize_t written = out_write_hal(out, conv->hal_buffer.data() + hal_done,
+                                            hal_bytes - hal_done);
+            if (written <= 0) {
+                if (written < 0 && !done && !hal_done)
+                    return written;
+                done += chunk * hal_done / hal_bytes;
+                return done * conv->client.frame_size;
+            }
+            hal_done += written;
+        }
+        done += chunk;
+    }
+
+    return done * conv->client.frame_size;
+}
+
+static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
+        size_t bytes)
+{
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+
+    /* Once the queue exists an empty write is still a round-trip to the
+     * HAL writer thread, and it can never make progress */
+    if (bytes == 0)
+        return 0;
+
+    if (!control_enter(&out->control))
+        return -ENODEV;
+
+    if (out->adapt.mode.load(std::memory_order_relaxed) != ADAPT_OFF)
+        adapt_record(&out->adapt, out->conv ?
+                adapt_duration_ns(bytes, out->conv->client.frame_size,
+                                  out->conv->client.sample_rate) :
+                adapt_duration_ns(bytes, out->config.frame_size, out->config.sample_rate));
+
+    ssize_t ret = out->conv ? out_convert_write(out, buffer, bytes) :
+                              out_write_hal(out, buffer, bytes);
+
+    struct wrapper_pcm_tap *tap = out->tap.load(std::memory_order_acquire);
+    if (tap && tap->enabled.load(std::memory_order_relaxed))
+        tap_record(tap, buffer, ret, out->conv ? out->conv->client.frame_size :
+                                                 out->config.frame_size.load());
+
+    /* The writer thread runs the rest between its own writes */
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_relaxed);
+    if (writer && writer->running.load(std::memory_order_relaxed))
+        out_control_apply(out, out->conv ? CONTROL_STANDBY | CONTROL_RECONFIGURE :
+                                           CONTROL_STANDBY);
+    else
+        out_control_apply(out, CONTROL_ALL_OPS);
+    control_leave(&out->control);
+
+    return ret;
+}
+
+/*
+ * PulseAudio's timer scheduling asks for positions several times per
+ * period. Between resyncs the answer is extrapolated from the last one the
+ * HAL gave, so most queries never leave the process.
+ */
+static int out_get_render_position(const struct audio_stream_out *stream,
+        uint32_t *dsp_frames)
+{
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_position_clock *clock = &out->position;
+    *dsp_frames = 0;
+
+    if (!position_interpolated(out)) {
+        status_t ret = out->streamIface->getRenderPosition(dsp_frames);
+        TRACE_EVENT(TRACE_OUT_RENDER_POSITION, out, *dsp_frames, ret);
+        *dsp_frames = (uint32_t)converter_client_frames(out->conv, *dsp_frames);
+        return ret;
+    }
+
+    std::lock_guard<std::mutex> lock(clock->lock);
+    int64_t now_ns = monotonic_ns();
+
+    if (position_needs_resync(clock, &clock->render, now_ns)) {
+        status_t ret = out->streamIface->getRenderPosition(dsp_frames);
+        TRACE_EVENT(TRACE_OUT_RENDER_POSITION, out, *dsp_frames, ret);
+        counter_add(&clock->hal_queries, 1);
+        if (ret != OK) {
+            clock->render.valid = false;
+            return ret;
+        }
+
+        /* The render position carries no timestamp of its own */
+        position_anchor_update(clock, &clock->render, *dsp_frames, now_ns, now_ns,
+                               out->config.sample_rate);
+    } else {
+        counter_add(&clock->interpolated, 1);
+    }
+
+    *dsp_frames = (uint32_t)converter_client_frames(out->conv,
+            position_report(clock, &clock->render, now_ns));
+    return 0;
+}
+
+/* A duplicating output reports the position all of its targets reached */
+static status_t out_hal_presentation_position(const struct wrapper_stream_out *out,
+                                              uint64_t *frames, struct timespec *timestamp)
+{
+    if (out->dup)
+        return out_duplicate_position(out->dup, frames, timestamp);
+    return out->streamIface->getPresentationPosition(frames, timestamp);
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                   uint64_t *frames, struct timespec *timestamp)
+{
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_position_clock *clock = &out->position;
+    *frames = 0;
+
+    if (!position_interpolated(out)) {
+        status_t ret = out_hal_presentation_position(out, frames, timestamp);
+        TRACE_EVENT(TRACE_OUT_PRESENTATION_POSITION, out, *frames, ret);
+        *frames = converter_client_frames(out->conv, *frames);
+        return ret;
+    }
+
+    std::lock_guard<std::mutex> lock(clock->lock);
+    int64_t now_ns = monotonic_ns();
+
+    if (position_needs_resync(clock, &clock->presentation, now_ns)) {
+        status_t ret = out_hal_presentation_position(out, frames, timestamp);
+        TRACE_EVENT(TRACE_OUT_PRESENTATION_POSITION, out, *frames, ret);
+        counter_add(&clock->hal_queries, 1);
+        if (ret != OK) {
+            clock->presentation.valid = false;
+            return ret;
+        }
+
+        int64_t time_ns = (int64_t)timestamp->tv_sec * 1000000000LL + timestamp->tv_nsec;
+        position_anchor_update(clock, &clock->presentation, *frames, time_ns, now_ns,
+                               out->config.sample_rate);
+    } else {
+        counter_add(&clock->interpolated, 1);
+    }
+
+    /* Reported as of now, which is equivalent to the HAL's older pair */
+    *frames = converter_client_frames(out->conv,
+            position_report(clock, &clock->presentation, now_ns));
+    timestamp->tv_sec = now_ns / 1000000000LL;
+    timestamp->tv_nsec = now_ns % 1000000000LL;
+    return 0;
+}
+
+
+static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+{
+    ALOGV("out_add_audio_effect: %p", effect);
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_ADD_EFFECT;
+    op.effect = effect;
+    return out_control_submit(out, &op);
+}
+
+static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+{
+    ALOGV("out_remove_audio_effect: %p", effect);
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_REMOVE_EFFECT;
+    op.effect = effect;
+    return out_control_submit(out, &op);
+}
+
+static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
+        int64_t *timestamp)
+{
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    *timestamp = 0;
+
+    status_t ret = out->streamIface->getNextWriteTimestamp(timestamp);
+    ALOGV("out_get_next_write_timestamp: %ld", (long int)(*timestamp));
+    return ret;
+}
+
+static int out_set_callback(struct audio_stream_out *stream,
+        stream_callback_t callback, void *cookie)
+{
+    ALOGV("out_set_callback: %p", callback);
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_SET_CALLBACK;
+    status_t ret = out_control_submit(out, &op);
+    if (ret != OK)
+        return ret;
+
+    out->callback->setClientCallback(callback, cookie);
+    return 0;
+}
+
+static int out_pause(struct audio_stream_out *stream)
+{
+    ALOGV("out_pause");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_PAUSE;
+    return out_control_submit(out, &op);
+}
+
+static int out_resume(struct audio_stream_out *stream)
+{
+    ALOGV("out_resume");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_RESUME;
+    return out_control_submit(out, &op);
+}
+
+static int out_drain(struct audio_stream_out *stream, audio_drain_type_t type)
+{
+    ALOGV("out_drain: type: %d", type);
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_DRAIN;
+    op.early_notify = type == AUDIO_DRAIN_EARLY_NOTIFY;
+    return out_control_submit(out, &op);
+}
+
+static int out_flush(struct audio_stream_out *stream)
+{
+    ALOGV("out_flush");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_FLUSH;
+    return out_control_submit(out, &op);
+}
+
+static int out_start(const struct audio_stream_out *stream)
+{
+    ALOGV("out_start");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    return out->streamIface->start();
+}
+
+static int out_stop(const struct audio_stream_out *stream)
+{
+    ALOGV("out_stop");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    return out->streamIface->stop();
+}
+
+static int out_create_mmap_buffer(const struct audio_stream_out *stream,
+        int32_t min_size_frames, struct audio_mmap_buffer_info *info)
+{
+    ALOGV("out_create_mmap_buffer: min_size_frames: %d", min_size_frames);
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    return stream_create_mmap_buffer(out->streamIface.load(), &out->config, &out->mmap,
+                                     min_size_frames, info);
+}
+
+static int out_get_mmap_position(const struct audio_stream_out *stream,
+        struct audio_mmap_position *position)
+{
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    return out->streamIface->getMmapPosition(position);
+}
+
+static void out_update_source_metadata(struct audio_stream_out *stream,
+        const struct source_metadata *source_metadata)
+{
+    ALOGV("out_update_source_metadata");
+
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    StreamOutHalInterface::SourceMetadata metadata;
+
+    struct wrapper_control_op op = {};
+
+    if (source_metadata)
+        metadata.tracks.assign(source_metadata->tracks,
+                               source_metadata->tracks + source_metadata->track_count);
+    op.type = CONTROL_METADATA;
+    op.metadata = &metadata;
+    out_control_submit(out, &op);
+}
+
+/** Capture thread **/
+
+/* Batching only makes sense for PCM inputs the HAL serves through read() */
+static bool in_async_supported(const struct wrapper_stream_in *in)
+{
+    return audio_is_linear_pcm(in->config.format) && !(in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ);
+}
+
+static uint64_t in_async_burst_ms(const struct wrapper_stream_in *in,
+                                  const struct wrapper_async_reader *reader)
+{
+    if (!in->config.sample_rate || !in->config.frame_size)
+        return 20;
+    return reader->burst / in->config.frame_size * 1000 / in->config.sample_rate;
+}
+
+static void in_async_reader_loop(struct wrapper_stream_in *in,
+                                 struct wrapper_async_reader *reader)
+{
+    struct wrapper_ring *ring = &reader->ring;
+
+    while (reader->running.load(std::memory_order_acquire)) {
+        in_control_apply(in, CONTROL_STREAM_OPS);
+
+        uint8_t *data;
+        size_t contiguous = ring_peek_space(ring, &data);
+        size_t space = ring->size - ring_fill(ring);
+        bool overrun = space < reader->burst;
+        size_t bytes = overrun ? reader->burst : std::min(contiguous, reader->burst);
+        size_t read = 0;
+
+        if (overrun)
+            data = reader->scratch;
+
+        int64_t start_ns = monotonic_ns();
+        status_t ret = in->streamIface->read(data, bytes, &read);
+        stream_stats_record(&in->stats, start_ns, monotonic_ns(), bytes, read, ret);
+        TRACE_EVENT(TRACE_IN_READ, in, ret == OK ? read : bytes, ret);
+
+        if (ret != OK) {
+            /* The client reopens the stream, and stops this thread for it */
+            if (hal_transport_error(ret) &&
+                adev_recover(in->adev, in->hal_generation.load(std::memory_order_relaxed))) {
+                {
+                    std::lock_guard<std::mutex> lock(reader->wake_lock);
+                }
+                reader->data_cond.notify_one();
+            }
+
+            /* Keep the pace of a working stream instead of spinning on errors */
+            std::unique_lock<std::mutex> lock(reader->wake_lock);
+            reader->stop_cond.wait_for(lock, std::chrono::milliseconds(in_async_burst_ms(in, reader)),
+                                       [reader] {
+                return !reader->running.load(std::memory_order_acquire);
+            });
+            continue;
+        }
+
+        if (overrun) {
+            counter_add(&reader->overruns, 1);
+            if (in->config.frame_size)
+                counter_add(&reader->frames_lost, read / in->config.frame_size);
+            continue;
+        }
+
+        ring_commit(ring, read);
+
+        /* Taking wake_lock orders this with the waiter's predicate check */
+        {
+            std::lock_guard<std::mutex> lock(reader->wake_lock);
+        }
+        reader->data_cond.notify_one();
+    }
+}
+
+static void in_async_stop(struct wrapper_async_reader *reader)
+{
+    if (!reader->thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(reader->wake_lock);
+        reader->running.store(false, std::memory_order_release);
+    }
+    reader->stop_cond.notify_one();
+    reader->data_cond.notify_one();
+    reader->thread.join();
+}
+
+static bool in_async_start(struct wrapper_stream_in *in)
+{
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_acquire);
+    int periods = property_get_int32(WRAPPER_PROP_ASYNC_READ_BURST, ASYNC_READ_DEFAULT_BURST);
+    int bursts = property_get_int32(WRAPPER_PROP_ASYNC_READ_BURSTS, ASYNC_READ_DEFAULT_BURSTS);
+
+    if (!reader) {
+        reader = new wrapper_async_reader();
+        in->async.store(reader, std::memory_order_release);
+    }
+
+    if (periods < 1)
+        periods = 1;
+    if (bursts < 2)
+        bursts = 2;
+
+    size_t burst = (size_t)periods * in->config.buffer_size;
+    if (reader->burst != burst) {
+        free(reader->scratch);
+        reader->scratch = (uint8_t *)malloc(burst);
+        reader->burst = reader->scratch ? burst : 0;
+    }
+    if (!burst || !reader->scratch || !ring_init(&reader->ring, (size_t)bursts * burst)) {
+        ALOGE("in_async_start: cannot allocate %d bursts of %zu bytes", bursts, burst);
+        return false;
+    }
+
+    reader->running.store(true, std::memory_order_release);
+    reader->thread = std::thread(in_async_reader_loop, in, reader);
+
+    struct sched_param param = {};
+    param.sched_priority = property_get_int32(WRAPPER_PROP_ASYNC_PRIORITY,
+                                              ASYNC_DEFAULT_PRIORITY);
+    int err = pthread_setschedparam(reader->thread.native_handle(), SCHED_FIFO, &param);
+    if (err)
+        ALOGW("in_async_start: cannot use SCHED_FIFO priority %d: %s",
+              param.sched_priority, strerror(err));
+    pthread_setname_np(reader->thread.native_handle(), "audio_hw_reader");
+
+    ALOGI("in_async_start: %p bursts of %zu bytes, ring of %zu bytes", in, burst,
+          reader->ring.size);
+    return true;
+}
+
+/* Frames captured but not yet read by the client */
+static uint64_t in_async_queued_frames(const struct wrapper_stream_in *in)
+{
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_acquire);
+
+    if (!reader || !reader->running.load(std::memory_order_relaxed) || !in->config.frame_size)
+        return 0;
+
+    return ring_fill(&reader->ring) / in->config.frame_size;
+}
+
+/* Same contract as out_async_apply_mode() */
+static void in_async_apply_mode(struct wrapper_stream_in *in)
+{
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_relaxed);
+    bool running = reader && reader->running.load(std::memory_order_relaxed);
+    bool requested = in->async_requested.load(std::memory_order_relaxed);
+
+    if (running == requested)
+        return;
+
+    if (requested) {
+        if (!in_async_start(in))
+            in->async_requested.store(false, std::memory_order_relaxed);
+    } else {
+        /* What was captured already is dropped along with the thread */
+        in_async_stop(reader);
+        ring_flush(&reader->ring);
+        ALOGI("in_async_stop: %p", in);
+    }
+}
+
+/*
+ * Serves the client from the ring, blocking like a HAL read until the
+ * whole request is there. A request is never waited on for longer than the
+ * ring takes to fill, so a stalled HAL shows up as a short read.
+ */
+static ssize_t in_async_read(struct wrapper_stream_in *in,
+                             struct wrapper_async_reader *reader,
+                             void *buffer, size_t bytes)
+{
+    struct wrapper_ring *ring = &reader->ring;
+    uint64_t ring_ms = in_async_burst_ms(in, reader) * (ring->size / reader->burst);
+    size_t done = 0;
+
+    while (done < bytes) {
+        uint8_t *data;
+        size_t available = ring_peek(ring, &data);
+
+        if (available == 0) {
+            counter_add(&reader->client_waits, 1);
+
+            std::unique_lock<std::mutex> lock(reader->wake_lock);
+            if (!reader->data_cond.wait_for(lock, std::chrono::milliseconds(ring_ms), [in, reader, ring] {
+                    return ring_fill(ring) > 0 || !reader->running.load(std::memory_order_acquire) ||
+                           stream_hal_stale(in->adev, &in->hal_generation);
+                }) || ring_fill(ring) == 0)
+                break;
+            continue;
+        }
+
+        size_t chunk = std::min(available, bytes - done);
+        memcpy((uint8_t *)buffer + done, data, chunk);
+        ring_consume(ring, chunk);
+        done += chunk;
+    }
+
+    return done > 0 ? (ssize_t)done : -EIO;
+}
+
+static void in_async_dump(int fd, const struct wrapper_stream_in *in)
+{
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_acquire);
+
+    if (!reader)
+        return;
+
+    dprintf(fd, "  capture thread: %s, ring: %zu/%zu bytes, burst: %zu bytes, latency: %llums\n",
+            reader->running.load(std::memory_order_relaxed) ? "running" : "stopped",
+            reader->ring.size ? ring_fill(&reader->ring) : 0, reader->ring.size, reader->burst,
+            (unsigned long long)(in->config.sample_rate ?
+                    in_async_queued_frames(in) * 1000 / in->config.sample_rate : 0));
+    dprintf(fd, "  capture thread: overruns: %llu, client waits: %llu\n",
+            (unsigned long long)reader->overruns.load(std::memory_order_relaxed),
+            (unsigned long long)reader->client_waits.load(std::memory_order_relaxed));
+}
+
+static void in_async_release(struct wrapper_stream_in *in)
+{
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_acquire);
+
+    if (!reader)
+        return;
+
+    in_async_stop(reader);
+    ring_release(&reader->ring);
+    free(reader->scratch);
+    delete reader;
+    in->async.store(NULL, std::memory_order_release);
+}
+
+/** Microphones **/
+
+static void microphone_from_info(const media::MicrophoneInfo &info,
+                                 struct audio_microphone_characteristic_t *mic)
+{
+    const std::vector<float> &location = info.getGeometricLocation();
+    const std::vector<float> &orientation = info.getOrientation();
+    const std::vector<std::vector<float>> &responses = info.getFrequencyResponses();
+    const std::vector<int> &mapping = info.getChannelMapping();
+
+    memset(mic, 0, sizeof(*mic));
+    snprintf(mic->device_id, sizeof(mic->device_id), "%s", info.getDeviceId().c_str());
+    mic->id = (audio_port_handle_t)info.getPortId();
+    mic->device = (audio_devices_t)info.getType();
+    snprintf(mic->address, sizeof(mic->address), "%s", info.getAddress().c_str());
+    mic->location = (audio_microphone_location_t)info.getDeviceLocation();
+    mic->group = (audio_microphone_group_t)info.getDeviceGroup();
+    mic->index_in_the_group = info.getIndexInTheGroup();
+    mic->sensitivity = info.getSensitivity();
+    mic->max_spl = info.getMaxSpl();
+    mic->min_spl = info.getMinSpl();
+    mic->directionality = (audio_microphone_directionality_t)info.getDirectionality();
+
+    size_t channels = std::min(mapping.size(),
+                               sizeof(mic->channel_mapping) / sizeof(mic->channel_mapping[0]));
+    for (size_t i = 0; i < channels; i++)
+        mic->channel_mapping[i] = (audio_microphone_channel_mapping_t)mapping[i];
+
+    /* Stored as a pair of vectors: frequencies, then responses */
+    if (responses.size() == 2) {
+        size_t count = std::min(std::min(responses[0].size(), responses[1].size()),
+                                (size_t)AUDIO_MICROPHONE_MAX_FREQUENCY_RESPONSES);
+        for (size_t i = 0; i < count; i++) {
+            mic->frequency_responses[0][i] = responses[0][i];
+            mic->frequency_responses[1][i] = responses[1][i];
+        }
+        mic->num_frequency_responses = count;
+    }
+
+    if (location.size() == 3)
+        mic->geometric_location = { location[0], location[1], location[2] };
+    if (orientation.size() == 3)
+        mic->orientation = { orientation[0], orientation[1], orientation[2] };
+}
+
+/* On entry *mic_count is the capacity of mic_array */
+static int microphones_copy(const std::vector<media::MicrophoneInfo> &microphones,
+                            struct audio_microphone_characteristic_t *mic_array,
+                            size_t *mic_count)
+{
+    size_t count = std::min(microphones.size(), *mic_count);
+
+    for (size_t i = 0; i < count; i++)
+        microphone_from_info(microphones[i], &mic_array[i]);
+    *mic_count = count;
+
+    return 0;
+}
+
+/** audio_stream_in implementation **/
+
+static uint32_t in_get_sample_rate(const struct audio_stream *stream)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    in->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+
+    ALOGV("in_get_sample_rate: %d", in->config.sample_rate.load());
+    if (in->conv)
+        return in->conv->client.sample_rate;
+    return in->config.sample_rate;
+}
+
+static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
+{
+    ALOGV("in_set_sample_rate: %d", rate);
+    return -ENOSYS;
+}
+
+static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    in->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+
+    ALOGV("in_get_channels: %d", in->config.channel_mask.load());
+    if (in->conv)
+        return in->conv->client.channel_mask;
+    return in->config.channel_mask;
+}
+
+static audio_format_t in_get_format(const struct audio_stream *stream)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    in->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+
+    ALOGV("in_get_format: %d", in->config.format.load());
+    if (in->conv)
+        return in->conv->client.format;
+    return in->config.format;
+}
+
+static int in_set_format(struct audio_stream *stream, audio_format_t format)
+{
+    return -ENOSYS;
+}
+
+static size_t in_get_buffer_size(const struct audio_stream *stream)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    in->config.ipcs_saved.fetch_add(1, std::memory_order_relaxed);
+
+    ALOGV("in_get_buffer_size: %zu", in->config.buffer_size.load());
+    if (in->conv)
+        return adapt_buffer_size(&in->adapt, converter_client_buffer_size(in->conv),
+                                 in->conv->client.frame_size);
+    return adapt_buffer_size(&in->adapt, in->config.buffer_size, in->config.frame_size);
+}
+
+/* Run by the client thread or a control thread, never the capture thread it stops */
+static status_t in_standby_run(struct wrapper_stream_in *in)
+{
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_acquire);
+
+    /*
+     * The thread would bring the HAL straight out of standby again, so it
+     * is stopped, and restarted by the next read.
+     */
+    if (reader && reader->running.load(std::memory_order_acquire)) {
+        in_async_stop(reader);
+        ring_flush(&reader->ring);
+    }
+
+    if (in->conv)
+        converter_reset(in->conv);
+    adapt_reset(&in->adapt);
+    control_stopped(&in->control);
+
+    return in->streamIface->standby();
+}
+
+/*
+ * Same for an input. Audio the capture thread queued in the old config is
+ * dropped, and the thread restarted by the next read.
+ */
+static status_t in_reconfigure_run(struct wrapper_stream_in *in, const std::string& kvpairs)
+{
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_acquire);
+    struct wrapper_hal_config hal;
+
+    if (reader && reader->running.load(std::memory_order_acquire)) {
+        in_async_stop(reader);
+        ring_flush(&reader->ring);
+    }
+
+    status_t ret = stream_set_parameters_run(in, kvpairs);
+    if (ret != OK)
+        return ret;
+
+    stream_query_config(in->streamIface.load(), &in->config, &hal);
+    stream_store_config(&in->config, &hal);
+    if (in->conv)
+        converter_reconfigure(in->conv, &hal, true);
+    return OK;
+}
+
+static status_t in_control_run(struct wrapper_stream_in *in, struct wrapper_control_op *op)
+{
+    switch (op->type) {
+    case CONTROL_SET_PARAMETERS:
+        return stream_set_parameters_run(in, *op->kvpairs);
+    case CONTROL_SET_VOLUME:
+        return in->streamIface->setGain(op->left);
+    case CONTROL_STANDBY:
+        return in_standby_run(in);
+    case CONTROL_RECONFIGURE:
+        return in_reconfigure_run(in, *op->kvpairs);
+    case CONTROL_ADD_EFFECT:
+        return stream_add_effect(in->streamIface.load(), in, (audio_session_t)in->handle,
+                                 in->handle, op->effect);
+    case CONTROL_REMOVE_EFFECT:
+        return stream_remove_effect(in->streamIface.load(), in, op->effect);
+    case CONTROL_METADATA:
+        return in->streamIface->updateSinkMetadata(
+                *(const StreamInHalInterface::SinkMetadata *)op->metadata);
+    default:
+        break;
+    }
+    return BAD_VALUE;
+}
+
+static void in_control_apply(struct wrapper_stream_in *in, uint32_t types)
+{
+    control_apply(&in->control, in, types, in_control_run);
+}
+
+static status_t in_control_submit(struct wrapper_stream_in *in, struct wrapper_control_op *op)
+{
+    return control_submit(&in->control, in, op, control_timeout_ms(&in->control, &in->config),
+                          in_control_run);
+}
+
+static int in_standby(struct audio_stream *stream)
+{
+    ALOGV("in_standby");
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    struct wrapper_control_op op = {};
+
+    op.type = CONTROL_STANDBY;
+    return in_control_submit(in, &op);
+}
+
+static int in_dump(const struct audio_stream *stream, int fd)
+{
+    ALOGV("in_dump");
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+
+    stream_dump_wrapper_state(fd, "input", in, in->module, &in->config, &in->stats);
+    params_cache_dump(fd, &in->params);
+    stream_effects_dump(fd, in);
+    converter_dump(fd, in->conv);
+    adapt_dump(fd, &in->adapt, in->config.buffer_size, in->config.frame_size);
+    tap_dump(fd, &in->tap);
+    soft_volume_dump(fd, &in->soft_volume);
+    control_dump(fd, &in->control);
+    in_async_dump(fd, in);
+
+    return in->streamIface->dump(fd);
+}
+
+static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    ALOGV("in_set_parameters");
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    static thread_local std::string forwarded;
+    struct wrapper_control_op op = {};
+    struct str_parms *parms;
+    int value;
+
+    if (params_create_wrapper(kvpairs, &parms))
+        return -ENOMEM;
+
+    if (parms) {
+        if (str_parms_get_int(parms, WRAPPER_PARAM_ASYNC_READ, &value) == 0) {
+            in->async_requested.store(value != 0 && in_async_supported(in),
+                                      std::memory_order_relaxed);
+            str_parms_del(parms, WRAPPER_PARAM_ASYNC_READ);
+        }
+
+        if (str_parms_get_int(parms, WRAPPER_PARAM_ADAPTIVE_BUFFER, &value) == 0) {
+            in->adapt.mode.store(adapt_valid_mode(value), std::memory_order_relaxed);
+            str_parms_del(parms, WRAPPER_PARAM_ADAPTIVE_BUFFER);
+        }
+
+        if (str_parms_get_int(parms, WRAPPER_PARAM_TAP, &value) == 0) {
+            struct wrapper_pcm_format pcm;
+
+            if (in->conv)
+                pcm = in->conv->client;
+            else
+                converter_set_format(&pcm, in->config.sample_rate, in->config.channel_mask,
+                                     in->config.format, true);
+            tap_set_enabled(&in->tap, value != 0, "input", in->handle,
+                            WRAPPER_TAP_INPUT, &pcm);
+            str_parms_del(parms, WRAPPER_PARAM_TAP);
+        }
+
+        params_cache_filter_remaining(&in->params, parms, &forwarded);
+        str_parms_destroy(parms);
+    } else {
+        params_cache_filter(&in->params, kvpairs, &forwarded);
+    }
+
+    if (forwarded.empty())
+        return OK;
+
+    op.type = params_change_stream_config(forwarded.c_str()) ? CONTROL_RECONFIGURE :
+                                                               CONTROL_SET_PARAMETERS;
+    op.kvpairs = &forwarded;
+    return in_control_submit(in, &op);
+}
+
+static char * in_get_parameters(const struct audio_stream *stream,
+        const char *keys)
+{
+    ALOGV("in_get_parameters");
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    return params_cache_get(&in->params, in->streamIface.load(), keys);
+}
+
+static int in_set_gain(struct audio_stream_in *stream, float gain)
+{
+    ALOGV("in_set_gain: %f", gain);
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+
+    in->gain.store(gain, std::memory_order_relaxed);
+
+    if (!in->soft_volume.active.load(std::memory_order_relaxed)) {
+        struct wrapper_control_op op = {};
+
+        op.type = CONTROL_SET_VOLUME;
+        op.left = gain;
+        op.right = gain;
+        int ret = in_control_submit(in, &op);
+
+        if (ret != INVALID_OPERATION ||
+            !soft_volume_enable(&in->soft_volume, &in->config, "input", in->handle))
+            return ret;
+    }
+
+    soft_volume_set(&in->soft_volume, gain, gain);
+    return 0;
+}
+
+/* See out_write_hal(): the HAL fills the caller's buffer from its queue */
+static ssize_t in_read_hal(struct wrapper_stream_in *in, void* buffer,
+                           size_t bytes)
+{
+    size_t read = 0;
+
+    if (stream_hal_stale(in->adev, &in->hal_generation))
+        in_recover(in);
+
+    /* Also restarts a capture thread that standby or recovery stopped */
+    in_async_apply_mode(in);
+
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_relaxed);
+    if (reader && reader->running.load(std::memory_order_relaxed)) {
+        ssize_t ret = in_async_read(in, reader, buffer, bytes);
+
+        /* The capture thread saw the HAL service restart: read from the reopened stream */
+        if (ret < 0 && stream_hal_stale(in->adev, &in->hal_generation))
+            return in_read_hal(in, buffer, bytes);
+        return in_soft_volume(in, buffer, ret);
+    }
+
+    in_control_apply(in, CONTROL_STREAM_OPS);
+
+    int64_t start_ns = monotonic_ns();
+    status_t ret = in->streamIface->read(buffer, bytes, &read);
+
+    if (hal_transport_error(ret) &&
+        adev_recover(in->adev, in->hal_generation.load(std::memory_order_relaxed))) {
+        in_recover(in);
+        ret = in->streamIface->read(buffer, bytes, &read);
+    }
+
+    stream_stats_record(&in->stats, start_ns, monotonic_ns(), bytes, read, ret);
+    TRACE_EVENT(TRACE_IN_READ, in, ret == OK ? read : bytes, ret);
+    if (ret != OK) {
+        return ret;
+    }
+
+    return in_soft_volume(in, buffer, read);
+}
+
+/* Reads up to a period from the HAL, converted to client channels in resample_in */
+static int in_convert_get_next_buffer(struct resampler_buffer_provider *provider,
+                                      struct resampler_buffer *buffer)
+{
+    struct wrapper_converter *conv = (struct wrapper_converter *)provider;
+
+    if (!conv->pending_frames) {
+        ssize_t read = in_read_hal(conv->in, conv->hal_buffer.data(),
+                                   conv->chunk_frames * conv->hal.frame_size);
+        if (read <= 0) {
+            conv->read_error = read;
+            buffer->raw = NULL;
+            buffer->frame_count = 0;
+            return read ? (int)read : -ENODATA;
+        }
+
+        size_t frames = read / conv->hal.frame_size;
+        const float *samples = converter_to_float(conv, &conv->hal, &conv->client,
+                                                  conv->hal_buffer.data(), frames);
+        memcpy_to_i16_from_float(conv->resample_in.data(), samples,
+                                 frames * conv->client.channels);
+        conv->pending_frames = frames;
+        conv->pending_offset = 0;
+    }
+
+    buffer->i16 = conv->resample_in.data() + conv->pending_offset * conv->client.channels;
+    buffer->frame_count = std::min(buffer->frame_count, conv->pending_frames);
+    return 0;
+}
+
+static void in_convert_release_buffer(struct resampler_buffer_provider *provider,
+                                      struct resampler_buffer *buffer)
+{
+    struct wrapper_converter *conv = (struct wrapper_converter *)provider;
+
+    conv->pending_offset += buffer->frame_count;
+    conv->pending_frames -= buffer->frame_count;
+}
+
+/* Fills the client's buffer a chunk at a time, returns client bytes */
+static ssize_t in_convert_read(struct wrapper_stream_in *in, void* buffer, size_t bytes)
+{
+    struct wrapper_converter *conv = in->conv;
+    uint8_t *dst = (uint8_t *)buffer;
+    size_t frames = bytes / conv->client.frame_size;
+    size_t done = 0;
+
+    conv->read_error = 0;
+    while (done < frames) {
+        size_t chunk = std::min(frames - done, conv->chunk_frames);
+
+        if (conv->resampler) {
+            conv->resampler->resample_from_provider(conv->resampler, conv->resample_out.data(),
+                                                    &chunk);
+            memcpy_by_audio_format(dst + done * conv->client.frame_size, conv->client.format,
+                                   conv->resample_out.data(), AUDIO_FORMAT_PCM_16_BIT,
+                                   chunk * conv->client.channels);
+        } else {
+            ssize_t read = in_read_hal(in, conv->hal_buffer.data(),
+                                       chunk * conv->hal.frame_size);
+            if (read <= 0) {
+                conv->read_error = read;
+                break;
+            }
+
+            chunk = read / conv->hal.frame_size;
+            const float *samples = converter_to_float(conv, &conv->hal, &conv->client,
+                                                      conv->hal_buffer.data(), chunk);
+            memcpy_by_audio_format(dst + done * conv->client.frame_size, conv->client.format,
+                                   samples, AUDIO_FORMAT_PCM_FLOAT,
+                                   chunk * conv->client.channels);
+        }
+
+        if (!chunk)
+            break;
+        done += chunk;
+    }
+
+    if (!done && conv->read_error < 0)
+        return conv->read_error;
+
+    return done * conv->client.frame_size;
+}
+
+static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
+                       size_t bytes)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+
+    if (bytes == 0)
+        return 0;
+
+    if (!control_enter(&in->control))
+        return -ENODEV;
+
+    if (in->adapt.mode.load(std::memory_order_relaxed) != ADAPT_OFF)
+        adapt_record(&in->adapt, in->conv ?
+                adapt_duration_ns(bytes, in->conv->client.frame_size,
+                                  in->conv->client.sample_rate) :
+                adapt_duration_ns(bytes, in->config.frame_size, in->config.sample_rate));
+
+    ssize_t ret = in->conv ? in_convert_read(in, buffer, bytes) :
+                             in_read_hal(in, buffer, bytes);
+
+    struct wrapper_pcm_tap *tap = in->tap.load(std::memory_order_acquire);
+    if (tap && tap->enabled.load(std::memory_order_relaxed))
+        tap_record(tap, buffer, ret, in->conv ? in->conv->client.frame_size :
+                                                in->config.frame_size.load());
+
+    /* A standby stops the capture thread, which runs the rest */
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_relaxed);
+    in_control_apply(in, reader && reader->running.load(std::memory_order_relaxed) ?
+                         CONTROL_STANDBY | CONTROL_RECONFIGURE : CONTROL_ALL_OPS);
+    control_leave(&in->control);
+
+    return ret;
+}
+
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    uint32_t framesLost = 0;
+
+    in->streamIface->getInputFramesLost(&framesLost);
+
+    /* Plus what the capture thread had to drop since the last call */
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_acquire);
+    if (reader)
+        framesLost += (uint32_t)reader->frames_lost.exchange(0, std::memory_order_relaxed);
+
+    framesLost = (uint32_t)converter_client_frames(in->conv, framesLost);
+
+    ALOGV("in_get_input_frames_lost: %d", framesLost);
+    return framesLost;
+}
+
+static int in_start(const struct audio_stream_in *stream)
+{
+    ALOGV("in_start");
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    return in->streamIface->start();
+}
+
+static int in_stop(const struct audio_stream_in *stream)
+{
+    ALOGV("in_stop");
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    return in->streamIface->stop();
+}
+
+static int in_create_mmap_buffer(const struct audio_stream_in *stream,
+        int32_t min_size_frames, struct audio_mmap_buffer_info *info)
+{
+    ALOGV("in_create_mmap_buffer: min_size_frames: %d", min_size_frames);
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    return stream_create_mmap_buffer(in->streamIface.load(), &in->config, &in->mmap,
+                                     min_size_frames, info);
+}
+
+static int in_get_mmap_position(const struct audio_stream_in *stream,
+        struct audio_mmap_position *position)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    return in->streamIface->getMmapPosition(position);
+}
+
+/*
+ * The HAL's pair is moved back over the frames queued in the capture ring,
+ * to the next frame the client reads and when it was captured, so the
+ * ring's depth shows as delay instead of going unreported. Frames held by
+ * the converter are few enough to be left out.
+ */
+static int in_get_capture_position(const struct audio_stream_in *stream,
+        int64_t *frames, int64_t *time)
+{
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+
+    status_t ret = in->streamIface->getCapturePosition(frames, time);
+    if (ret != OK)
+        return ret;
+
+    int64_t queued = (int64_t)std::min(in_async_queued_frames(in), (uint64_t)*frames);
+    if (queued && in->config.sample_rate) {
+        *frames -= queued;
+        *time -= queued * 1000000000LL / in->config.sample_rate;
+    }
+    *frames = (int64_t)converter_client_frames(in->conv, (uint64_t)*frames);
+    return 0;
+}
+
+static int in_get_active_microphones(const struct audio_stream_in *stream,
+        struct audio_microphone_characteristic_t *mic_array, size_t *mic_count)
+{
+    ALOGV("in_get_active_microphones");
+
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    std::vector<media::MicrophoneInfo> microphones;
+
+    status_t ret = in->streamIface->getActiveMicrophones(&microphones);
+    if (ret != OK)
+        return ret;
 
-    out->streamIface->getSampleRate(&rate);
-    return rate;
+    return microphones_copy(microphones, mic_array, mic_count);
 }
 
-static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
+static void in_update_sink_metadata(struct audio_stream_in *stream,
+        const struct sink_metadata *sink_metadata)
 {
-    ALOGV("out_set_sample_rate: %d", rate);
-    return -ENOSYS;
-}
+    ALOGV("in_update_sink_metadata");
 
-static size_t out_get_buffer_size(const struct audio_stream *stream)
-{
-    ALOGV("out_get_buffer_size");
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    StreamInHalInterface::SinkMetadata metadata;
 
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    size_t buffer_size = 0;
+    struct wrapper_control_op op = {};
 
-    out->streamIface->getBufferSize(&buffer_size);
-    return buffer_size;
+    if (sink_metadata)
+        metadata.tracks.assign(sink_metadata->tracks,
+                               sink_metadata->tracks + sink_metadata->track_count);
+    op.type = CONTROL_METADATA;
+    op.metadata = &metadata;
+    in_control_submit(in, &op);
 }
 
-static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
+/*
+ * The legacy API has no notion of audio sessions, so pre-processing on an
+ * input runs in a session of its own, named after its io handle.
+ */
+static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    ALOGV("out_get_channels");
+    ALOGV("in_add_audio_effect: %p", effect);
 
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    audio_channel_mask_t mask = 0;
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    struct wrapper_control_op op = {};
 
-    out->streamIface->getChannelMask(&mask);
-    return mask;
+    op.type = CONTROL_ADD_EFFECT;
+    op.effect = effect;
+    return in_control_submit(in, &op);
 }
 
-static audio_format_t out_get_format(const struct audio_stream *stream)
+static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    ALOGV("out_get_format");
+    ALOGV("in_remove_audio_effect: %p", effect);
 
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    audio_format_t format = {};
+    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    struct wrapper_control_op op = {};
 
-    out->streamIface->getFormat(&format);
-    return format;
+    op.type = CONTROL_REMOVE_EFFECT;
+    op.effect = effect;
+    return in_control_submit(in, &op);
 }
 
-static int out_set_format(struct audio_stream *stream, audio_format_t format)
+/** HAL module registry **/
+
+/*
+ * The libaudiohal factory and the HAL devices opened through it are shared
+ * by every wrapper device in the process. Devices are opened on a thread of
+ * their own as soon as they are first named, so several modules come up in
+ * parallel and a caller only blocks for the one it actually needs.
+ */
+static std::mutex module_cache_lock;
+static std::map<std::string, std::shared_future<sp<DeviceHalInterface>>> module_cache;
+
+static sp<DevicesFactoryHalInterface> devices_factory()
 {
-    ALOGV("out_set_format: %d",format);
-    return -ENOSYS;
+    static sp<DevicesFactoryHalInterface> factory = DevicesFactoryHalInterface::create();
+    return factory;
 }
 
-static int out_standby(struct audio_stream *stream)
+static std::shared_future<sp<DeviceHalInterface>> module_cache_open(const std::string& name)
 {
-    ALOGV("out_standby");
-
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    return out->streamIface->standby();
+    std::lock_guard<std::mutex> lock(module_cache_lock);
+
+    auto it = module_cache.find(name);
+    if (it != module_cache.end())
+        return it->second;
+
+    std::shared_future<sp<DeviceHalInterface>> device =
+            std::async(std::launch::async, [name] {
+                sp<DeviceHalInterface> deviceIface;
+                status_t ret = devices_factory()->openDevice(name.c_str(), &deviceIface);
+                if (ret != OK) {
+                    ALOGE("devicesFactoryHal->openDevice() error %d loading module %s",
+                          ret, name.c_str());
+                    deviceIface.clear();
+                }
+                return deviceIface;
+            }).share();
+
+    module_cache[name] = device;
+    return device;
 }
 
-static int out_dump(const struct audio_stream *stream, int fd)
+/* Every cached device is a dead proxy once the HAL service restarted */
+static void module_cache_clear()
 {
-    ALOGV("out_dump");
+    std::map<std::string, std::shared_future<sp<DeviceHalInterface>>> dead;
 
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    return out->streamIface->dump(fd);
+    {
+        std::lock_guard<std::mutex> lock(module_cache_lock);
+        dead.swap(module_cache);
+    }
+    /* Destroyed unlocked, as an open still running is waited for */
 }
 
-static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+static sp<DeviceHalInterface> module_cache_get(const std::string& name)
 {
-    ALOGV("out_set_parameters");
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    sp<DeviceHalInterface> deviceIface = module_cache_open(name).get();
+
+    /* Forget failures so that a later open can try again */
+    if (deviceIface == nullptr) {
+        std::lock_guard<std::mutex> lock(module_cache_lock);
+        auto it = module_cache.find(name);
+        if (it != module_cache.end() && it->second.get() == nullptr)
+            module_cache.erase(it);
+    }
 
-    String8 kvPairs(kvpairs);
-    return out->streamIface->setParameters(kvPairs);
+    return deviceIface;
 }
 
-static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
-{
-    ALOGV("out_get_parameters");
+/* Devices that are served by a dedicated HAL module rather than the primary one */
+static const struct {
+    const char *module;
+    audio_devices_t out_devices;
+    audio_devices_t in_devices;
+} module_routes[] = {
+    { AUDIO_HARDWARE_MODULE_ID_A2DP, AUDIO_DEVICE_OUT_ALL_A2DP, AUDIO_DEVICE_IN_BLUETOOTH_A2DP },
+    { "bluetooth", AUDIO_DEVICE_OUT_ALL_A2DP, AUDIO_DEVICE_IN_BLUETOOTH_A2DP },
+    { AUDIO_HARDWARE_MODULE_ID_USB, AUDIO_DEVICE_OUT_ALL_USB, AUDIO_DEVICE_IN_ALL_USB },
+    { AUDIO_HARDWARE_MODULE_ID_REMOTE_SUBMIX, AUDIO_DEVICE_OUT_REMOTE_SUBMIX,
+      AUDIO_DEVICE_IN_REMOTE_SUBMIX },
+};
 
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    String8 paramKeys;
-    String8 values;
+/*
+ * Name of the module this library was loaded as. libhardware loads
+ * audio.<module>.<variant>.so, so e.g. a copy installed as audio.usb.halium.so
+ * wraps the "usb" HIDL module; the stock audio.hidl_compat.default.so keeps
+ * wrapping the primary module.
+ */
+static std::string wrapper_module_name()
+{
+    char value[PROPERTY_VALUE_MAX];
+    Dl_info info;
+
+    if (property_get(WRAPPER_PROP_MODULE, value, NULL) > 0)
+        return value;
+
+    /* Any symbol of this library resolves to its file name */
+    if (dladdr((void *)wrapper_module_name, &info) && info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+        base = base ? base + 1 : info.dli_fname;
+
+        if (strncmp(base, "audio.", 6) == 0) {
+            const char *end = strchr(base + 6, '.');
+            std::string name(base + 6, end ? end - base - 6 : 0);
+            if (!name.empty() && name != "hidl_compat")
+                return name;
+        }
+    }
 
-    out->streamIface->getParameters(paramKeys, &values);
-    return strdup(values.string());
+    return AUDIO_HARDWARE_MODULE_ID_PRIMARY;
 }
 
-static uint32_t out_get_latency(const struct audio_stream_out *stream)
+/* Registers the modules named in the routed-modules property and starts opening them */
+static void adev_init_modules(struct wrapper_audio_device *adev)
 {
-    ALOGV("out_get_latency");
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
+    char value[PROPERTY_VALUE_MAX];
+    char *saveptr = NULL;
 
-    uint32_t latency = 0;
-    out->streamIface->getLatency(&latency);
-    return latency;
-}
+    /* Only the primary module routes streams elsewhere */
+    if (adev->module_name != AUDIO_HARDWARE_MODULE_ID_PRIMARY)
+        return;
 
-static int out_set_volume(struct audio_stream_out *stream, float left,
-        float right)
-{
-    ALOGV("out_set_volume: Left:%f Right:%f", left, right);
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    return out->streamIface->setVolume(left, right);
-}
+    property_get(WRAPPER_PROP_ROUTED_MODULES, value, "");
 
-static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
-        size_t bytes)
-{
-    ALOGV("out_write: buffer: %p, bytes: %zu", buffer, bytes);
+    for (char *name = strtok_r(value, ", ", &saveptr); name;
+         name = strtok_r(NULL, ", ", &saveptr)) {
+        struct wrapper_hal_module module;
+        module.name = name;
+        module.open_failed = false;
+        adev->modules.push_back(module);
 
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    size_t written = 0;
+        module_cache_open(module.name);
+    }
+}
 
-    status_t ret = out->streamIface->write(buffer, bytes, &written);
-    if (ret != OK) {
-        return ret;
+static sp<DeviceHalInterface> adev_open_module(struct wrapper_audio_device *adev,
+                                               struct wrapper_hal_module *module)
+{
+    if (module->deviceIface == nullptr && !module->open_failed) {
+        module->deviceIface = module_cache_get(module->name);
+        if (module->deviceIface == nullptr) {
+            ALOGW("cannot load module %s, using %s instead",
+                  module->name.c_str(), adev->module_name.c_str());
+            module->open_failed = true;
+        } else {
+            ALOGI("opened HAL module %s", module->name.c_str());
+        }
     }
 
-    return written;
+    return module->deviceIface;
 }
 
-static int out_get_render_position(const struct audio_stream_out *stream,
-        uint32_t *dsp_frames)
+/*
+ * Picks the HAL module serving the given devices, falling back to this
+ * device's own module when no routed module claims them or it fails to open.
+ */
+static sp<DeviceHalInterface> adev_route_stream(struct wrapper_audio_device *adev,
+                                                audio_devices_t devices, bool input,
+                                                const char **module_name)
 {
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    *dsp_frames = 0;
+    std::lock_guard<std::mutex> lock(adev->modules_lock);
+
+    for (struct wrapper_hal_module &module : adev->modules) {
+        for (size_t i = 0; i < sizeof(module_routes) / sizeof(module_routes[0]); i++) {
+            audio_devices_t route = input ? module_routes[i].in_devices :
+                                            module_routes[i].out_devices;
+
+            if (module.name != module_routes[i].module ||
+                !(devices & route & ~AUDIO_DEVICE_BIT_IN))
+                continue;
+
+            sp<DeviceHalInterface> deviceIface = adev_open_module(adev, &module);
+            if (deviceIface != nullptr) {
+                *module_name = module.name.c_str();
+                return deviceIface;
+            }
+        }
+    }
 
-    status_t ret = out->streamIface->getRenderPosition(dsp_frames);
-    ALOGV("out_get_render_position: dsp_frames: %d", *dsp_frames);
-    return ret;
+    *module_name = adev->module_name.c_str();
+    return adev->deviceIface;
 }
 
-static int out_get_presentation_position(const struct audio_stream_out *stream,
-                                   uint64_t *frames, struct timespec *timestamp)
+/* Device-wide settings go to every opened module, as AudioFlinger does */
+static void adev_for_each_routed_module(struct wrapper_audio_device *adev,
+                                        void (*fn)(const sp<DeviceHalInterface>&, void *),
+                                        void *arg)
 {
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    *frames = 0;
+    std::lock_guard<std::mutex> lock(adev->modules_lock);
 
-    status_t ret = out->streamIface->getPresentationPosition(frames, timestamp);
-    ALOGV("out_get_presentation_position: frames: %lu", (unsigned long)(*frames));
-    return ret;
+    for (struct wrapper_hal_module &module : adev->modules) {
+        if (module.deviceIface != nullptr)
+            fn(module.deviceIface, arg);
+    }
 }
 
+/** Pre-opened outputs **/
 
-static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
-{
-    ALOGV("out_add_audio_effect: %p", effect);
-    return 0;
-}
+static const struct {
+    const char *name;
+    audio_output_flags_t flags;
+} preopen_profiles[] = {
+    { "primary", AUDIO_OUTPUT_FLAG_PRIMARY },
+    { "deep_buffer", AUDIO_OUTPUT_FLAG_DEEP_BUFFER },
+    { "low_latency", AUDIO_OUTPUT_FLAG_FAST },
+};
 
-static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+/*
+ * Opens every pre-open slot that is empty. A slot taken by a client stream
+ * is only reopened after that stream closed, since HALs commonly refuse a
+ * second output with the same flags (the primary output above all).
+ */
+static void adev_preopen_loop(struct wrapper_audio_device *adev)
 {
-    ALOGV("out_remove_audio_effect: %p", effect);
-    return 0;
+    std::unique_lock<std::mutex> lock(adev->preopen_lock);
+
+    while (!adev->preopen_exit) {
+        struct wrapper_preopen_output *slot = NULL;
+
+        for (struct wrapper_preopen_output &entry : adev->preopen) {
+            if (entry.state == PREOPEN_EMPTY) {
+                slot = &entry;
+                break;
+            }
+        }
+
+        if (!slot) {
+            adev->preopen_cond.wait(lock);
+            continue;
+        }
+
+        struct audio_config config = AUDIO_CONFIG_INITIALIZER;
+        config.sample_rate = 48000;
+        config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        config.format = AUDIO_FORMAT_PCM_16_BIT;
+
+        slot->state = PREOPEN_OPENING;
+        lock.unlock();
+
+        sp<StreamOutHalInterface> streamIface;
+        status_t ret = adev->deviceIface->openOutputStream(slot->handle, adev->preopen_devices,
+                                                           slot->flags, &config, "",
+                                                           &streamIface);
+
+        lock.lock();
+        if (ret == OK) {
+            ALOGI("pre-opened %s output: rate=%u channel_mask=%#x format=%#x", slot->name,
+                  config.sample_rate, config.channel_mask, config.format);
+            slot->streamIface = streamIface;
+            slot->config = config;
+            slot->state = PREOPEN_READY;
+        } else {
+            ALOGW("cannot pre-open %s output: error %d", slot->name, ret);
+            slot->state = PREOPEN_FAILED;
+        }
+        adev->preopen_cond.notify_all();
+    }
 }
 
-static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
-        int64_t *timestamp)
+static void adev_preopen_start(struct wrapper_audio_device *adev)
 {
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    *timestamp = 0;
+    char value[PROPERTY_VALUE_MAX];
+    char *saveptr = NULL;
+
+    if (adev->deviceIface == nullptr || property_get(WRAPPER_PROP_PREOPEN, value, "") <= 0)
+        return;
+
+    adev->preopen_devices = property_get_int32(WRAPPER_PROP_PREOPEN_DEVICES,
+                                               AUDIO_DEVICE_OUT_SPEAKER);
+
+    for (char *name = strtok_r(value, ", ", &saveptr); name;
+         name = strtok_r(NULL, ", ", &saveptr)) {
+        for (size_t i = 0; i < sizeof(preopen_profiles) / sizeof(preopen_profiles[0]); i++) {
+            if (strcmp(name, preopen_profiles[i].name) != 0)
+                continue;
+
+            struct wrapper_preopen_output entry;
+            entry.name = preopen_profiles[i].name;
+            entry.flags = preopen_profiles[i].flags;
+            entry.handle = PREOPEN_HANDLE_BASE + (audio_io_handle_t)adev->preopen.size();
+            entry.config = AUDIO_CONFIG_INITIALIZER;
+            entry.state = PREOPEN_EMPTY;
+            adev->preopen.push_back(entry);
+        }
+    }
 
-    status_t ret = out->streamIface->getNextWriteTimestamp(timestamp);
-    ALOGV("out_get_next_write_timestamp: %ld", (long int)(*timestamp));
-    return ret;
+    if (!adev->preopen.empty())
+        adev->preopen_thread = std::thread(adev_preopen_loop, adev);
 }
 
-/** audio_stream_in implementation **/
-
-static uint32_t in_get_sample_rate(const struct audio_stream *stream)
+static void adev_preopen_stop(struct wrapper_audio_device *adev)
 {
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    uint32_t rate = 0;
+    {
+        std::lock_guard<std::mutex> lock(adev->preopen_lock);
+        adev->preopen_exit = true;
+    }
+    adev->preopen_cond.notify_all();
 
-    in->streamIface->getSampleRate(&rate);
-    ALOGV("in_get_sample_rate: %d", rate);
-    return rate;
-}
+    if (adev->preopen_thread.joinable())
+        adev->preopen_thread.join();
 
-static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
-{
-    ALOGV("in_set_sample_rate: %d", rate);
-    return -ENOSYS;
+    adev->preopen.clear();
 }
 
-static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
+static bool preopen_config_matches(const struct audio_config *requested,
+                                   const struct audio_config *opened)
 {
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    audio_channel_mask_t channels = 0;
-
-    in->streamIface->getChannelMask(&channels);
-    ALOGV("in_get_channels: %d", channels);
-    return channels;
+    return (!requested->sample_rate || requested->sample_rate == opened->sample_rate) &&
+           (!requested->channel_mask || requested->channel_mask == opened->channel_mask) &&
+           (requested->format == AUDIO_FORMAT_DEFAULT || requested->format == opened->format);
 }
 
-static audio_format_t in_get_format(const struct audio_stream *stream)
+/*
+ * Hands out a pre-opened output matching the request, waiting for one that
+ * is still being opened. Returns the slot index, or -1 if none matches.
+ *
+ * A ready slot with the requested flags but another device or config is
+ * closed and the index returned with no stream: HALs only allow one output
+ * per flags like primary, so the caller opens its own in the slot's place.
+ */
+static int adev_take_preopened_output(struct wrapper_audio_device *adev,
+                                      audio_devices_t devices, audio_output_flags_t flags,
+                                      struct audio_config *config, const char *address,
+                                      sp<StreamOutHalInterface> *streamIface)
 {
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    audio_format_t format = {};
+    std::unique_lock<std::mutex> lock(adev->preopen_lock);
+
+    for (size_t i = 0; i < adev->preopen.size(); i++) {
+        struct wrapper_preopen_output *slot = &adev->preopen[i];
+
+        if (slot->flags != flags)
+            continue;
+
+        adev->preopen_cond.wait(lock, [slot] { return slot->state != PREOPEN_OPENING; });
+        if (slot->state != PREOPEN_READY)
+            continue;
+
+        sp<StreamOutHalInterface> slotIface = slot->streamIface;
+        slot->streamIface.clear();
+        slot->state = PREOPEN_IN_USE;
+
+        if (adev->preopen_devices == devices && (!address || address[0] == '\0') &&
+                preopen_config_matches(config, &slot->config)) {
+            *streamIface = slotIface;
+            *config = slot->config;
+            ALOGI("using pre-opened %s output", slot->name);
+        } else {
+            ALOGI("closing pre-opened %s output for a different device or config", slot->name);
+            lock.unlock();
+            slotIface.clear();
+        }
+        return i;
+    }
 
-    in->streamIface->getFormat(&format);
-    ALOGV("in_get_format: %d", format);
-    return format;
+    return -1;
 }
 
-static int in_set_format(struct audio_stream *stream, audio_format_t format)
+/* Called once the client stream and its HAL stream are gone */
+static void adev_release_preopened_output(struct wrapper_audio_device *adev, int index)
 {
-    return -ENOSYS;
+    {
+        std::lock_guard<std::mutex> lock(adev->preopen_lock);
+        adev->preopen[index].state = PREOPEN_EMPTY;
+    }
+    adev->preopen_cond.notify_all();
 }
 
-static size_t in_get_buffer_size(const struct audio_stream *stream)
+/*
+ * Opens a HAL stream in the primary's config for each of devices, on the
+ * module each one routes to, and starts a writer thread per target. Devices
+ * whose HAL refuses that config are left out; without any secondary target
+ * the output stays a plain one.
+ */
+static struct wrapper_duplicate *out_duplicate_create(struct wrapper_audio_device *adev,
+                                                      struct wrapper_stream_out *out,
+                                                      audio_devices_t primary_device,
+                                                      audio_devices_t devices)
 {
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    static std::atomic<audio_io_handle_t> next_handle(DUPLICATE_HANDLE_BASE);
+    struct wrapper_duplicate *dup = new wrapper_duplicate();
+    struct wrapper_duplicate_target *primary = new wrapper_duplicate_target();
+
+    primary->streamIface = out->streamIface;
+    primary->module = out->module;
+    primary->device = primary_device;
+    primary->handle = out->hal_handle;
+    dup->targets[dup->count++] = primary;
+
+    while (devices && dup->count < DUPLICATE_MAX_TARGETS) {
+        audio_devices_t device = devices & -devices;
+        audio_io_handle_t handle = next_handle++;
+        struct audio_config config = AUDIO_CONFIG_INITIALIZER;
+        sp<StreamOutHalInterface> streamIface;
+        const char *module;
+
+        devices &= ~device;
+        config.sample_rate = out->config.sample_rate;
+        config.channel_mask = out->config.channel_mask;
+        config.format = out->config.format;
+
+        sp<DeviceHalInterface> deviceIface = adev_route_stream(adev, device, false, &module);
+        status_t ret = deviceIface->openOutputStream(
+                handle, device, (audio_output_flags_t)(out->flags & ~AUDIO_OUTPUT_FLAG_PRIMARY),
+                &config, "", &streamIface);
+        if (ret != OK || config.sample_rate != out->config.sample_rate ||
+            config.channel_mask != out->config.channel_mask ||
+            config.format != out->config.format) {
+            ALOGW("duplicating output: leaving out device %#x on module %s: error %d, "
+                  "rate=%u channel_mask=%#x format=%#x", device, module, ret,
+                  config.sample_rate, config.channel_mask, config.format);
+            continue;
+        }
+
+        struct wrapper_duplicate_target *target = new wrapper_duplicate_target();
+        target->streamIface = streamIface;
+        target->module = module;
+        target->device = device;
+        target->handle = handle;
+        dup->targets[dup->count++] = target;
+    }
 
-    size_t buffer_size = 0;
-    in->streamIface->getBufferSize(&buffer_size);
+    dup->period = out->config.buffer_size;
+    dup->size = dup->period * DUPLICATE_PERIODS;
+    dup->frame_size = out->config.frame_size;
+    dup->sample_rate = out->config.sample_rate;
+    if (dup->count > 1 && dup->frame_size && dup->sample_rate)
+        dup->buffer = (uint8_t *)malloc(dup->size);
+    for (size_t i = 1; i < dup->count; i++)
+        dup->targets[i]->period.resize(dup->period);
+
+    if (!dup->buffer) {
+        ALOGW("duplicating output: no secondary target, using device %#x only",
+              primary_device);
+        for (size_t i = 0; i < dup->count; i++)
+            delete dup->targets[i];
+        delete dup;
+        return NULL;
+    }
 
-    ALOGV("in_get_buffer_size: %zu", buffer_size);
-    return buffer_size;
-}
+    struct sched_param param = {};
+    param.sched_priority = property_get_int32(WRAPPER_PROP_ASYNC_PRIORITY,
+                                              ASYNC_DEFAULT_PRIORITY);
+    dup->running.store(true, std::memory_order_release);
 
-static int in_standby(struct audio_stream *stream)
-{
-    ALOGV("in_standby");
+    for (size_t i = 0; i < dup->count; i++) {
+        struct wrapper_duplicate_target *target = dup->targets[i];
 
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    return in->streamIface->standby();
-}
+        target->thread = std::thread(out_duplicate_writer_loop, out, dup, target);
+        if (pthread_setschedparam(target->thread.native_handle(), SCHED_FIFO, &param))
+            ALOGW("duplicating output: cannot use SCHED_FIFO priority %d",
+                  param.sched_priority);
+        pthread_setname_np(target->thread.native_handle(), "audio_hw_dup");
 
-static int in_dump(const struct audio_stream *stream, int fd)
-{
-    ALOGV("in_dump");
+        ALOGI("duplicating output: %s target device %#x on module %s", i ? "secondary" :
+              "primary", target->device, target->module);
+    }
 
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    return in->streamIface->dump(fd);
+    return dup;
 }
 
-static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
+static int adev_open_output_stream(struct audio_hw_device *dev,
+        audio_io_handle_t handle,
+        audio_devices_t devices,
+        audio_output_flags_t flags,
+        struct audio_config *config,
+        struct audio_stream_out **stream_out,
+        const char *address __unused)
 {
-    ALOGV("in_set_parameters");
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
+    ALOGV("adev_open_output_stream...");
 
-    String8 kvPairs(kvpairs);
-    return in->streamIface->setParameters(kvPairs);
-}
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    struct wrapper_stream_out *out;
+    struct audio_config requested = *config;
+    audio_devices_t duplicate_devices = out_duplicate_devices(devices, flags, config);
+    int ret = 0;
 
-static char * in_get_parameters(const struct audio_stream *stream,
-        const char *keys)
-{
-    ALOGV("in_get_parameters");
+    /* The HAL stream opened here is the primary target of a duplicating output */
+    devices &= ~duplicate_devices;
 
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    String8 paramKeys;
-    String8 values;
+    out = pool_take(&adev->pools->outputs);
+    if (!out)
+        return -ENOMEM;
 
-    in->streamIface->getParameters(paramKeys, &values);
-    return strdup(values.string());
-}
+    out->mmap.fd = -1;
+    out->params.enabled = property_get_bool(WRAPPER_PROP_PARAM_CACHE, true);
 
-static int in_set_gain(struct audio_stream_in *stream, float gain)
-{
-    ALOGV("in_set_gain: %f", gain);
+    sp<DeviceHalInterface> deviceIface = adev_route_stream(adev, devices, false, &out->module);
+    sp<StreamOutHalInterface> streamIface;
+    status_t result = OK;
+
+    out->preopen_index = -1;
+    if (deviceIface == adev->deviceIface.load())
+        out->preopen_index = adev_take_preopened_output(adev, devices, flags, config, address,
+                                                        &streamIface);
+    bool preopened = streamIface != nullptr;
+    if (!preopened) {
+        result = deviceIface->openOutputStream(handle, devices, flags,
+                                               config, address, &streamIface);
+        if (result != OK && converter_retry_open(&requested, config)) {
+            ALOGI("openOutputStream() error %d, retrying with the HAL's config", result);
+            result = deviceIface->openOutputStream(handle, devices, flags,
+                                                   config, address, &streamIface);
+        }
+    }
+    out->handle = handle;
+    out->hal_handle = preopened ? adev->preopen[out->preopen_index].handle : handle;
+    if (result != OK) {
+        ALOGE("openOutputStream() error %d", result);
+        if (out->preopen_index >= 0)
+            adev_release_preopened_output(adev, out->preopen_index);
+        pool_put(&adev->pools->outputs, out);
+        return -EINVAL;
+    }
+    out->streamIface = streamIface;
 
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    return in->streamIface->setGain(gain);
+    out->stream.common.get_sample_rate = out_get_sample_rate;
+    out->stream.common.set_sample_rate = out_set_sample_rate;
+    out->stream.common.get_buffer_size = out_get_buffer_size;
+    out->stream.common.get_channels = out_get_channels;
+    out->stream.common.get_format = out_get_format;
+    out->stream.common.set_format = out_set_format;
+    out->stream.common.standby = out_standby;
+    out->stream.common.dump = out_dump;
+    out->stream.common.set_parameters = out_set_parameters;
+    out->stream.common.get_parameters = out_get_parameters;
+    out->stream.common.add_audio_effect = out_add_audio_effect;
+    out->stream.common.remove_audio_effect = out_remove_audio_effect;
+    out->stream.get_latency = out_get_latency;
+    out->stream.set_volume = out_set_volume;
+    out->stream.write = out_write;
+    out->stream.get_render_position = out_get_render_position;
+    out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
+    out->stream.start = out_start;
+    out->stream.stop = out_stop;
+    out->stream.create_mmap_buffer = out_create_mmap_buffer;
+    out->stream.get_mmap_position = out_get_mmap_position;
+    out->stream.update_source_metadata = out_update_source_metadata;
+
+    /*
+     * Only direct, offloaded and non-blocking outputs have asynchronous
+     * semantics. Optional operations stay unset when the HAL lacks them, which
+     * is how clients of the legacy API probe for support.
+     */
+    if (flags & (AUDIO_OUTPUT_FLAG_DIRECT | AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD |
+                 AUDIO_OUTPUT_FLAG_NON_BLOCKING)) {
+        bool supportsPause = false;
+        bool supportsResume = false;
+        bool supportsDrain = false;
+
+        out->streamIface->supportsPauseAndResume(&supportsPause, &supportsResume);
+        out->streamIface->supportsDrain(&supportsDrain);
+
+        if (flags & AUDIO_OUTPUT_FLAG_NON_BLOCKING)
+            out->stream.set_callback = out_set_callback;
+        if (supportsPause && supportsResume) {
+            out->stream.pause = out_pause;
+            out->stream.resume = out_resume;
+        }
+        if (supportsDrain)
+            out->stream.drain = out_drain;
+        out->stream.flush = out_flush;
+
+        ALOGI("adev_open_output_stream async support: pause=%d resume=%d drain=%d",
+              supportsPause, supportsResume, supportsDrain);
+    }
+
+    stream_refresh_config(out->streamIface.load(), &out->config);
+
+    out->flags = flags;
+    out->devices = devices;
+    out->duplicate_devices = duplicate_devices;
+    out->address = address ? address : "";
+    out->volume_left = NAN;
+    out->volume_right = NAN;
+    soft_volume_init(&out->soft_volume);
+    control_init(&out->control);
+    out->hal_generation = adev->hal_generation.load(std::memory_order_acquire);
+    if (duplicate_devices)
+        out->dup = out_duplicate_create(adev, out, devices, duplicate_devices);
+    out->async_periods = property_get_int32(WRAPPER_PROP_ASYNC_PERIODS, ASYNC_DEFAULT_PERIODS);
+    out->async_requested = property_get_bool(WRAPPER_PROP_ASYNC_WRITE, false) &&
+                           out_async_supported(out);
+    out->position.resync_ms = property_get_int32(WRAPPER_PROP_POSITION_RESYNC_MS,
+                                                 POSITION_DEFAULT_RESYNC_MS);
+    adapt_init(&out->adapt, adev->adapt_mode, NULL);
+
+    if (property_get_bool(WRAPPER_PROP_CONVERT, false) && out_async_supported(out))
+        out->conv = converter_create(&requested, &out->config, false);
+
+    config->format = out->conv ? out->conv->client.format : out->config.format.load();
+    config->channel_mask = out->conv ? out->conv->client.channel_mask :
+                                       out->config.channel_mask.load();
+    config->sample_rate = out->conv ? out->conv->client.sample_rate :
+                                      out->config.sample_rate.load();
+
+    ALOGI("adev_open_output_stream selects channel_mask=%d rate=%d format=%d on module %s",
+          config->channel_mask, config->sample_rate, config->format, out->module);
+
+    out->adev = adev;
+    {
+        std::lock_guard<std::mutex> lock(adev->streams_lock);
+        adev->outputs.push_back(out);
+    }
+
+    *stream_out = &out->stream;
+
+    return 0;
 }
 
-static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
-                       size_t bytes)
+static void adev_close_output_stream(struct audio_hw_device *dev,
+        struct audio_stream_out *stream)
 {
-    ALOGV("in_read: bytes %zu", bytes);
+    ALOGV("adev_close_output_stream...");
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
 
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    size_t read = 0;
+    {
+        std::lock_guard<std::mutex> lock(adev->streams_lock);
+        adev->outputs.erase(std::remove(adev->outputs.begin(), adev->outputs.end(), out),
+                            adev->outputs.end());
+    }
 
-    status_t ret = in->streamIface->read(buffer, bytes, &read);
-    if (ret != OK) {
-        return ret;
+    /* It may have been the last stream of a generation before a HAL restart */
+    {
+        std::lock_guard<std::mutex> lock(adev->recovery_lock);
+        adev_release_retired(adev);
     }
 
-    return read;
-}
+    /* A bulk standby may still hold a copy of the list */
+    {
+        std::lock_guard<std::mutex> lock(adev->standby.run_lock);
+    }
 
-static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
-{
-    struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    uint32_t framesLost = 0;
+    /* A write() still in flight finishes before anything is released */
+    control_close(&out->control);
 
-    in->streamIface->getInputFramesLost(&framesLost);
-    ALOGV("in_get_input_frames_lost: %d", framesLost);
-    return framesLost;
+    if (out->callback != nullptr)
+        out->callback->setClientCallback(NULL, NULL);
+
+    out_async_release(out);
+    out_duplicate_release(out);
+    converter_release(out->conv);
+    tap_release(out->tap.load(std::memory_order_acquire));
+
+    stream_release_effects(out->streamIface.load(), out);
+    stream_release_mmap_buffer(&out->mmap);
+
+    int preopen_index = out->preopen_index;
+    pool_put(&adev->pools->outputs, out);
+
+    if (preopen_index >= 0)
+        adev_release_preopened_output(adev, preopen_index);
 }
 
-static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+static void module_set_parameters(const sp<DeviceHalInterface>& deviceIface, void *arg)
 {
-    return 0;
+    deviceIface->setParameters(*(const String8 *)arg);
 }
 
-static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+/** Bulk standby **/
+
+/* The same standby() the client would make, serialized with its writes and reads */
+static void standby_task_run(const struct wrapper_standby_task *task)
 {
-    return 0;
-}
+    struct wrapper_control_op op = {};
 
-static int adev_open_output_stream(struct audio_hw_device *dev,
-        audio_io_handle_t handle,
-        audio_devices_t devices,
-        audio_output_flags_t flags,
-        struct audio_config *config,
-        struct audio_stream_out **stream_out,
-        const char *address __unused)
+    op.type = CONTROL_STANDBY;
+    if (task->out)
+        out_control_submit(task->out, &op);
+    else
+        in_control_submit(task->in, &op);
+}
+
+/* Runs tasks until none are left to take, with pool->lock held on entry and exit */
+static void standby_pool_drain(struct wrapper_standby_pool *pool,
+                               std::unique_lock<std::mutex>& lock)
 {
-    ALOGV("adev_open_output_stream...");
+    while (pool->next < pool->tasks.size()) {
+        struct wrapper_standby_task task = pool->tasks[pool->next++];
+        int64_t start_ns = monotonic_ns();
 
-    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
-    struct wrapper_stream_out *out;
-    int ret = 0;
+        lock.unlock();
+        standby_task_run(&task);
+        lock.lock();
 
-    out = new struct wrapper_stream_out;
-    if (!out)
-        return -ENOMEM;
+        pool->busy_ns += monotonic_ns() - start_ns;
+        if (++pool->done == pool->tasks.size())
+            pool->done_cond.notify_all();
+    }
+}
 
-    status_t result = adev->deviceIface->openOutputStream(handle, devices, flags,
-                                                           config, address, &out->streamIface);
-    if (result != OK) {
-        ALOGE("openOutputStream() error %d", result);
-        delete out;
-        return -EINVAL;
+static void standby_pool_loop(struct wrapper_standby_pool *pool)
+{
+    std::unique_lock<std::mutex> lock(pool->lock);
+
+    for (;;) {
+        pool->work_cond.wait(lock, [pool] {
+            return pool->exit || pool->next < pool->tasks.size();
+        });
+        if (pool->exit)
+            return;
+        standby_pool_drain(pool, lock);
     }
+}
 
-    out->stream.common.get_sample_rate = out_get_sample_rate;
-    out->stream.common.set_sample_rate = out_set_sample_rate;
-    out->stream.common.get_buffer_size = out_get_buffer_size;
-    out->stream.common.get_channels = out_get_channels;
-    out->stream.common.get_format = out_get_format;
-    out->stream.common.set_format = out_set_format;
-    out->stream.common.standby = out_standby;
-    out->stream.common.dump = out_dump;
-    out->stream.common.set_parameters = out_set_parameters;
-    out->stream.common.get_parameters = out_get_parameters;
-    out->stream.common.add_audio_effect = out_add_audio_effect;
-    out->stream.common.remove_audio_effect = out_remove_audio_effect;
-    out->stream.get_latency = out_get_latency;
-    out->stream.set_volume = out_set_volume;
-    out->stream.write = out_write;
-    out->stream.get_render_position = out_get_render_position;
-    out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
-    out->stream.get_presentation_position = out_get_presentation_position;
+static void standby_pool_stop(struct wrapper_standby_pool *pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->lock);
+        pool->exit = true;
+    }
+    pool->work_cond.notify_all();
+
+    for (std::thread &thread : pool->threads) {
+        if (thread.joinable())
+            thread.join();
+    }
+}
 
-    config->format = out_get_format(&out->stream.common);
-    config->channel_mask = out_get_channels(&out->stream.common);
-    config->sample_rate = out_get_sample_rate(&out->stream.common);
+/*
+ * Puts every open stream in standby, e.g. before the device suspends. Each
+ * standby() is a round-trip to the HAL service. Those that took long last
+ * time are spread over a few workers; fast ones are issued one by one,
+ * which costs less than waking threads. The stream lists are only locked
+ * to copy them, so opens, closes and patches are not held up by the HAL.
+ * There is no bulk resume counterpart: streams leave standby by themselves
+ * on their next write or read.
+ */
+static void adev_standby_all(struct wrapper_audio_device *adev)
+{
+    struct wrapper_standby_pool *pool = &adev->standby;
+    std::lock_guard<std::mutex> run_lock(pool->run_lock);
+    std::unique_lock<std::mutex> lock(pool->lock);
+    int64_t start_ns = monotonic_ns();
+
+    {
+        std::lock_guard<std::mutex> streams_lock(adev->streams_lock);
+        for (struct wrapper_stream_out *out : adev->outputs)
+            pool->tasks.push_back({out, NULL});
+        for (struct wrapper_stream_in *in : adev->inputs)
+            pool->tasks.push_back({NULL, in});
+    }
 
-    ALOGI("adev_open_output_stream selects channel_mask=%d rate=%d format=%d",
-          config->channel_mask, config->sample_rate, config->format);
+    size_t count = pool->tasks.size();
+    bool parallel = count > 1 && pool->mean_ns >= STANDBY_ALL_PARALLEL_NS;
+
+    pool->done = 0;
+    pool->busy_ns = 0;
+    if (parallel) {
+        if (!pool->started) {
+            for (std::thread &thread : pool->threads)
+                thread = std::thread(standby_pool_loop, pool);
+            pool->started = true;
+        }
+        pool->next = 0;
+        pool->work_cond.notify_all();
+
+        standby_pool_drain(pool, lock);
+        pool->done_cond.wait(lock, [pool] { return pool->done == pool->tasks.size(); });
+    } else {
+        /* Nothing for the workers to take, nor any bookkeeping per stream */
+        pool->next = count;
+        lock.unlock();
+        for (const struct wrapper_standby_task &task : pool->tasks)
+            standby_task_run(&task);
+        lock.lock();
+    }
 
-    *stream_out = &out->stream;
+    int64_t elapsed_ns = monotonic_ns() - start_ns;
+    if (count)
+        pool->mean_ns = (parallel ? pool->busy_ns : elapsed_ns) / (int64_t)count;
+    pool->tasks.clear();
+    lock.unlock();
 
-    return 0;
+    adev->standby_all_ns.store(elapsed_ns, std::memory_order_relaxed);
+    ALOGV("adev_standby_all: %zu streams in %lld us, %s", count,
+          (long long)(elapsed_ns / 1000), parallel ? "in parallel" : "one by one");
 }
 
-static void adev_close_output_stream(struct audio_hw_device *dev,
-        struct audio_stream_out *stream)
+/* Keeps the connect event of every connected device, for adev_recover() */
+static void adev_record_connections(struct wrapper_audio_device *adev,
+                                    const std::string& kvpairs)
 {
-    ALOGV("adev_close_output_stream...");
-    struct wrapper_stream_out *out = (struct wrapper_stream_out *)stream;
-    delete out;
+    std::lock_guard<std::mutex> lock(adev->state.lock);
+
+    params_for_each(kvpairs.c_str(), [&](std::string_view key, std::string_view value) {
+        if (key == AUDIO_PARAMETER_DEVICE_CONNECT)
+            adev->state.connections[std::string(value)] = kvpairs;
+        else if (key == AUDIO_PARAMETER_DEVICE_DISCONNECT)
+            adev->state.connections.erase(std::string(value));
+    });
 }
 
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 {
     ALOGV("adev_set_parameters");
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    static thread_local std::string forwarded;
+    static thread_local std::string remaining;
+    status_t ret;
+
+    /* Wrapper-only keys are consumed here and never reach the HAL */
+    if (strstr(kvpairs, WRAPPER_PARAM_PREFIX)) {
+        params_split_wrapper(kvpairs, &remaining, [adev](std::string_view key, int value) {
+            if (key == WRAPPER_PARAM_TRACE_LEVEL)
+                trace_set_level(value);
+            else if (key == WRAPPER_PARAM_STANDBY_ALL && value)
+                adev_standby_all(adev);
+        });
+        kvpairs = remaining.c_str();
+    }
+
+    ret = params_forward(adev->deviceIface.load(), &adev->params, kvpairs, &forwarded);
+
+    if (forwarded.empty())
+        return ret;
+
+    String8 kvPairs = params_string8(&adev->params, forwarded.c_str());
+    adev_for_each_routed_module(adev, module_set_parameters, &kvPairs);
+
+    /* Connecting or disconnecting a device can make the HAL reroute streams */
+    if (params_has_event(forwarded)) {
+        adev_record_connections(adev, forwarded);
+
+        std::lock_guard<std::mutex> lock(adev->streams_lock);
+        for (struct wrapper_stream_out *out : adev->outputs)
+            params_cache_invalidate(&out->params, AUDIO_PARAMETER_STREAM_ROUTING);
+        for (struct wrapper_stream_in *in : adev->inputs)
+            params_cache_invalidate(&in->params, AUDIO_PARAMETER_STREAM_ROUTING);
+    }
 
-    String8 kvPairs(kvpairs);
-    return adev->deviceIface->setParameters(kvPairs);
+    return ret;
 }
 
 static char * adev_get_parameters(const struct audio_hw_device *dev,
@@ -438,11 +6017,7 @@ static char * adev_get_parameters(const struct audio_hw_device *dev,
     ALOGV("adev_get_parameters");
 
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
-    String8 paramKeys;
-    String8 values;
-
-    adev->deviceIface->getParameters(paramKeys, &values);
-    return strdup(values.string());
+    return params_cache_get(&adev->params, adev->deviceIface.load(), keys);
 }
 
 static int adev_init_check(const struct audio_hw_device *dev)
@@ -458,6 +6033,10 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
     ALOGV("adev_set_voice_volume: %f", volume);
 
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    {
+        std::lock_guard<std::mutex> lock(adev->state.lock);
+        adev->state.voice_volume = volume;
+    }
     return adev->deviceIface->setVoiceVolume(volume);
 }
 
@@ -466,6 +6045,10 @@ static int adev_set_master_volume(struct audio_hw_device *dev, float volume)
     ALOGV("adev_set_master_volume: %f", volume);
 
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    {
+        std::lock_guard<std::mutex> lock(adev->state.lock);
+        adev->state.master_volume = volume;
+    }
     return adev->deviceIface->setMasterVolume(volume);
 }
 
@@ -482,6 +6065,10 @@ static int adev_set_master_mute(struct audio_hw_device *dev, bool muted)
 {
     ALOGV("adev_set_master_mute: %d", muted);
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    {
+        std::lock_guard<std::mutex> lock(adev->state.lock);
+        adev->state.master_mute = muted;
+    }
     return adev->deviceIface->setMasterMute(muted);
 }
 
@@ -499,14 +6086,28 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
     ALOGV("adev_set_mode: %d", mode);
 
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    {
+        std::lock_guard<std::mutex> lock(adev->state.lock);
+        adev->state.mode = mode;
+    }
     return adev->deviceIface->setMode(mode);
 }
 
+static void module_set_mic_mute(const sp<DeviceHalInterface>& deviceIface, void *arg)
+{
+    deviceIface->setMicMute(*(bool *)arg);
+}
+
 static int adev_set_mic_mute(struct audio_hw_device *dev, bool state)
 {
     ALOGV("adev_set_mic_mute: %d", state);
 
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    {
+        std::lock_guard<std::mutex> lock(adev->state.lock);
+        adev->state.mic_mute = state;
+    }
+    adev_for_each_routed_module(adev, module_set_mic_mute, &state);
     return adev->deviceIface->setMicMute(state);
 }
 
@@ -518,6 +6119,32 @@ static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
     return adev->deviceIface->getMicMute(state);
 }
 
+static int adev_get_microphones(const struct audio_hw_device *dev,
+        struct audio_microphone_characteristic_t *mic_array, size_t *mic_count)
+{
+    ALOGV("adev_get_microphones");
+
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    std::vector<media::MicrophoneInfo> microphones;
+
+    status_t ret = adev->deviceIface->getMicrophones(&microphones);
+    if (ret != OK)
+        return ret;
+
+    return microphones_copy(microphones, mic_array, mic_count);
+}
+
+/* Where inputs opened with config keep the size they settled on, made on first use */
+static std::atomic<uint32_t> *adev_input_scale(struct wrapper_audio_device *adev,
+                                               const struct audio_config *config)
+{
+    std::lock_guard<std::mutex> lock(adev->input_scale_lock);
+
+    return &adev->input_scale_pct.try_emplace(
+            std::make_tuple(config->sample_rate, config->channel_mask, config->format),
+            100).first->second;
+}
+
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
         const struct audio_config *config)
 {
@@ -526,6 +6153,21 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
 
     adev->deviceIface->getInputBufferSize(config, &buffer_size);
 
+    /* Clients size their reads from this, so it follows what inputs of config settled on */
+    if (adev->adapt_mode == ADAPT_APPLY) {
+        uint32_t scale = 100;
+        {
+            std::lock_guard<std::mutex> lock(adev->input_scale_lock);
+            auto it = adev->input_scale_pct.find(std::make_tuple(
+                    config->sample_rate, config->channel_mask, config->format));
+            if (it != adev->input_scale_pct.end())
+                scale = it->second.load(std::memory_order_relaxed);
+        }
+        buffer_size = adapt_scale(buffer_size,
+                                  audio_channel_count_from_in_mask(config->channel_mask) *
+                                  audio_bytes_per_sample(config->format), scale);
+    }
+
     ALOGV("adev_get_input_buffer_size: %zu", buffer_size);
     return buffer_size;
 }
@@ -544,21 +6186,43 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
     struct wrapper_stream_in *in;
+    struct audio_config requested = *config;
     int ret = 0;
 
-    in = new struct wrapper_stream_in;
+    in = pool_take(&adev->pools->inputs);
     if (!in)
         return -ENOMEM;
 
-    status_t result = adev->deviceIface->openInputStream(handle, devices, config,
-                                                         flags, address, source,
-                                                         0/*outputDevice*/, ""/*outputDeviceAddress*/,
-                                                         &in->streamIface);
+    in->mmap.fd = -1;
+    in->params.enabled = property_get_bool(WRAPPER_PROP_PARAM_CACHE, true);
+    in->handle = handle;
+    in->devices = devices;
+    in->source = source;
+    in->address = address ? address : "";
+    in->gain = NAN;
+    soft_volume_init(&in->soft_volume);
+    control_init(&in->control);
+    in->hal_generation = adev->hal_generation.load(std::memory_order_acquire);
+
+    sp<DeviceHalInterface> deviceIface = adev_route_stream(adev, devices, true, &in->module);
+    sp<StreamInHalInterface> streamIface;
+    status_t result = deviceIface->openInputStream(handle, devices, config,
+                                                   flags, address, source,
+                                                   0/*outputDevice*/, ""/*outputDeviceAddress*/,
+                                                   &streamIface);
+    if (result != OK && converter_retry_open(&requested, config)) {
+        ALOGI("openInputStream() error %d, retrying with the HAL's config", result);
+        result = deviceIface->openInputStream(handle, devices, config,
+                                              flags, address, source,
+                                              0/*outputDevice*/, ""/*outputDeviceAddress*/,
+                                              &streamIface);
+    }
     if (result != OK) {
         ALOGE("openInputStream() error %d", result);
-        delete in;
+        pool_put(&adev->pools->inputs, in);
         return result;
     }
+    in->streamIface = streamIface;
 
     in->stream.common.get_sample_rate = in_get_sample_rate;
     in->stream.common.set_sample_rate = in_set_sample_rate;
@@ -575,17 +6239,47 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.set_gain = in_set_gain;
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->stream.start = in_start;
+    in->stream.stop = in_stop;
+    in->stream.create_mmap_buffer = in_create_mmap_buffer;
+    in->stream.get_mmap_position = in_get_mmap_position;
+    in->stream.get_capture_position = in_get_capture_position;
+    in->stream.get_active_microphones = in_get_active_microphones;
+    in->stream.update_sink_metadata = in_update_sink_metadata;
+
+    stream_refresh_config(in->streamIface.load(), &in->config);
+
+    in->flags = flags;
+    in->async_requested = property_get_bool(WRAPPER_PROP_ASYNC_READ, false) &&
+                          in_async_supported(in);
+
+    if (property_get_bool(WRAPPER_PROP_CONVERT, false) && in_async_supported(in)) {
+        in->conv = converter_create(&requested, &in->config, true);
+        if (in->conv) {
+            in->conv->provider.get_next_buffer = in_convert_get_next_buffer;
+            in->conv->provider.release_buffer = in_convert_release_buffer;
+            in->conv->in = in;
+        }
+    }
 
-    config->format = in_get_format(&in->stream.common);
-    config->channel_mask = in_get_channels(&in->stream.common);
-    config->sample_rate = in_get_sample_rate(&in->stream.common);
+    config->format = in->conv ? in->conv->client.format : in->config.format.load();
+    config->channel_mask = in->conv ? in->conv->client.channel_mask :
+                                      in->config.channel_mask.load();
+    config->sample_rate = in->conv ? in->conv->client.sample_rate : in->config.sample_rate.load();
+    adapt_init(&in->adapt, adev->adapt_mode, adev_input_scale(adev, config));
 
-    ALOGI("adev_open_input_stream selects channel_mask=%d rate=%d format=%d",
-          config->channel_mask, config->sample_rate, config->format);
+    ALOGI("adev_open_input_stream selects channel_mask=%d rate=%d format=%d on module %s",
+          config->channel_mask, config->sample_rate, config->format, in->module);
 
     if (ret) {
-        delete in;
+        pool_put(&adev->pools->inputs, in);
     } else {
+        in->adev = adev;
+        {
+            std::lock_guard<std::mutex> lock(adev->streams_lock);
+            adev->inputs.push_back(in);
+        }
+
         *stream_in = &in->stream;
     }
 
@@ -596,14 +6290,660 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
                                     struct audio_stream_in *stream)
 {
     ALOGV("adev_close_input_stream...");
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
     struct wrapper_stream_in *in = (struct wrapper_stream_in *)stream;
-    delete in;
+
+    {
+        std::lock_guard<std::mutex> lock(adev->streams_lock);
+        adev->inputs.erase(std::remove(adev->inputs.begin(), adev->inputs.end(), in),
+                           adev->inputs.end());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(adev->recovery_lock);
+        adev_release_retired(adev);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(adev->standby.run_lock);
+    }
+
+    control_close(&in->control);
+
+    in_async_release(in);
+    converter_release(in->conv);
+    tap_release(in->tap.load(std::memory_order_acquire));
+
+    stream_release_effects(in->streamIface.load(), in);
+    stream_release_mmap_buffer(&in->mmap);
+    pool_put(&adev->pools->inputs, in);
+}
+
+/** HAL service recovery **/
+
+/* Whether the HAL service behind this device or any opened module is gone */
+static bool adev_hal_dead(struct wrapper_audio_device *adev)
+{
+    if (hal_transport_error(adev->deviceIface->initCheck()))
+        return true;
+
+    std::lock_guard<std::mutex> lock(adev->modules_lock);
+    for (struct wrapper_hal_module &module : adev->modules) {
+        if (module.deviceIface != nullptr &&
+            hal_transport_error(module.deviceIface->initCheck()))
+            return true;
+    }
+
+    return false;
+}
+
+/* Tells a restarted HAL service what the client told the one before */
+static void adev_replay_state(struct wrapper_audio_device *adev)
+{
+    struct wrapper_device_state *state = &adev->state;
+    std::string kvpairs;
+
+    std::lock_guard<std::mutex> lock(state->lock);
+
+    for (const auto &entry : state->connections) {
+        String8 kvPairs(entry.second.c_str());
+        adev->deviceIface->setParameters(kvPairs);
+        adev_for_each_routed_module(adev, module_set_parameters, &kvPairs);
+    }
+
+    if (state->mode != AUDIO_MODE_INVALID)
+        adev->deviceIface->setMode(state->mode);
+    if (!isnan(state->voice_volume))
+        adev->deviceIface->setVoiceVolume(state->voice_volume);
+    if (!isnan(state->master_volume))
+        adev->deviceIface->setMasterVolume(state->master_volume);
+    if (state->master_mute >= 0)
+        adev->deviceIface->setMasterMute(state->master_mute);
+    if (state->mic_mute >= 0) {
+        bool mute = state->mic_mute;
+        adev_for_each_routed_module(adev, module_set_mic_mute, &mute);
+        adev->deviceIface->setMicMute(mute);
+    }
+
+    params_cache_kvpairs(&adev->params, &kvpairs);
+    if (!kvpairs.empty()) {
+        String8 kvPairs(kvpairs.c_str());
+        adev->deviceIface->setParameters(kvPairs);
+        adev_for_each_routed_module(adev, module_set_parameters, &kvPairs);
+    }
+}
+
+/*
+ * Drops the replaced module interfaces no open stream was opened through
+ * any more. Called with recovery_lock held.
+ */
+static void adev_release_retired(struct wrapper_audio_device *adev)
+{
+    uint32_t oldest = adev->hal_generation.load(std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(adev->streams_lock);
+        for (struct wrapper_stream_out *out : adev->outputs)
+            oldest = std::min(oldest, out->hal_generation.load(std::memory_order_relaxed));
+        for (struct wrapper_stream_in *in : adev->inputs)
+            oldest = std::min(oldest, in->hal_generation.load(std::memory_order_relaxed));
+    }
+
+    adev->retired.erase(std::remove_if(adev->retired.begin(), adev->retired.end(),
+                                       [oldest](const std::pair<uint32_t, sp<RefBase>> &entry) {
+                                           return entry.first < oldest;
+                                       }),
+                        adev->retired.end());
+}
+
+/*
+ * Recovery thread: libaudiohal offers no death notification, so a
+ * transport error is confirmed with a cheap call on every opened module.
+ * If the service is gone, the modules are opened again, which waits for the
+ * service to come back, and are told the client's device state. Only the
+ * swap of the interfaces holds recovery_lock.
+ */
+static void adev_recovery_loop(struct wrapper_audio_device *adev)
+{
+    std::unique_lock<std::mutex> lock(adev->recovery_lock);
+
+    for (;;) {
+        adev->recovery_cond.wait(lock, [adev] {
+            return adev->recovery_requested || adev->recovery_exit;
+        });
+        if (adev->recovery_exit)
+            break;
+
+        uint32_t seen = adev->hal_generation.load(std::memory_order_relaxed);
+        lock.unlock();
+
+        if (!adev_hal_dead(adev)) {
+            lock.lock();
+            adev->recovery_requested = false;
+            continue;
+        }
+
+        int64_t start_ns = monotonic_ns();
+        ALOGW("HAL service died, reopening module %s", adev->module_name.c_str());
+
+        std::map<std::string, sp<DeviceHalInterface>> reopened;
+        {
+            std::lock_guard<std::mutex> modules_lock(adev->modules_lock);
+            for (struct wrapper_hal_module &module : adev->modules) {
+                if (module.deviceIface != nullptr)
+                    reopened[module.name] = nullptr;
+            }
+        }
+
+        module_cache_clear();
+        for (auto &entry : reopened)
+            module_cache_open(entry.first);
+        for (auto &entry : reopened)
+            entry.second = module_cache_get(entry.first);
+
+        sp<DeviceHalInterface> deviceIface = module_cache_get(adev->module_name);
+        if (deviceIface == nullptr) {
+            ALOGE("cannot reopen module %s", adev->module_name.c_str());
+            lock.lock();
+            adev->recovery_requested = false;
+            continue;
+        }
+
+        lock.lock();
+        adev->retired.emplace_back(seen, adev->deviceIface.exchange(deviceIface));
+        {
+            std::lock_guard<std::mutex> modules_lock(adev->modules_lock);
+            for (struct wrapper_hal_module &module : adev->modules) {
+                auto it = reopened.find(module.name);
+                if (module.deviceIface == nullptr || it == reopened.end())
+                    continue;
+                adev->retired.emplace_back(seen, module.deviceIface);
+                module.deviceIface = it->second;
+                module.open_failed = module.deviceIface == nullptr;
+            }
+        }
+
+        adev_replay_state(adev);
+
+        /* Patch handles belong to the old service; clients route again by parameters */
+        {
+            std::lock_guard<std::mutex> patches_lock(adev->patches_lock);
+            if (!adev->patches.empty())
+                ALOGW("dropping %zu audio patches of the old HAL service", adev->patches.size());
+            adev->patches.clear();
+        }
+
+        /* Pre-opened outputs nobody took are opened again in the background */
+        {
+            std::lock_guard<std::mutex> preopen_lock(adev->preopen_lock);
+            for (struct wrapper_preopen_output &slot : adev->preopen) {
+                if (slot.state == PREOPEN_READY || slot.state == PREOPEN_FAILED) {
+                    adev->retired.emplace_back(seen, slot.streamIface);
+                    slot.streamIface.clear();
+                    slot.state = PREOPEN_EMPTY;
+                }
+            }
+        }
+        adev->preopen_cond.notify_all();
+        effects_factory_reset();
+
+        adev->hal_generation.store(seen + 1, std::memory_order_release);
+        adev->recovery_requested = false;
+        adev_release_retired(adev);
+        adev->recovery_ns.store(monotonic_ns() - start_ns, std::memory_order_relaxed);
+        ALOGI("HAL service recovered in %lld us",
+              (long long)(adev->recovery_ns.load(std::memory_order_relaxed) / 1000));
+    }
+}
+
+/*
+ * Called with the generation a HAL call failed in, from any thread. Never
+ * waits for the HAL service: it wakes the recovery thread, started on the
+ * first error, and the caller's call fails until the service is back.
+ * Returns true if the caller's streams can be reopened already.
+ */
+static bool adev_recover(struct wrapper_audio_device *adev, uint32_t seen)
+{
+    {
+        std::lock_guard<std::mutex> lock(adev->recovery_lock);
+
+        /* Someone else recovered from this death already */
+        if (adev->hal_generation.load(std::memory_order_relaxed) != seen)
+            return true;
+        if (adev->recovery_requested || adev->recovery_exit)
+            return false;
+
+        adev->recovery_requested = true;
+        if (!adev->recovery_thread.joinable())
+            adev->recovery_thread = std::thread(adev_recovery_loop, adev);
+    }
+    adev->recovery_cond.notify_one();
+    return false;
+}
+
+static void adev_recovery_stop(struct wrapper_audio_device *adev)
+{
+    {
+        std::lock_guard<std::mutex> lock(adev->recovery_lock);
+        adev->recovery_exit = true;
+    }
+    adev->recovery_cond.notify_one();
+
+    if (adev->recovery_thread.joinable())
+        adev->recovery_thread.join();
+}
+
+/*
+ * Opens an output again in the config it had, on the module its devices
+ * route to, and replays its parameters and volume. Runs on the data thread;
+ * the writer threads of the stream are stopped and started again around it.
+ * A HAL picking another config is followed by the converter; without one
+ * the old, dead stream is kept and the client's calls keep failing.
+ */
+static void out_recover(struct wrapper_stream_out *out)
+{
+    struct wrapper_audio_device *adev = out->adev;
+    struct wrapper_async_writer *writer = out->async.load(std::memory_order_relaxed);
+    struct audio_config config = AUDIO_CONFIG_INITIALIZER;
+    sp<StreamOutHalInterface> streamIface;
+    std::string kvpairs;
+    const char *module;
+
+    out->hal_generation.store(adev->hal_generation.load(std::memory_order_acquire),
+                              std::memory_order_relaxed);
+
+    /* The client maps the shared buffer of an MMAP stream, which cannot move */
+    if (out->flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) {
+        ALOGW("out_recover: cannot reopen MMAP output %d", out->handle);
+        return;
+    }
+
+    /* Restarted by out_async_apply_mode() on the next write */
+    if (writer && writer->running.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> lock(writer->hal_lock);
+            ring_flush(&writer->ring);
+        }
+        out_async_stop(writer);
+    }
+    out_duplicate_release(out);
+
+    config.sample_rate = out->config.sample_rate;
+    config.channel_mask = out->config.channel_mask;
+    config.format = out->config.format;
+
+    sp<DeviceHalInterface> deviceIface = adev_route_stream(adev, out->devices, false, &module);
+    status_t ret = deviceIface->openOutputStream(out->hal_handle, out->devices, out->flags,
+                                                 &config, out->address.c_str(), &streamIface);
+    if (ret != OK) {
+        ALOGE("out_recover: cannot reopen output %d: error %d", out->handle, ret);
+        return;
+    }
+
+    struct wrapper_hal_config hal;
+    stream_query_config(streamIface, &out->config, &hal);
+    if (hal.sample_rate != out->config.sample_rate ||
+        hal.channel_mask != out->config.channel_mask || hal.format != out->config.format) {
+        if (!out->conv || !converter_reconfigure(out->conv, &hal, false)) {
+            ALOGE("out_recover: output %d reopened with rate=%u channel_mask=%#x format=%#x, "
+                  "which its client cannot follow", out->handle, hal.sample_rate,
+                  hal.channel_mask, hal.format);
+            return;
+        }
+        ALOGW("out_recover: output %d reopened with rate=%u channel_mask=%#x format=%#x, "
+              "converting to it", out->handle, hal.sample_rate, hal.channel_mask, hal.format);
+    } else if (out->conv) {
+        converter_reconfigure(out->conv, &hal, false);
+    }
+    stream_store_config(&out->config, &hal);
+
+    out->streamIface = streamIface;
+    out->module = module;
+    {
+        std::lock_guard<std::mutex> lock(adev->recovery_lock);
+        adev_release_retired(adev);
+    }
+    position_reset(&out->position);
+    stream_reattach_effects(streamIface, out, AUDIO_SESSION_OUTPUT_MIX, out->hal_handle);
+
+    if (out->callback != nullptr)
+        streamIface->setCallback(out->callback);
+
+    params_cache_kvpairs(&out->params, &kvpairs);
+    if (!kvpairs.empty())
+        streamIface->setParameters(String8(kvpairs.c_str()));
+
+    float left = out->volume_left.load(std::memory_order_relaxed);
+    float right = out->volume_right.load(std::memory_order_relaxed);
+    /* A HAL that refused the volume before is still left out of it */
+    if (!isnan(left) && !isnan(right) &&
+        !out->soft_volume.active.load(std::memory_order_relaxed))
+        streamIface->setVolume(left, right);
+
+    if (out->duplicate_devices)
+        out->dup = out_duplicate_create(adev, out, out->devices, out->duplicate_devices);
+
+    ALOGI("out_recover: reopened output %d on module %s", out->handle, module);
+}
+
+/* Same for an input, whose capture thread is stopped and started again */
+static void in_recover(struct wrapper_stream_in *in)
+{
+    struct wrapper_audio_device *adev = in->adev;
+    struct wrapper_async_reader *reader = in->async.load(std::memory_order_relaxed);
+    struct audio_config config = AUDIO_CONFIG_INITIALIZER;
+    sp<StreamInHalInterface> streamIface;
+    std::string kvpairs;
+    const char *module;
+
+    in->hal_generation.store(adev->hal_generation.load(std::memory_order_acquire),
+                             std::memory_order_relaxed);
+
+    if (in->flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) {
+        ALOGW("in_recover: cannot reopen MMAP input %d", in->handle);
+        return;
+    }
+
+    /* Restarted by in_async_apply_mode() on the next read */
+    if (reader && reader->running.load(std::memory_order_relaxed)) {
+        in_async_stop(reader);
+        ring_flush(&reader->ring);
+    }
+
+    config.sample_rate = in->config.sample_rate;
+    config.channel_mask = in->config.channel_mask;
+    config.format = in->config.format;
+
+    sp<DeviceHalInterface> deviceIface = adev_route_stream(adev, in->devices, true, &module);
+    status_t ret = deviceIface->openInputStream(in->handle, in->devices, &config, in->flags,
+                                                in->address.c_str(), in->source,
+                                                0/*outputDevice*/, ""/*outputDeviceAddress*/,
+                                                &streamIface);
+    if (ret != OK) {
+        ALOGE("in_recover: cannot reopen input %d: error %d", in->handle, ret);
+        return;
+    }
+
+    struct wrapper_hal_config hal;
+    stream_query_config(streamIface, &in->config, &hal);
+    if (hal.sample_rate != in->config.sample_rate ||
+        hal.channel_mask != in->config.channel_mask || hal.format != in->config.format) {
+        if (!in->conv || !converter_reconfigure(in->conv, &hal, true)) {
+            ALOGE("in_recover: input %d reopened with rate=%u channel_mask=%#x format=%#x, "
+                  "which its client cannot follow", in->handle, hal.sample_rate,
+                  hal.channel_mask, hal.format);
+            return;
+        }
+        ALOGW("in_recover: input %d reopened with rate=%u channel_mask=%#x format=%#x, "
+              "converting to it", in->handle, hal.sample_rate, hal.channel_mask, hal.format);
+    } else if (in->conv) {
+        converter_reconfigure(in->conv, &hal, true);
+    }
+    stream_store_config(&in->config, &hal);
+
+    in->streamIface = streamIface;
+    in->module = module;
+    {
+        std::lock_guard<std::mutex> lock(adev->recovery_lock);
+        adev_release_retired(adev);
+    }
+    stream_reattach_effects(streamIface, in, (audio_session_t)in->handle, in->handle);
+
+    params_cache_kvpairs(&in->params, &kvpairs);
+    if (!kvpairs.empty())
+        streamIface->setParameters(String8(kvpairs.c_str()));
+
+    float gain = in->gain.load(std::memory_order_relaxed);
+    if (!isnan(gain) && !in->soft_volume.active.load(std::memory_order_relaxed))
+        streamIface->setGain(gain);
+
+    ALOGI("in_recover: reopened input %d on module %s", in->handle, module);
+}
+
+/** Audio patches **/
+
+/* This device's own module, or the routed module of that name */
+static sp<DeviceHalInterface> adev_module_iface(struct wrapper_audio_device *adev,
+                                                const char *name)
+{
+    std::lock_guard<std::mutex> lock(adev->modules_lock);
+
+    for (struct wrapper_hal_module &module : adev->modules) {
+        if (module.name == name && module.deviceIface != nullptr)
+            return module.deviceIface;
+    }
+
+    return adev->deviceIface;
+}
+
+/*
+ * Module serving a port: the one the mix's stream was opened on, or the one
+ * serving the device. Client io handles of pre-opened outputs are replaced
+ * with the handles the HAL opened them with.
+ */
+static sp<DeviceHalInterface> adev_route_port(struct wrapper_audio_device *adev,
+                                              audio_port_type_t type, audio_port_role_t role,
+                                              audio_devices_t device, audio_io_handle_t *mix)
+{
+    const char *module_name = NULL;
+
+    if (type == AUDIO_PORT_TYPE_MIX) {
+        {
+            std::lock_guard<std::mutex> lock(adev->streams_lock);
+            for (struct wrapper_stream_out *out : adev->outputs) {
+                if (out->handle == *mix) {
+                    module_name = out->module;
+                    *mix = out->hal_handle;
+                }
+            }
+            for (struct wrapper_stream_in *in : adev->inputs) {
+                if (in->handle == *mix)
+                    module_name = in->module;
+            }
+        }
+
+        return module_name ? adev_module_iface(adev, module_name) : adev->deviceIface;
+    }
+
+    if (type == AUDIO_PORT_TYPE_DEVICE)
+        return adev_route_stream(adev, device, role == AUDIO_PORT_ROLE_SOURCE, &module_name);
+
+    return adev->deviceIface;
+}
+
+/* A patch changes the route of its mixes behind their routing= parameter */
+static void adev_patch_invalidate_routing(struct wrapper_audio_device *adev,
+                                          const struct audio_port_config *ports, size_t count)
+{
+    std::lock_guard<std::mutex> lock(adev->streams_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        const struct audio_port_config &port = ports[i];
+
+        if (port.type != AUDIO_PORT_TYPE_MIX)
+            continue;
+
+        for (struct wrapper_stream_out *out : adev->outputs) {
+            if (out->hal_handle == port.ext.mix.handle)
+                params_cache_invalidate(&out->params, AUDIO_PARAMETER_STREAM_ROUTING);
+        }
+        for (struct wrapper_stream_in *in : adev->inputs) {
+            if (in->handle == port.ext.mix.handle)
+                params_cache_invalidate(&in->params, AUDIO_PARAMETER_STREAM_ROUTING);
+        }
+    }
+}
+
+static int adev_release_audio_patch(struct audio_hw_device *dev, audio_patch_handle_t handle);
+
+/* Called with patches_lock held */
+static std::vector<std::pair<audio_patch_handle_t, sp<DeviceHalInterface>>>::iterator
+adev_find_patch(struct wrapper_audio_device *adev, audio_patch_handle_t handle)
+{
+    return std::find_if(adev->patches.begin(), adev->patches.end(),
+                        [handle](const std::pair<audio_patch_handle_t,
+                                                 sp<DeviceHalInterface>> &patch) {
+                            return patch.first == handle;
+                        });
+}
+
+/*
+ * Patches switch routes in the HAL without the standby a routing=
+ * parameter change often causes, and without touching the streams.
+ */
+static int adev_create_audio_patch(struct audio_hw_device *dev,
+                                   unsigned int num_sources,
+                                   const struct audio_port_config *sources,
+                                   unsigned int num_sinks,
+                                   const struct audio_port_config *sinks,
+                                   audio_patch_handle_t *handle)
+{
+    ALOGV("adev_create_audio_patch: %u sources, %u sinks, handle %d",
+          num_sources, num_sinks, *handle);
+
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    struct audio_port_config ports[2 * AUDIO_PATCH_PORTS_MAX];
+    size_t count = num_sources + num_sinks;
+    sp<DeviceHalInterface> deviceIface;
+
+    if (num_sources > AUDIO_PATCH_PORTS_MAX || num_sinks > AUDIO_PATCH_PORTS_MAX)
+        return -EINVAL;
+    std::copy(sources, sources + num_sources, ports);
+    std::copy(sinks, sinks + num_sinks, ports + num_sources);
+
+    /* The mix decides the module, a device-only patch goes by its devices */
+    for (size_t i = 0; i < count; i++) {
+        struct audio_port_config &port = ports[i];
+
+        if (port.type == AUDIO_PORT_TYPE_MIX || deviceIface == nullptr) {
+            sp<DeviceHalInterface> portIface = adev_route_port(adev, port.type, port.role,
+                                                               port.ext.device.type,
+                                                               &port.ext.mix.handle);
+            if (port.type == AUDIO_PORT_TYPE_MIX || port.type == AUDIO_PORT_TYPE_DEVICE)
+                deviceIface = portIface;
+        }
+    }
+    if (deviceIface == nullptr)
+        deviceIface = adev->deviceIface;
+
+    /* Updating a patch that lives on another module means moving it */
+    if (*handle != AUDIO_PATCH_HANDLE_NONE) {
+        std::unique_lock<std::mutex> lock(adev->patches_lock);
+        auto it = adev_find_patch(adev, *handle);
+
+        if (it != adev->patches.end() && it->second != deviceIface) {
+            lock.unlock();
+            adev_release_audio_patch(dev, *handle);
+            *handle = AUDIO_PATCH_HANDLE_NONE;
+        }
+    }
+
+    status_t ret = deviceIface->createAudioPatch(num_sources, ports,
+                                                 num_sinks, ports + num_sources, handle);
+    if (ret != OK) {
+        ALOGE("createAudioPatch() error %d", ret);
+        return ret;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(adev->patches_lock);
+        auto it = adev_find_patch(adev, *handle);
+        if (it != adev->patches.end())
+            it->second = deviceIface;
+        else
+            adev->patches.emplace_back(*handle, deviceIface);
+    }
+    adev_patch_invalidate_routing(adev, ports, count);
+
+    return 0;
+}
+
+static int adev_release_audio_patch(struct audio_hw_device *dev, audio_patch_handle_t handle)
+{
+    ALOGV("adev_release_audio_patch: %d", handle);
+
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    sp<DeviceHalInterface> deviceIface = adev->deviceIface;
+
+    {
+        std::lock_guard<std::mutex> lock(adev->patches_lock);
+        auto it = adev_find_patch(adev, handle);
+        if (it != adev->patches.end()) {
+            deviceIface = it->second;
+            adev->patches.erase(it);
+        }
+    }
+
+    return deviceIface->releaseAudioPatch(handle);
+}
+
+static int adev_get_audio_port(struct audio_hw_device *dev, struct audio_port *port)
+{
+    ALOGV("adev_get_audio_port: %d", port->id);
+
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    audio_io_handle_t mix = port->ext.mix.handle;
+    sp<DeviceHalInterface> deviceIface = adev_route_port(adev, port->type, port->role,
+                                                         port->ext.device.type, &mix);
+    audio_io_handle_t client_mix = port->ext.mix.handle;
+
+    if (port->type == AUDIO_PORT_TYPE_MIX)
+        port->ext.mix.handle = mix;
+
+    status_t ret = deviceIface->getAudioPort(port);
+
+    if (port->type == AUDIO_PORT_TYPE_MIX)
+        port->ext.mix.handle = client_mix;
+    return ret;
+}
+
+static int adev_set_audio_port_config(struct audio_hw_device *dev,
+                                      const struct audio_port_config *config)
+{
+    ALOGV("adev_set_audio_port_config: %d", config->id);
+
+    struct wrapper_audio_device *adev = (struct wrapper_audio_device *)dev;
+    struct audio_port_config port = *config;
+    sp<DeviceHalInterface> deviceIface = adev_route_port(adev, port.type, port.role,
+                                                         port.ext.device.type,
+                                                         &port.ext.mix.handle);
+
+    return deviceIface->setAudioPortConfig(&port);
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
     ALOGV("adev_dump");
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)device;
+
+    trace_dump(fd);
+
+    dprintf(fd, "wrapper device (module %s):\n", adev->module_name.c_str());
+    params_cache_dump(fd, &adev->params);
+    {
+        std::lock_guard<std::mutex> lock(adev->patches_lock);
+        dprintf(fd, "  audio patches: %zu\n", adev->patches.size());
+    }
+    dprintf(fd, "  last standby of all streams: %llu us\n",
+            (unsigned long long)(adev->standby_all_ns.load(std::memory_order_relaxed) / 1000));
+    {
+        std::lock_guard<std::mutex> lock(adev->recovery_lock);
+        dprintf(fd, "  HAL service recoveries: %u, last took %llu us, %zu old interfaces held\n",
+                adev->hal_generation.load(std::memory_order_relaxed),
+                (unsigned long long)(adev->recovery_ns.load(std::memory_order_relaxed) / 1000),
+                adev->retired.size());
+    }
+    pool_dump(fd, "output", &adev->pools->outputs);
+    pool_dump(fd, "input", &adev->pools->inputs);
+
+    {
+        std::lock_guard<std::mutex> lock(adev->streams_lock);
+        for (struct wrapper_stream_out *out : adev->outputs)
+            stream_dump_wrapper_state(fd, "output", out, out->module, &out->config, &out->stats);
+        for (struct wrapper_stream_in *in : adev->inputs)
+            stream_dump_wrapper_state(fd, "input", in, in->module, &in->config, &in->stats);
+    }
+
     return adev->deviceIface->dump(fd);
 }
 
@@ -611,6 +6951,31 @@ static int adev_close(hw_device_t *device)
 {
     ALOGV("adev_close");
     struct wrapper_audio_device *adev = (struct wrapper_audio_device *)device;
+
+    /*
+     * Streams a client forgot to close still point at the device, and may
+     * have threads of their own running: they are closed first.
+     */
+    std::vector<struct wrapper_stream_out *> outputs;
+    std::vector<struct wrapper_stream_in *> inputs;
+    {
+        std::lock_guard<std::mutex> lock(adev->streams_lock);
+        outputs = adev->outputs;
+        inputs = adev->inputs;
+    }
+    if (!outputs.empty() || !inputs.empty())
+        ALOGW("adev_close: closing %zu outputs and %zu inputs left open",
+              outputs.size(), inputs.size());
+    for (struct wrapper_stream_out *out : outputs)
+        adev_close_output_stream(&adev->hw_device, &out->stream);
+    for (struct wrapper_stream_in *in : inputs)
+        adev_close_input_stream(&adev->hw_device, &in->stream);
+
+    adev_recovery_stop(adev);
+    adev_preopen_stop(adev);
+    standby_pool_stop(&adev->standby);
+
+    delete adev->pools;
     delete adev;
     return 0;
 }
@@ -625,16 +6990,34 @@ static int adev_open(const hw_module_t* module, const char* name,
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
         return -EINVAL;
 
-    adev = new wrapper_audio_device;
+    trace_set_level(property_get_int32(WRAPPER_PROP_TRACE_LEVEL, 0));
+
+    adev = new wrapper_audio_device();
     if (!adev)
         return -ENOMEM;
 
-    sp<DevicesFactoryHalInterface> devicesFactoryHal = DevicesFactoryHalInterface::create();
-    int rc = devicesFactoryHal->openDevice(AUDIO_HARDWARE_MODULE_ID_PRIMARY, &adev->deviceIface);
-    if (rc) {
-        ALOGE("devicesFactoryHal->openDevice() error %d loading module %s", rc, name);
+    adev->params.enabled = property_get_bool(WRAPPER_PROP_PARAM_CACHE, true);
+    adev->pools = new wrapper_stream_pools();
+    adev->adapt_mode = adapt_valid_mode(property_get_int32(WRAPPER_PROP_ADAPTIVE_BUFFER,
+                                                           ADAPT_OFF));
+    adev->state.mode = AUDIO_MODE_INVALID;
+    adev->state.voice_volume = NAN;
+    adev->state.master_volume = NAN;
+    adev->state.master_mute = -1;
+    adev->state.mic_mute = -1;
+
+    /* Routed modules start opening in parallel with this device's own */
+    adev->module_name = wrapper_module_name();
+    module_cache_open(adev->module_name);
+    adev_init_modules(adev);
+
+    adev->deviceIface = module_cache_get(adev->module_name);
+    if (adev->deviceIface == nullptr) {
+        ALOGE("cannot load module %s", adev->module_name.c_str());
     }
 
+    adev_preopen_start(adev);
+
     adev->hw_device.common.tag = HARDWARE_DEVICE_TAG;
     adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
     adev->hw_device.common.module = (struct hw_module_t *) module;
@@ -656,6 +7039,22 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.open_input_stream = adev_open_input_stream;
     adev->hw_device.close_input_stream = adev_close_input_stream;
     adev->hw_device.dump = adev_dump;
+    adev->hw_device.get_microphones = adev_get_microphones;
+
+    /*
+     * With patch support the device is exposed as API 3.0, so that clients
+     * switch routes through patches; otherwise they keep using routing=.
+     */
+    bool supportsPatches = false;
+    if (adev->deviceIface != nullptr &&
+        adev->deviceIface->supportsAudioPatches(&supportsPatches) == OK && supportsPatches) {
+        adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_3_0;
+        adev->hw_device.create_audio_patch = adev_create_audio_patch;
+        adev->hw_device.release_audio_patch = adev_release_audio_patch;
+        adev->hw_device.get_audio_port = adev_get_audio_port;
+        adev->hw_device.set_audio_port_config = adev_set_audio_port_config;
+    }
+    ALOGI("adev_open: audio patches %ssupported", supportsPatches ? "" : "not ");
 
     *device = &adev->hw_device.common;
 
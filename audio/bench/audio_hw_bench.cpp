@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives the wrapper's audio_hw_device function table the way PulseAudio's
+ * droid modules do, against the in-process fake libaudiohal, and reports
+ * what the wrapper itself costs per call: time outside the fake HAL and
+ * heap allocations.
+ *
+ * usage: audio_hw_bench [-n iterations] [-w write_us] [-r read_us] [-c control_us] [-C]
+ *
+ * -C enables conversion, persist.halium.audio_hw.convert, for the
+ * converted playback and capture scenarios, which are skipped otherwise.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <cutils/properties.h>
+#include <hardware/hardware.h>
+#include <hardware/audio.h>
+#include <hardware/audio_effect.h>
+
+#include "fake_audiohal.h"
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+static std::atomic<uint64_t> allocations;
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+/* Counts C allocations too, e.g. the strdup() behind get_parameters() */
+extern "C" void *malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+#else
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *ptr = malloc(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+#endif
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* One measured run of wrapper entry points */
+struct bench_run {
+    int64_t start_ns;
+    int64_t hal_start_ns;
+    uint64_t allocations_start;
+};
+
+static void bench_begin(struct bench_run *run)
+{
+    fake_audiohal_reset_counters();
+    run->allocations_start = allocations.load();
+    run->hal_start_ns = fake_audiohal_time_ns();
+    run->start_ns = now_ns();
+}
+
+static void bench_end(const struct bench_run *run, const char *name, uint64_t calls)
+{
+    int64_t elapsed_ns = now_ns() - run->start_ns;
+    int64_t hal_ns = fake_audiohal_time_ns() - run->hal_start_ns;
+    uint64_t allocs = allocations.load() - run->allocations_start;
+
+    /* HAL time spent on the wrapper's own threads overlaps the caller's */
+    if (hal_ns > elapsed_ns)
+        hal_ns = elapsed_ns;
+
+    printf("%-36s %9llu %12.0f %10.0f %8llu %10.3f\n", name,
+           (unsigned long long)calls,
+           elapsed_ns ? calls * 1e9 / elapsed_ns : 0.0,
+           calls ? (double)(elapsed_ns - hal_ns) / calls : 0.0,
+           (unsigned long long)fake_audiohal_calls(),
+           calls ? (double)allocs / calls : 0.0);
+}
+
+static struct audio_stream_out *open_output(struct audio_hw_device *dev,
+                                            audio_output_flags_t flags)
+{
+    struct audio_config config = {};
+    struct audio_stream_out *out = NULL;
+
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+
+    if (dev->open_output_stream(dev, 1, AUDIO_DEVICE_OUT_SPEAKER, flags, &config, &out, "")) {
+        fprintf(stderr, "open_output_stream failed\n");
+        exit(1);
+    }
+    return out;
+}
+
+static struct audio_stream_in *open_input(struct audio_hw_device *dev)
+{
+    struct audio_config config = {};
+    struct audio_stream_in *in = NULL;
+
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_IN_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+
+    if (dev->open_input_stream(dev, 2, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in,
+                               AUDIO_INPUT_FLAG_NONE, "", AUDIO_SOURCE_MIC)) {
+        fprintf(stderr, "open_input_stream failed\n");
+        exit(1);
+    }
+    return in;
+}
+
+/* write() plus the position and latency queries PulseAudio makes per period */
+static void bench_playback(struct audio_hw_device *dev, size_t period_frames, int iterations)
+{
+    struct audio_stream_out *out = open_output(dev, AUDIO_OUTPUT_FLAG_PRIMARY);
+    size_t frame_size = 4;
+    std::vector<char> buffer(period_frames * frame_size);
+    struct bench_run run;
+    char name[64];
+
+    /* Warm up so that one-time setup is not counted as steady state */
+    for (int i = 0; i < 16; i++)
+        out->write(out, buffer.data(), buffer.size());
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        uint64_t frames;
+        struct timespec timestamp;
+
+        out->write(out, buffer.data(), buffer.size());
+        out->get_presentation_position(out, &frames, &timestamp);
+        out->get_latency(out);
+        out->common.get_buffer_size(&out->common);
+    }
+    snprintf(name, sizeof(name), "playback %zu frames (4 calls)", period_frames);
+    bench_end(&run, name, (uint64_t)iterations * 4);
+
+    dev->close_output_stream(dev, out);
+}
+
+static void bench_capture(struct audio_hw_device *dev, size_t period_frames, int iterations)
+{
+    struct audio_stream_in *in = open_input(dev);
+    size_t frame_size = 4;
+    std::vector<char> buffer(period_frames * frame_size);
+    struct bench_run run;
+    char name[64];
+
+    for (int i = 0; i < 16; i++)
+        in->read(in, buffer.data(), buffer.size());
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        in->read(in, buffer.data(), buffer.size());
+        in->get_input_frames_lost(in);
+    }
+    snprintf(name, sizeof(name), "capture %zu frames (2 calls)", period_frames);
+    bench_end(&run, name, (uint64_t)iterations * 2);
+
+    dev->close_input_stream(dev, in);
+}
+
+/* 44.1 kHz mono float clients of the 48 kHz stereo 16 bit fake HAL */
+static void bench_conversion(struct audio_hw_device *dev, int iterations)
+{
+    struct audio_config config = {};
+    struct audio_stream_out *out = NULL;
+    struct audio_stream_in *in = NULL;
+    std::vector<float> buffer(441);
+    struct bench_run run;
+
+    config.sample_rate = 44100;
+    config.channel_mask = AUDIO_CHANNEL_OUT_MONO;
+    config.format = AUDIO_FORMAT_PCM_FLOAT;
+    if (dev->open_output_stream(dev, 1, AUDIO_DEVICE_OUT_SPEAKER, AUDIO_OUTPUT_FLAG_PRIMARY,
+                                &config, &out, "")) {
+        printf("%-36s skipped, conversion is disabled (-C)\n", "converted playback 441 frames");
+        return;
+    }
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++)
+        out->write(out, buffer.data(), buffer.size() * sizeof(float));
+    bench_end(&run, "converted playback 441 frames", iterations);
+
+    /* The HAL switching between 44.1 and 48 kHz every 100 writes */
+    int failed = 0;
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        if (i % 100 == 0)
+            out->common.set_parameters(&out->common, i % 200 ? "sampling_rate=48000" :
+                                                               "sampling_rate=44100");
+        if (out->write(out, buffer.data(), buffer.size() * sizeof(float)) !=
+            (ssize_t)(buffer.size() * sizeof(float)))
+            failed++;
+    }
+    bench_end(&run, "converted playback, HAL rate changes", iterations);
+    if (failed)
+        printf("%-36s %9d calls failed\n", "converted playback, rate changes", failed);
+    dev->close_output_stream(dev, out);
+
+    config.sample_rate = 44100;
+    config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    config.format = AUDIO_FORMAT_PCM_FLOAT;
+    if (dev->open_input_stream(dev, 2, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in,
+                               AUDIO_INPUT_FLAG_NONE, "", AUDIO_SOURCE_MIC))
+        return;
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++)
+        in->read(in, buffer.data(), buffer.size() * sizeof(float));
+    bench_end(&run, "converted capture 441 frames", iterations);
+    dev->close_input_stream(dev, in);
+}
+
+/* Speaker plus headphones, duplicated to two fake HAL streams if enabled */
+static void bench_duplicate(struct audio_hw_device *dev, int iterations)
+{
+    struct audio_config config = {};
+    struct audio_stream_out *out = NULL;
+    std::vector<char> buffer(480 * 4);
+    struct bench_run run;
+
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_output_stream(dev, 1, AUDIO_DEVICE_OUT_SPEAKER |
+                                AUDIO_DEVICE_OUT_WIRED_HEADPHONE, AUDIO_OUTPUT_FLAG_PRIMARY,
+                                &config, &out, "")) {
+        fprintf(stderr, "open_output_stream failed\n");
+        exit(1);
+    }
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        uint64_t frames;
+        struct timespec timestamp;
+
+        out->write(out, buffer.data(), buffer.size());
+        out->get_presentation_position(out, &frames, &timestamp);
+        out->get_latency(out);
+    }
+    bench_end(&run, "duplicated 480 frames (3 calls)", (uint64_t)iterations * 3);
+
+    dev->close_output_stream(dev, out);
+}
+
+/*
+ * Playback and capture on a HAL without stream volume, so that the wrapper
+ * scales every period; the volume changes every 50 periods, each change
+ * ramping over the next few.
+ */
+static void bench_soft_volume(struct audio_hw_device *dev, int iterations)
+{
+    std::vector<char> buffer(480 * 4);
+    struct bench_run run;
+
+    fake_audiohal_set_volume_supported(false);
+
+    struct audio_stream_out *out = open_output(dev, AUDIO_OUTPUT_FLAG_PRIMARY);
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        if (i % 50 == 0)
+            out->set_volume(out, (i / 50) & 1 ? 0.25f : 0.75f, 0.5f);
+        out->write(out, buffer.data(), buffer.size());
+    }
+    bench_end(&run, "soft volume playback 480 frames", iterations);
+    dev->close_output_stream(dev, out);
+
+    struct audio_stream_in *in = open_input(dev);
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        if (i % 50 == 0)
+            in->set_gain(in, (i / 50) & 1 ? 0.25f : 0.75f);
+        in->read(in, buffer.data(), buffer.size());
+    }
+    bench_end(&run, "soft gain capture 480 frames", iterations);
+    dev->close_input_stream(dev, in);
+
+    fake_audiohal_set_volume_supported(true);
+}
+
+/* Route and state churn as produced by PulseAudio's port switching */
+static void bench_parameters(struct audio_hw_device *dev, int iterations)
+{
+    struct audio_stream_out *out = open_output(dev, AUDIO_OUTPUT_FLAG_PRIMARY);
+    struct bench_run run;
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        out->common.set_parameters(&out->common, (i & 1) ? "routing=2" : "routing=4");
+        free(out->common.get_parameters(&out->common, "routing"));
+        dev->set_parameters(dev, "screen_state=on");
+        free(dev->get_parameters(dev, "screen_state"));
+    }
+    bench_end(&run, "parameter churn (4 calls)", (uint64_t)iterations * 4);
+
+    dev->close_output_stream(dev, out);
+}
+
+/* Speaker/headset switches of a playing output through audio patches */
+static void bench_patches(struct audio_hw_device *dev, int iterations)
+{
+    if (!dev->create_audio_patch)
+        return;
+
+    struct audio_stream_out *out = open_output(dev, AUDIO_OUTPUT_FLAG_PRIMARY);
+    struct audio_port_config source = {};
+    struct audio_port_config sink = {};
+    struct bench_run run;
+
+    source.role = AUDIO_PORT_ROLE_SOURCE;
+    source.type = AUDIO_PORT_TYPE_MIX;
+    source.ext.mix.handle = 1;
+    sink.role = AUDIO_PORT_ROLE_SINK;
+    sink.type = AUDIO_PORT_TYPE_DEVICE;
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        audio_patch_handle_t patch = AUDIO_PATCH_HANDLE_NONE;
+
+        sink.ext.device.type = (i & 1) ? AUDIO_DEVICE_OUT_WIRED_HEADSET : AUDIO_DEVICE_OUT_SPEAKER;
+        dev->create_audio_patch(dev, 1, &source, 1, &sink, &patch);
+        dev->release_audio_patch(dev, patch);
+    }
+    bench_end(&run, "route switch via patch (2 calls)", (uint64_t)iterations * 2);
+
+    dev->close_output_stream(dev, out);
+}
+
+static int32_t bench_effect_get_descriptor(effect_handle_t self, effect_descriptor_t *descriptor)
+{
+    memset(descriptor, 0, sizeof(*descriptor));
+    strcpy(descriptor->name, "bench effect");
+    return 0;
+}
+
+/* Configured for 48 kHz stereo, which the wrapper copies to the HAL's instance */
+static int32_t bench_effect_command(effect_handle_t self, uint32_t cmd, uint32_t size,
+                                    void *data, uint32_t *reply_size, void *reply)
+{
+    if (cmd != EFFECT_CMD_GET_CONFIG || *reply_size < sizeof(effect_config_t))
+        return -EINVAL;
+
+    effect_config_t *config = (effect_config_t *)reply;
+    memset(config, 0, sizeof(*config));
+    config->inputCfg.samplingRate = config->outputCfg.samplingRate = 48000;
+    config->inputCfg.channels = config->outputCfg.channels = AUDIO_CHANNEL_IN_STEREO;
+    *reply_size = sizeof(*config);
+    return 0;
+}
+
+/* Enabled, so the wrapper enables the HAL's instance too */
+static int32_t bench_effect_process(effect_handle_t self, audio_buffer_t *in,
+                                    audio_buffer_t *out)
+{
+    return 0;
+}
+
+/* A client-side effect, as PulseAudio would load from the effects library */
+static const struct effect_interface_s bench_effect_interface = {
+    bench_effect_process, bench_effect_command, bench_effect_get_descriptor, NULL,
+};
+
+/* Pre-processing attached and detached as capture use cases change */
+static void bench_effects(struct audio_hw_device *dev, int iterations)
+{
+    struct audio_stream_in *in = open_input(dev);
+    const struct effect_interface_s *itfe = &bench_effect_interface;
+    effect_handle_t effect = (effect_handle_t)&itfe;
+    struct bench_run run;
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        in->common.add_audio_effect(&in->common, effect);
+        in->common.remove_audio_effect(&in->common, effect);
+    }
+    bench_end(&run, "effect attach/detach (2 calls)", (uint64_t)iterations * 2);
+
+    dev->close_input_stream(dev, in);
+}
+
+/* Screen-off suspend of four outputs and two inputs, one by one and in bulk */
+static void bench_standby(struct audio_hw_device *dev, int iterations)
+{
+    struct audio_stream_out *outs[4];
+    struct audio_stream_in *ins[2];
+    struct bench_run run;
+
+    for (struct audio_stream_out *&out : outs)
+        out = open_output(dev, AUDIO_OUTPUT_FLAG_NONE);
+    for (struct audio_stream_in *&in : ins)
+        in = open_input(dev);
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        for (struct audio_stream_out *out : outs)
+            out->common.standby(&out->common);
+        for (struct audio_stream_in *in : ins)
+            in->common.standby(&in->common);
+    }
+    bench_end(&run, "standby 6 streams one by one", iterations);
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++)
+        dev->set_parameters(dev, "wrapper_standby_all=1");
+    bench_end(&run, "standby 6 streams in bulk", iterations);
+
+    for (struct audio_stream_out *out : outs)
+        dev->close_output_stream(dev, out);
+    for (struct audio_stream_in *in : ins)
+        dev->close_input_stream(dev, in);
+}
+
+/*
+ * A write() and a read() after the HAL service restarted, retried every
+ * millisecond like a client does until the reopened streams take them.
+ */
+static void bench_recovery(struct audio_hw_device *dev, int iterations)
+{
+    struct audio_stream_out *out = open_output(dev, AUDIO_OUTPUT_FLAG_PRIMARY);
+    struct audio_stream_in *in = open_input(dev);
+    std::vector<char> buffer(480 * 4);
+    struct bench_run run;
+    int failed = 0;
+
+    dev->set_master_volume(dev, 0.5f);
+    out->set_volume(out, 0.25f, 0.25f);
+    out->common.set_parameters(&out->common, "routing=2");
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        fake_audiohal_restart();
+        while (out->write(out, buffer.data(), buffer.size()) != (ssize_t)buffer.size()) {
+            failed++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        while (in->read(in, buffer.data(), buffer.size()) != (ssize_t)buffer.size()) {
+            failed++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    bench_end(&run, "recovery write+read (2 calls)", (uint64_t)iterations * 2);
+    printf("%-36s %9d calls failed while recovering\n", "recovery write+read", failed);
+
+    dev->close_output_stream(dev, out);
+    dev->close_input_stream(dev, in);
+}
+
+/*
+ * A routing change every 50 ms from another thread while a client plays
+ * 10 ms periods in real time, against a HAL holding each write for 5 ms
+ * and each control call for 10 ms behind one lock per stream. Prints the
+ * longest write() and set_parameters(), without and with the writer thread.
+ */
+static void bench_control(struct audio_hw_device *dev,
+                          const struct fake_audiohal_latency *latency, int iterations)
+{
+    static const struct fake_audiohal_latency slow = { 5000, 0, 10000 };
+    static const char *const modes[] = { "wrapper_async_write=0", "wrapper_async_write=1" };
+    std::vector<char> buffer(480 * 4);
+    int writes = std::max(iterations / 200, 10);
+
+    for (const char *mode : modes) {
+        struct audio_stream_out *out = open_output(dev, AUDIO_OUTPUT_FLAG_PRIMARY);
+        std::atomic<bool> playing{true};
+        int64_t longest_write = 0;
+        int64_t longest_control = 0;
+        int controls = 0;
+
+        out->common.set_parameters(&out->common, mode);
+        fake_audiohal_set_latency(&slow);
+
+        std::thread player([&] {
+            int64_t deadline = now_ns();
+
+            for (int i = 0; i < writes; i++) {
+                int64_t start = now_ns();
+                out->write(out, buffer.data(), buffer.size());
+                longest_write = std::max(longest_write, now_ns() - start);
+
+                deadline += 10000000;
+                struct timespec ts = { (time_t)(deadline / 1000000000LL),
+                                       (long)(deadline % 1000000000LL) };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            playing = false;
+        });
+
+        while (playing) {
+            struct timespec ts = { 0, 50000000 };
+            int64_t start = now_ns();
+
+            out->common.set_parameters(&out->common, controls++ & 1 ? "routing=2" : "routing=4");
+            longest_control = std::max(longest_control, now_ns() - start);
+            nanosleep(&ts, NULL);
+        }
+        player.join();
+
+        fake_audiohal_set_latency(latency);
+        printf("control calls, %-22s longest write %lld us, set_parameters %lld us\n",
+               strchr(mode, '1') ? "writer thread" : "blocking writes",
+               (long long)(longest_write / 1000), (long long)(longest_control / 1000));
+        dev->close_output_stream(dev, out);
+    }
+}
+
+static void bench_open_close(struct audio_hw_device *dev, int iterations)
+{
+    struct bench_run run;
+
+    bench_begin(&run);
+    for (int i = 0; i < iterations; i++) {
+        struct audio_stream_out *out = open_output(dev, AUDIO_OUTPUT_FLAG_PRIMARY);
+        dev->close_output_stream(dev, out);
+    }
+    bench_end(&run, "output open/close (2 calls)", (uint64_t)iterations * 2);
+}
+
+int main(int argc, char **argv)
+{
+    struct fake_audiohal_latency latency = {};
+    struct hw_device_t *device;
+    int iterations = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:r:c:C")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'w':
+            latency.write_us = atoi(optarg);
+            break;
+        case 'r':
+            latency.read_us = atoi(optarg);
+            break;
+        case 'c':
+            latency.control_us = atoi(optarg);
+            break;
+        case 'C':
+            property_set("persist.halium.audio_hw.convert", "1");
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-w write_us] [-r read_us] "
+                    "[-c control_us] [-C]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fake_audiohal_set_latency(&latency);
+
+    if (HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+                                                 AUDIO_HARDWARE_INTERFACE, &device)) {
+        fprintf(stderr, "cannot open the wrapper device\n");
+        return 1;
+    }
+
+    struct audio_hw_device *dev = (struct audio_hw_device *)device;
+
+    printf("injected latency: write %uus, read %uus, control %uus; %d iterations\n",
+           latency.write_us, latency.read_us, latency.control_us, iterations);
+    printf("ns/call is the time spent in the wrapper itself, outside the fake HAL\n");
+    printf("%-36s %9s %12s %10s %8s %10s\n", "scenario", "calls", "calls/s",
+           "ns/call", "HAL calls", "allocs/call");
+
+    static const size_t periods[] = { 96, 240, 480, 960 };
+    for (size_t period : periods)
+        bench_playback(dev, period, iterations);
+    for (size_t period : periods)
+        bench_capture(dev, period, iterations);
+    bench_conversion(dev, iterations);
+    bench_duplicate(dev, iterations);
+    bench_soft_volume(dev, iterations);
+    bench_parameters(dev, iterations);
+    bench_patches(dev, iterations);
+    bench_effects(dev, iterations);
+    bench_standby(dev, iterations / 10);
+    bench_recovery(dev, iterations / 100);
+    bench_control(dev, &latency, iterations);
+    bench_open_close(dev, iterations / 10);
+
+    device->close(device);
+    return 0;
+}
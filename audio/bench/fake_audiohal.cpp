@@ -0,0 +1,639 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "fake_audiohal"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <mutex>
+
+#include <log/log.h>
+
+#include <media/audiohal/DeviceHalInterface.h>
+#include <media/audiohal/DevicesFactoryHalInterface.h>
+#include <media/audiohal/EffectsFactoryHalInterface.h>
+#include <media/audiohal/StreamHalInterface.h>
+
+#include "fake_audiohal.h"
+
+using namespace android;
+
+static std::atomic<uint32_t> write_latency_us;
+static std::atomic<uint32_t> read_latency_us;
+static std::atomic<uint32_t> control_latency_us;
+static std::atomic<uint64_t> call_count;
+static std::atomic<int64_t> call_time_ns;
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void fake_audiohal_set_latency(const struct fake_audiohal_latency *latency)
+{
+    write_latency_us = latency->write_us;
+    read_latency_us = latency->read_us;
+    control_latency_us = latency->control_us;
+}
+
+uint64_t fake_audiohal_calls()
+{
+    return call_count.load();
+}
+
+int64_t fake_audiohal_time_ns()
+{
+    return call_time_ns.load();
+}
+
+void fake_audiohal_reset_counters()
+{
+    call_count = 0;
+    call_time_ns = 0;
+}
+
+/* Devices and streams of an older service than this one are dead */
+static std::atomic<uint32_t> service_generation{0};
+
+void fake_audiohal_restart()
+{
+    service_generation.fetch_add(1);
+}
+
+static std::atomic<bool> volume_supported{true};
+
+void fake_audiohal_set_volume_supported(bool supported)
+{
+    volume_supported = supported;
+}
+
+/* Answers like a libaudiohal proxy whose HAL service restarted */
+class FakeProxy {
+  protected:
+    bool dead() const
+    {
+        return mGeneration != service_generation.load(std::memory_order_relaxed);
+    }
+
+  private:
+    uint32_t mGeneration = service_generation.load(std::memory_order_relaxed);
+};
+
+/*
+ * Accounts one HAL call and holds it for the injected latency, inside the
+ * stream's lock if given: vendor HALs serialize a stream's data and
+ * control calls, so one waits for the other.
+ */
+class FakeCall {
+  public:
+    explicit FakeCall(const std::atomic<uint32_t>& latency_us, std::mutex *serial = nullptr)
+        : mStart(now_ns())
+    {
+        if (serial)
+            mLock = std::unique_lock<std::mutex>(*serial);
+
+        uint32_t us = latency_us.load(std::memory_order_relaxed);
+        if (us) {
+            struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    ~FakeCall()
+    {
+        call_count.fetch_add(1, std::memory_order_relaxed);
+        call_time_ns.fetch_add(now_ns() - mStart, std::memory_order_relaxed);
+    }
+
+  private:
+    int64_t mStart;
+    std::unique_lock<std::mutex> mLock;
+};
+
+#define FAKE_CONTROL_CALL() FakeCall call(control_latency_us)
+#define FAKE_SERIALIZED_CALL() FakeCall call(control_latency_us, &mSerial)
+
+/* Behaviour shared by fake output and input streams */
+class FakeStream : public virtual StreamHalInterface, protected FakeProxy {
+  public:
+    explicit FakeStream(const struct audio_config *config)
+        : mConfig(*config),
+          mSampleRate(config->sample_rate),
+          mFrameSize(audio_bytes_per_sample(config->format) *
+                     __builtin_popcount(config->channel_mask)) {}
+
+    status_t getBufferSize(size_t *size) override
+    {
+        FAKE_CONTROL_CALL();
+        /* 10 ms periods */
+        *size = mSampleRate / 100 * mFrameSize;
+        return OK;
+    }
+    status_t getSampleRate(uint32_t *rate) override
+    {
+        FAKE_CONTROL_CALL();
+        *rate = mSampleRate;
+        return OK;
+    }
+    status_t getChannelMask(audio_channel_mask_t *mask) override
+    {
+        FAKE_CONTROL_CALL();
+        *mask = mConfig.channel_mask;
+        return OK;
+    }
+    status_t getFormat(audio_format_t *format) override
+    {
+        FAKE_CONTROL_CALL();
+        *format = mConfig.format;
+        return OK;
+    }
+    status_t getAudioProperties(uint32_t *sampleRate, audio_channel_mask_t *mask,
+                                audio_format_t *format) override
+    {
+        FAKE_CONTROL_CALL();
+        *sampleRate = mSampleRate;
+        *mask = mConfig.channel_mask;
+        *format = mConfig.format;
+        return OK;
+    }
+    status_t setParameters(const String8& kvPairs) override
+    {
+        FAKE_SERIALIZED_CALL();
+        /* Like HALs that reconfigure a stream to the rate it is asked for */
+        const char *rate = strstr(kvPairs.c_str(), "sampling_rate=");
+        if (rate)
+            mSampleRate = strtoul(rate + strlen("sampling_rate="), NULL, 10);
+        return OK;
+    }
+    status_t getParameters(const String8& keys, String8 *values) override
+    {
+        FAKE_CONTROL_CALL();
+        values->setTo("");
+        return OK;
+    }
+    status_t getFrameSize(size_t *size) override
+    {
+        FAKE_CONTROL_CALL();
+        *size = mFrameSize;
+        return OK;
+    }
+    status_t addEffect(sp<EffectHalInterface> effect) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t removeEffect(sp<EffectHalInterface> effect) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t standby() override
+    {
+        FAKE_SERIALIZED_CALL();
+        return OK;
+    }
+    status_t dump(int fd) override
+    {
+        return OK;
+    }
+    status_t start() override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t stop() override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t createMmapBuffer(int32_t minSizeFrames,
+                              struct audio_mmap_buffer_info *info) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t getMmapPosition(struct audio_mmap_position *position) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t setHalThreadPriority(int priority) override
+    {
+        return OK;
+    }
+
+  protected:
+    struct audio_config mConfig;
+    std::atomic<uint32_t> mSampleRate;
+    size_t mFrameSize;
+    std::atomic<uint64_t> mFrames{0};
+    std::mutex mSerial;
+};
+
+class FakeStreamOut : public FakeStream, public StreamOutHalInterface {
+  public:
+    explicit FakeStreamOut(const struct audio_config *config) : FakeStream(config) {}
+
+    status_t getLatency(uint32_t *latency) override
+    {
+        FAKE_CONTROL_CALL();
+        *latency = 20;
+        return OK;
+    }
+    status_t setVolume(float left, float right) override
+    {
+        FAKE_SERIALIZED_CALL();
+        return volume_supported ? OK : INVALID_OPERATION;
+    }
+    status_t write(const void *buffer, size_t bytes, size_t *written) override
+    {
+        FakeCall call(write_latency_us, &mSerial);
+        if (dead())
+            return DEAD_OBJECT;
+        mFrames += bytes / mFrameSize;
+        *written = bytes;
+        return OK;
+    }
+    status_t getRenderPosition(uint32_t *dspFrames) override
+    {
+        FAKE_CONTROL_CALL();
+        *dspFrames = (uint32_t)mFrames.load();
+        return OK;
+    }
+    status_t getNextWriteTimestamp(int64_t *timestamp) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t setCallback(wp<StreamOutHalInterfaceCallback> callback) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t supportsPauseAndResume(bool *supportsPause, bool *supportsResume) override
+    {
+        *supportsPause = *supportsResume = false;
+        return OK;
+    }
+    status_t pause() override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t resume() override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t supportsDrain(bool *supportsDrain) override
+    {
+        *supportsDrain = false;
+        return OK;
+    }
+    status_t drain(bool earlyNotify) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t flush() override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t getPresentationPosition(uint64_t *frames, struct timespec *timestamp) override
+    {
+        FAKE_CONTROL_CALL();
+        *frames = mFrames.load();
+        clock_gettime(CLOCK_MONOTONIC, timestamp);
+        return OK;
+    }
+    status_t updateSourceMetadata(const SourceMetadata& sourceMetadata) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+};
+
+class FakeStreamIn : public FakeStream, public StreamInHalInterface {
+  public:
+    explicit FakeStreamIn(const struct audio_config *config) : FakeStream(config) {}
+
+    status_t setGain(float gain) override
+    {
+        FAKE_SERIALIZED_CALL();
+        return volume_supported ? OK : INVALID_OPERATION;
+    }
+    status_t read(void *buffer, size_t bytes, size_t *read) override
+    {
+        FakeCall call(read_latency_us, &mSerial);
+        if (dead())
+            return DEAD_OBJECT;
+        memset(buffer, 0, bytes);
+        mFrames += bytes / mFrameSize;
+        *read = bytes;
+        return OK;
+    }
+    status_t getInputFramesLost(uint32_t *framesLost) override
+    {
+        FAKE_CONTROL_CALL();
+        *framesLost = 0;
+        return OK;
+    }
+    status_t getCapturePosition(int64_t *frames, int64_t *time) override
+    {
+        FAKE_CONTROL_CALL();
+        *frames = (int64_t)mFrames.load();
+        *time = now_ns();
+        return OK;
+    }
+    status_t getActiveMicrophones(std::vector<media::MicrophoneInfo> *microphones) override
+    {
+        FAKE_CONTROL_CALL();
+        microphones->clear();
+        return OK;
+    }
+    status_t updateSinkMetadata(const SinkMetadata& sinkMetadata) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t setPreferredMicrophoneDirection(audio_microphone_direction_t direction) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t setPreferredMicrophoneFieldDimension(float zoom) override
+    {
+        return INVALID_OPERATION;
+    }
+};
+
+class FakeDevice : public DeviceHalInterface, protected FakeProxy {
+  public:
+    status_t getSupportedDevices(uint32_t *devices) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t initCheck() override
+    {
+        return dead() ? DEAD_OBJECT : OK;
+    }
+    status_t setVoiceVolume(float volume) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t setMasterVolume(float volume) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t getMasterVolume(float *volume) override
+    {
+        FAKE_CONTROL_CALL();
+        *volume = 1.0f;
+        return OK;
+    }
+    status_t setMode(audio_mode_t mode) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t setMicMute(bool state) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t getMicMute(bool *state) override
+    {
+        FAKE_CONTROL_CALL();
+        *state = false;
+        return OK;
+    }
+    status_t setMasterMute(bool state) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t getMasterMute(bool *state) override
+    {
+        FAKE_CONTROL_CALL();
+        *state = false;
+        return OK;
+    }
+    status_t setParameters(const String8& kvPairs) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t getParameters(const String8& keys, String8 *values) override
+    {
+        FAKE_CONTROL_CALL();
+        values->setTo("");
+        return OK;
+    }
+    status_t getInputBufferSize(const struct audio_config *config, size_t *size) override
+    {
+        FAKE_CONTROL_CALL();
+        *size = config->sample_rate / 100 * audio_bytes_per_sample(config->format) *
+                __builtin_popcount(config->channel_mask);
+        return OK;
+    }
+    status_t openOutputStream(audio_io_handle_t handle, audio_devices_t devices,
+                              audio_output_flags_t flags, struct audio_config *config,
+                              const char *address, sp<StreamOutHalInterface> *outStream) override
+    {
+        FAKE_CONTROL_CALL();
+        fillDefaultConfig(config, AUDIO_CHANNEL_OUT_STEREO);
+        if (!acceptConfig(config))
+            return BAD_VALUE;
+        *outStream = new FakeStreamOut(config);
+        return OK;
+    }
+    status_t openInputStream(audio_io_handle_t handle, audio_devices_t devices,
+                             struct audio_config *config, audio_input_flags_t flags,
+                             const char *address, audio_source_t source,
+                             audio_devices_t outputDevice, const char *outputDeviceAddress,
+                             sp<StreamInHalInterface> *inStream) override
+    {
+        FAKE_CONTROL_CALL();
+        fillDefaultConfig(config, AUDIO_CHANNEL_IN_STEREO);
+        if (!acceptConfig(config))
+            return BAD_VALUE;
+        *inStream = new FakeStreamIn(config);
+        return OK;
+    }
+    status_t supportsAudioPatches(bool *supportsPatches) override
+    {
+        *supportsPatches = true;
+        return OK;
+    }
+    status_t createAudioPatch(unsigned int num_sources, const struct audio_port_config *sources,
+                              unsigned int num_sinks, const struct audio_port_config *sinks,
+                              audio_patch_handle_t *patch) override
+    {
+        FAKE_CONTROL_CALL();
+        if (*patch == AUDIO_PATCH_HANDLE_NONE)
+            *patch = ++mLastPatch;
+        return OK;
+    }
+    status_t releaseAudioPatch(audio_patch_handle_t patch) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t getAudioPort(struct audio_port *port) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t setAudioPortConfig(const struct audio_port_config *config) override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t getMicrophones(std::vector<media::MicrophoneInfo> *microphones) override
+    {
+        microphones->clear();
+        return OK;
+    }
+    status_t dump(int fd) override
+    {
+        return OK;
+    }
+
+  private:
+    static void fillDefaultConfig(struct audio_config *config, audio_channel_mask_t mask)
+    {
+        if (!config->sample_rate)
+            config->sample_rate = 48000;
+        if (!config->channel_mask)
+            config->channel_mask = mask;
+        if (config->format == AUDIO_FORMAT_DEFAULT)
+            config->format = AUDIO_FORMAT_PCM_16_BIT;
+    }
+
+    /* Runs at 48 kHz only, like most primary HALs, and suggests it otherwise */
+    static bool acceptConfig(struct audio_config *config)
+    {
+        if (config->sample_rate == 48000)
+            return true;
+        config->sample_rate = 48000;
+        return false;
+    }
+
+    std::atomic<audio_patch_handle_t> mLastPatch{AUDIO_PATCH_HANDLE_NONE};
+};
+
+class FakeDevicesFactory : public DevicesFactoryHalInterface {
+  public:
+    status_t openDevice(const char *name, sp<DeviceHalInterface> *device) override
+    {
+        FAKE_CONTROL_CALL();
+        *device = new FakeDevice();
+        return OK;
+    }
+};
+
+// static
+sp<DevicesFactoryHalInterface> DevicesFactoryHalInterface::create()
+{
+    return new FakeDevicesFactory();
+}
+
+class FakeEffect : public EffectHalInterface {
+  public:
+    status_t setInBuffer(const sp<EffectBufferHalInterface>& buffer) override
+    {
+        return OK;
+    }
+    status_t setOutBuffer(const sp<EffectBufferHalInterface>& buffer) override
+    {
+        return OK;
+    }
+    status_t process() override
+    {
+        return OK;
+    }
+    status_t processReverse() override
+    {
+        return OK;
+    }
+    status_t command(uint32_t cmdCode, uint32_t cmdSize, void *pCmdData,
+                     uint32_t *replySize, void *pReplyData) override
+    {
+        FAKE_CONTROL_CALL();
+        if (replySize && *replySize >= sizeof(int32_t) && pReplyData)
+            *(int32_t *)pReplyData = 0;
+        return OK;
+    }
+    status_t getDescriptor(effect_descriptor_t *pDescriptor) override
+    {
+        memset(pDescriptor, 0, sizeof(*pDescriptor));
+        return OK;
+    }
+    status_t close() override
+    {
+        FAKE_CONTROL_CALL();
+        return OK;
+    }
+    status_t dump(int fd) override
+    {
+        return OK;
+    }
+    uint64_t effectId() const override
+    {
+        return 0;
+    }
+};
+
+class FakeEffectsFactory : public EffectsFactoryHalInterface {
+  public:
+    status_t queryNumberEffects(uint32_t *pNumEffects) override
+    {
+        *pNumEffects = 0;
+        return OK;
+    }
+    status_t getDescriptor(uint32_t index, effect_descriptor_t *pDescriptor) override
+    {
+        return NAME_NOT_FOUND;
+    }
+    status_t getDescriptor(const effect_uuid_t *pEffectUuid,
+                           effect_descriptor_t *pDescriptor) override
+    {
+        return NAME_NOT_FOUND;
+    }
+    status_t createEffect(const effect_uuid_t *pEffectUuid, int32_t sessionId, int32_t ioId,
+                          sp<EffectHalInterface> *effect) override
+    {
+        FAKE_CONTROL_CALL();
+        *effect = new FakeEffect();
+        return OK;
+    }
+    status_t dumpEffects(int fd) override
+    {
+        return OK;
+    }
+    status_t allocateBuffer(size_t size, sp<EffectBufferHalInterface>* buffer) override
+    {
+        return INVALID_OPERATION;
+    }
+    status_t mirrorBuffer(void* external, size_t size,
+                          sp<EffectBufferHalInterface>* buffer) override
+    {
+        return INVALID_OPERATION;
+    }
+};
+
+// static
+sp<EffectsFactoryHalInterface> EffectsFactoryHalInterface::create()
+{
+    return new FakeEffectsFactory();
+}
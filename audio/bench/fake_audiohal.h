@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_AUDIOHAL_H
+#define FAKE_AUDIOHAL_H
+
+#include <stdint.h>
+
+/*
+ * In-process stand-in for libaudiohal: DevicesFactoryHalInterface::create()
+ * returns a factory whose devices and streams answer immediately, after an
+ * optional injected delay that models the binder and HAL cost of a call.
+ */
+
+struct fake_audiohal_latency {
+    uint32_t write_us;      /* StreamOutHalInterface::write() */
+    uint32_t read_us;       /* StreamInHalInterface::read() */
+    uint32_t control_us;    /* every other device and stream call */
+};
+
+void fake_audiohal_set_latency(const struct fake_audiohal_latency *latency);
+
+/* Calls made into the fake HAL, and the time spent inside them */
+uint64_t fake_audiohal_calls();
+int64_t fake_audiohal_time_ns();
+void fake_audiohal_reset_counters();
+
+/* Kills every device and stream opened so far, as a HAL service restart does */
+void fake_audiohal_restart();
+
+/* Without it setVolume() and setGain() fail as on HALs lacking stream volume */
+void fake_audiohal_set_volume_supported(bool supported);
+
+#endif // FAKE_AUDIOHAL_H
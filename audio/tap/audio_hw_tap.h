@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_HW_TAP_H
+#define AUDIO_HW_TAP_H
+
+#include <stdint.h>
+
+/*
+ * Layout of a PCM tap file: a header, then a ring holding the most recent
+ * records. Each record is a wrapper_tap_record followed by the PCM that
+ * crossed the wrapper in one write() or read(), padded to 8 bytes. Records
+ * wrap around the end of the ring byte by byte.
+ */
+
+#define WRAPPER_TAP_MAGIC 0x50415457            /* "WTAP" */
+#define WRAPPER_TAP_RECORD_MAGIC 0x44434552     /* "RECD" */
+#define WRAPPER_TAP_VERSION 1
+#define WRAPPER_TAP_ALIGN 8
+
+enum wrapper_tap_direction {
+    WRAPPER_TAP_OUTPUT,
+    WRAPPER_TAP_INPUT,
+};
+
+struct wrapper_tap_header {
+    uint32_t magic;
+    uint32_t version;
+    /* Offset of the ring from the start of the file */
+    uint32_t header_size;
+    uint32_t direction;
+    uint64_t ring_size;
+    /* The client's side of the stream */
+    uint32_t sample_rate;
+    uint32_t channel_mask;
+    uint32_t format;
+    uint32_t frame_size;
+    uint32_t channels;
+    uint32_t reserved;
+    /*
+     * Bytes ever written to the ring, published after each record; the
+     * ring holds the last ring_size of them.
+     */
+    uint64_t write_pos;
+    uint64_t records;
+};
+
+struct wrapper_tap_record {
+    uint32_t magic;
+    /* PCM bytes following this header, before padding */
+    uint32_t size;
+    /* CLOCK_MONOTONIC when the HAL call returned */
+    int64_t time_ns;
+    /* What write() or read() returned: bytes, or a negative status */
+    int64_t result;
+    /* Frames that crossed the wrapper before this call */
+    uint64_t position;
+};
+
+#endif // AUDIO_HW_TAP_H
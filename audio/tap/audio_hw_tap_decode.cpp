@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decodes a PCM tap file pulled from a device: prints one line per
+ * recorded write() or read(), and writes the PCM out as a WAV file.
+ *
+ * usage: audio_hw_tap_decode <tap file> [output.wav]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <system/audio.h>
+
+#include "audio_hw_tap.h"
+
+static bool read_file(const char *path, std::vector<uint8_t> *data)
+{
+    FILE *file = fopen(path, "rb");
+    uint8_t buffer[65536];
+    size_t count;
+
+    if (!file)
+        return false;
+
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data->insert(data->end(), buffer, buffer + count);
+
+    fclose(file);
+    return true;
+}
+
+/* Copies size bytes out of the ring starting at byte pos of the stream */
+static void ring_copy(const uint8_t *ring, uint64_t ring_size, uint64_t pos, void *data,
+                      size_t size)
+{
+    size_t offset = pos % ring_size;
+    size_t first = size < ring_size - offset ? size : ring_size - offset;
+
+    memcpy(data, ring + offset, first);
+    if (first < size)
+        memcpy((uint8_t *)data + first, ring, size - first);
+}
+
+static void put_le(FILE *file, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        fputc((value >> (8 * i)) & 0xff, file);
+}
+
+/* WAV tag and bits per sample for the stream's format; false if not PCM */
+static bool wav_format(uint32_t format, uint32_t *tag, uint32_t *bits)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        *tag = 1;
+        *bits = 16;
+        return true;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+        *tag = 1;
+        *bits = 24;
+        return true;
+    case AUDIO_FORMAT_PCM_32_BIT:
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        *tag = 1;
+        *bits = 32;
+        return true;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        *tag = 3;
+        *bits = 32;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void wav_write_header(FILE *file, const struct wrapper_tap_header *header,
+                             uint32_t tag, uint32_t bits, uint32_t data_size)
+{
+    uint32_t block_align = header->channels * bits / 8;
+
+    fwrite("RIFF", 1, 4, file);
+    put_le(file, 36 + data_size, 4);
+    fwrite("WAVEfmt ", 1, 8, file);
+    put_le(file, 16, 4);
+    put_le(file, tag, 2);
+    put_le(file, header->channels, 2);
+    put_le(file, header->sample_rate, 4);
+    put_le(file, header->sample_rate * block_align, 4);
+    put_le(file, block_align, 2);
+    put_le(file, bits, 2);
+    fwrite("data", 1, 4, file);
+    put_le(file, data_size, 4);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> pcm;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <tap file> [output.wav]\n", argv[0]);
+        return 1;
+    }
+
+    if (!read_file(argv[1], &data)) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    struct wrapper_tap_header header;
+    if (data.size() < sizeof(header)) {
+        fprintf(stderr, "%s: too short for a tap file\n", argv[1]);
+        return 1;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+
+    if (header.magic != WRAPPER_TAP_MAGIC || header.version != WRAPPER_TAP_VERSION ||
+        header.ring_size == 0 || data.size() < header.header_size + header.ring_size) {
+        fprintf(stderr, "%s: not a version %d tap file\n", argv[1], WRAPPER_TAP_VERSION);
+        return 1;
+    }
+
+    const uint8_t *ring = data.data() + header.header_size;
+    uint64_t end = header.write_pos;
+    uint64_t pos = end > header.ring_size ? end - header.ring_size : 0;
+    uint64_t skipped = 0;
+    uint64_t records = 0;
+    uint64_t errors = 0;
+    int64_t first_ns = 0;
+    int64_t last_ns = 0;
+
+    printf("%s stream: rate %u, channel mask %#x, format %#x, frame size %u\n",
+           header.direction == WRAPPER_TAP_INPUT ? "input" : "output", header.sample_rate,
+           header.channel_mask, header.format, header.frame_size);
+    printf("%14s %10s %10s %12s\n", "time (ms)", "delta (us)", "result", "position");
+
+    /* The oldest record may have been partly overwritten: resync on the next magic */
+    pos = (pos + WRAPPER_TAP_ALIGN - 1) & ~(uint64_t)(WRAPPER_TAP_ALIGN - 1);
+    while (pos + sizeof(struct wrapper_tap_record) <= end) {
+        struct wrapper_tap_record record;
+
+        ring_copy(ring, header.ring_size, pos, &record, sizeof(record));
+        if (record.magic != WRAPPER_TAP_RECORD_MAGIC ||
+            pos + sizeof(record) + record.size > end) {
+            pos += WRAPPER_TAP_ALIGN;
+            skipped += WRAPPER_TAP_ALIGN;
+            continue;
+        }
+
+        if (!records)
+            first_ns = record.time_ns;
+        printf("%14.3f %10lld %10lld %12llu\n", (record.time_ns - first_ns) / 1e6,
+               records ? (long long)(record.time_ns - last_ns) / 1000 : 0LL,
+               (long long)record.result, (unsigned long long)record.position);
+
+        size_t offset = pcm.size();
+        pcm.resize(offset + record.size);
+        ring_copy(ring, header.ring_size, pos + sizeof(record), pcm.data() + offset,
+                  record.size);
+
+        if (record.result < 0)
+            errors++;
+        records++;
+        last_ns = record.time_ns;
+        pos += (sizeof(record) + record.size + WRAPPER_TAP_ALIGN - 1) &
+               ~(uint64_t)(WRAPPER_TAP_ALIGN - 1);
+    }
+
+    printf("%llu of %llu records in the ring, %llu errors, %zu PCM bytes, "
+           "%llu bytes skipped\n", (unsigned long long)records,
+           (unsigned long long)header.records, (unsigned long long)errors, pcm.size(),
+           (unsigned long long)skipped);
+
+    if (argc < 3)
+        return 0;
+
+    FILE *file = fopen(argv[2], "wb");
+    if (!file) {
+        fprintf(stderr, "cannot write %s\n", argv[2]);
+        return 1;
+    }
+
+    uint32_t tag;
+    uint32_t bits;
+    if (wav_format(header.format, &tag, &bits) && header.channels)
+        wav_write_header(file, &header, tag, bits, pcm.size());
+    else
+        fprintf(stderr, "format %#x is not PCM, writing raw data\n", header.format);
+
+    fwrite(pcm.data(), 1, pcm.size(), file);
+    fclose(file);
+    return 0;
+}
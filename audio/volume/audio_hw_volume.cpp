@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define VOLUME_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VOLUME_SSE2 1
+#endif
+
+#include "audio_hw_volume.h"
+
+/*
+ * The vector loops take 4 samples per register, so they only cover layouts
+ * where a register holds whole frames (1, 2 or 4 channels): lane l is
+ * channel l % channels of frame l / channels. Other layouts, and the tail
+ * of a buffer, go through the scalar loops.
+ */
+
+static inline bool vector_layout(uint32_t channels)
+{
+    return channels == 1 || channels == 2 || channels == 4;
+}
+
+/* Gains of the 4 lanes of the first register, and their advance per register */
+static inline void vector_gains(uint32_t channels, const float *gain, const float *step,
+                                float *lanes, float *delta)
+{
+    for (int l = 0; l < 4; l++) {
+        uint32_t c = l % channels;
+
+        lanes[l] = gain[c] + step[c] * (float)(l / channels);
+        delta[l] = step[c] * (float)(4 / channels);
+    }
+}
+
+/* Moves gain[] past the frames of the samples done by a vector loop */
+static inline void vector_advance(uint32_t channels, size_t samples, float *gain,
+                                  const float *step)
+{
+    size_t frames = samples / channels;
+
+    for (uint32_t c = 0; c < channels; c++)
+        gain[c] += step[c] * (float)frames;
+}
+
+static inline int16_t clamp16(long value)
+{
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+}
+
+static inline int32_t clamp32(long long value)
+{
+    return value > INT32_MAX ? INT32_MAX : value < INT32_MIN ? INT32_MIN : (int32_t)value;
+}
+
+/** Scalar **/
+
+static void scale_i16_scalar(int16_t *dst, const int16_t *src, size_t frames,
+                             uint32_t channels, float *gain, const float *step)
+{
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            *dst++ = clamp16(lrintf(*src++ * gain[c]));
+            gain[c] += step[c];
+        }
+    }
+}
+
+static void scale_i32_scalar(int32_t *dst, const int32_t *src, size_t frames,
+                             uint32_t channels, float *gain, const float *step)
+{
+    /* float only has 24 bits of mantissa, double keeps the whole sample */
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            *dst++ = clamp32(llrint(*src++ * (double)gain[c]));
+            gain[c] += step[c];
+        }
+    }
+}
+
+static void scale_float_scalar(float *dst, const float *src, size_t frames,
+                               uint32_t channels, float *gain, const float *step)
+{
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            *dst++ = *src++ * gain[c];
+            gain[c] += step[c];
+        }
+    }
+}
+
+/** NEON **/
+
+#if VOLUME_NEON
+
+static inline int32x4_t neon_round(float32x4_t value)
+{
+#if defined(__aarch64__)
+    return vcvtnq_s32_f32(value);
+#else
+    /* ARMv7 only truncates: add a half carrying the sign of the value */
+    uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(value), vdupq_n_u32(0x80000000));
+    float32x4_t half = vreinterpretq_f32_u32(
+            vorrq_u32(sign, vreinterpretq_u32_f32(vdupq_n_f32(0.5f))));
+
+    return vcvtq_s32_f32(vaddq_f32(value, half));
+#endif
+}
+
+static size_t scale_i16_vector(int16_t *dst, const int16_t *src, size_t samples,
+                               uint32_t channels, const float *gain, const float *step)
+{
+    float lanes[4];
+    float delta[4];
+    size_t i;
+
+    vector_gains(channels, gain, step, lanes, delta);
+    float32x4_t d = vld1q_f32(delta);
+    float32x4_t d2 = vaddq_f32(d, d);
+    float32x4_t g0 = vld1q_f32(lanes);
+    float32x4_t g1 = vaddq_f32(g0, d);
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+        int16x8_t x = vld1q_s16(src + i);
+        float32x4_t lo = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), g0);
+        float32x4_t hi = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), g1);
+
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(neon_round(lo)),
+                                        vqmovn_s32(neon_round(hi))));
+        g0 = vaddq_f32(g0, d2);
+        g1 = vaddq_f32(g1, d2);
+    }
+    return i;
+}
+
+static size_t scale_i32_vector(int32_t *dst, const int32_t *src, size_t samples,
+                               uint32_t channels, const float *gain, const float *step)
+{
+    float lanes[4];
+    float delta[4];
+    size_t i;
+
+    vector_gains(channels, gain, step, lanes, delta);
+    float32x4_t d = vld1q_f32(delta);
+    float32x4_t g = vld1q_f32(lanes);
+
+    /* Q31 gains: a gain of 1 saturates to 0x7fffffff, one LSB short of unity */
+    for (i = 0; i + 4 <= samples; i += 4) {
+        vst1q_s32(dst + i, vqrdmulhq_s32(vld1q_s32(src + i), vcvtq_n_s32_f32(g, 31)));
+        g = vaddq_f32(g, d);
+    }
+    return i;
+}
+
+static size_t scale_float_vector(float *dst, const float *src, size_t samples,
+                                 uint32_t channels, const float *gain, const float *step)
+{
+    float lanes[4];
+    float delta[4];
+    size_t i;
+
+    vector_gains(channels, gain, step, lanes, delta);
+    float32x4_t d = vld1q_f32(delta);
+    float32x4_t g = vld1q_f32(lanes);
+
+    for (i = 0; i + 4 <= samples; i += 4) {
+        vst1q_f32(dst + i, vmulq_f32(vld1q_f32(src + i), g));
+        g = vaddq_f32(g, d);
+    }
+    return i;
+}
+
+/** SSE2 **/
+
+#elif VOLUME_SSE2
+
+static size_t scale_i16_vector(int16_t *dst, const int16_t *src, size_t samples,
+                               uint32_t channels, const float *gain, const float *step)
+{
+    float lanes[4];
+    float delta[4];
+    size_t i;
+
+    vector_gains(channels, gain, step, lanes, delta);
+    __m128 d = _mm_loadu_ps(delta);
+    __m128 d2 = _mm_add_ps(d, d);
+    __m128 g0 = _mm_loadu_ps(lanes);
+    __m128 g1 = _mm_add_ps(g0, d);
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        /* Sign extension without SSE4.1: the sample in the high half, shifted down */
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+
+        lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), g0));
+        hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), g1));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+        g0 = _mm_add_ps(g0, d2);
+        g1 = _mm_add_ps(g1, d2);
+    }
+    return i;
+}
+
+static size_t scale_i32_vector(int32_t *dst, const int32_t *src, size_t samples,
+                               uint32_t channels, const float *gain, const float *step)
+{
+    float lanes[4];
+    float delta[4];
+    size_t i;
+
+    vector_gains(channels, gain, step, lanes, delta);
+    __m128 d = _mm_loadu_ps(delta);
+    __m128 g = _mm_loadu_ps(lanes);
+
+    /* SSE2 has no signed 32 bit multiply: scale pairs of samples as doubles */
+    for (i = 0; i + 4 <= samples; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128d lo = _mm_mul_pd(_mm_cvtepi32_pd(x), _mm_cvtps_pd(g));
+        __m128d hi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(x, 0xee)),
+                                _mm_cvtps_pd(_mm_movehl_ps(g, g)));
+
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_unpacklo_epi64(_mm_cvtpd_epi32(lo), _mm_cvtpd_epi32(hi)));
+        g = _mm_add_ps(g, d);
+    }
+    return i;
+}
+
+static size_t scale_float_vector(float *dst, const float *src, size_t samples,
+                                 uint32_t channels, const float *gain, const float *step)
+{
+    float lanes[4];
+    float delta[4];
+    size_t i;
+
+    vector_gains(channels, gain, step, lanes, delta);
+    __m128 d = _mm_loadu_ps(delta);
+    __m128 g = _mm_loadu_ps(lanes);
+
+    for (i = 0; i + 4 <= samples; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+        g = _mm_add_ps(g, d);
+    }
+    return i;
+}
+
+#endif
+
+/** Dispatch **/
+
+#if VOLUME_NEON || VOLUME_SSE2
+#define VOLUME_SCALE(type, name)                                                       \
+    do {                                                                               \
+        type *d = (type *)dst;                                                         \
+        const type *s = (const type *)src;                                             \
+        size_t done = 0;                                                               \
+        if (vector_layout(channels)) {                                                 \
+            done = scale_##name##_vector(d, s, frames * channels, channels, gain, step); \
+            vector_advance(channels, done, gain, step);                                \
+        }                                                                              \
+        scale_##name##_scalar(d + done, s + done, frames - done / channels, channels,  \
+                              gain, step);                                             \
+    } while (0)
+#else
+#define VOLUME_SCALE(type, name) \
+    scale_##name##_scalar((type *)dst, (const type *)src, frames, channels, gain, step)
+#endif
+
+bool volume_format_supported(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+    case AUDIO_FORMAT_PCM_32_BIT:
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void volume_apply(audio_format_t format, void *dst, const void *src, size_t frames,
+                  uint32_t channels, float *gain, const float *step)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        VOLUME_SCALE(int16_t, i16);
+        break;
+    case AUDIO_FORMAT_PCM_32_BIT:
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        VOLUME_SCALE(int32_t, i32);
+        break;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        VOLUME_SCALE(float, float);
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_HW_VOLUME_H
+#define AUDIO_HW_VOLUME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+/*
+ * Gain kernels of the wrapper's software volume, for HALs without stream
+ * volume or gain. Interleaved 16 bit, 32 bit (and 8.24) and float PCM is
+ * scaled with NEON or SSE2 where the target has it, and scalar code
+ * elsewhere. Gains are within [0, 1].
+ */
+
+#define VOLUME_MAX_CHANNELS 8
+
+bool volume_format_supported(audio_format_t format);
+
+/*
+ * dst = src * gain, channel c of each frame scaled by gain[c], which is
+ * then advanced by step[c]: a step of 0 is a constant gain, any other a
+ * linear ramp. On return gain[] holds the gains of the next frame. dst may
+ * be src.
+ */
+void volume_apply(audio_format_t format, void *dst, const void *src, size_t frames,
+                  uint32_t channels, float *gain, const float *step);
+
+#endif // AUDIO_HW_VOLUME_H